@@ -15,36 +15,674 @@ typedef loff_t file_offset_t;
 #else
 #include <stdint.h>
 #include <sys/types.h>
+#include <linux/types.h>
 typedef int64_t file_offset_t;
 #endif
 
 #define MAX_PCIE_DEVICES 16
 
+/*
+ * One PCIe device found while walking up from a block device
+ */
+struct file_to_pcie_device_info {
+    unsigned short vendor_id;
+    unsigned short device_id;
+    unsigned char bus;
+    unsigned char device;
+    unsigned char function;
+    char name[64];
+    /*
+     * File offset range on this PCIe device. For a member of a striped
+     * device this is the first and last byte it holds, with the other
+     * members' chunks in between: its share is the sector range.
+     */
+    file_offset_t file_offset_start;
+    file_offset_t file_offset_end;
+    /* Block device sector range (for reference) */
+    file_offset_t sector_start;
+    file_offset_t sector_end;
+};
+
 struct file_to_pcie_request {
     int fd;
     file_offset_t offset;
     size_t length;
     int pcie_count;
-    struct {
-        unsigned short vendor_id;
-        unsigned short device_id;
-        unsigned char bus;
-        unsigned char device;
-        unsigned char function;
-        char name[64];
-        /* File offset range on this PCIe device */
-        file_offset_t file_offset_start;
-        file_offset_t file_offset_end;
-        /* Block device sector range (for reference) */
-        file_offset_t sector_start;
-        file_offset_t sector_end;
-    } pcie_devices[MAX_PCIE_DEVICES];
+    struct file_to_pcie_device_info pcie_devices[MAX_PCIE_DEVICES];
+};
+
+/*
+ * Batched queries: resolve many (fd, offset, length) segments in
+ * a single ioctl. Segments sharing an fd or a block device are only
+ * resolved once per batch.
+ */
+#define FILE_TO_PCIE_SEGMENT_F_FIXED 0x1  /* fd is a registered index */
+
+struct file_to_pcie_segment {
+    int fd;
+    __u32 flags;            /* FILE_TO_PCIE_SEGMENT_F_* */
+    file_offset_t offset;
+    __u64 length;
+};
+
+struct file_to_pcie_segment_result {
+    int status;             /* 0 on success, negative errno on failure */
+    int pcie_count;
+    struct file_to_pcie_device_info pcie_devices[MAX_PCIE_DEVICES];
+};
+
+/*
+ * The batch takes FILE_TO_PCIE_QUERY_F_ENDPOINT, _TOPOLOGY and
+ * _NO_NAMES in flags. With any of them set, only the first pcie_count
+ * entries of each result are written; the rest are left as they were.
+ */
+struct file_to_pcie_batch {
+    __u64 segments;         /* User pointer to segment array */
+    __u64 results;          /* User pointer to result array */
+    __u32 count;            /* Number of segments (and results) */
+    __u32 completed;        /* Out: number of results written */
+    __u32 flags;            /* FILE_TO_PCIE_QUERY_F_* */
+    __u32 reserved;
+};
+
+/*
+ * Extent-mapped queries: one record per physical extent of a file
+ * segment, clipped to the segment. flags carries the FIEMAP_EXTENT_*
+ * bits from <linux/fiemap.h> (UNWRITTEN, DELALLOC, DATA_INLINE,
+ * SHARED, ...). sector_start/sector_end are -1 when the filesystem
+ * cannot report a physical location (e.g. delayed allocation).
+ * Adjacent extents on the same device that are also contiguous on it
+ * are merged into one record.
+ *
+ * Records must stay at least as large as struct fiemap_extent: the
+ * result buffer is also used as the filesystem's fiemap scratch space.
+ */
+#define FILE_TO_PCIE_EXTENT_F_SYNC   0x1  /* Flush dirty data first */
+#define FILE_TO_PCIE_EXTENT_F_FIXED  0x2  /* fd is a registered index */
+#define FILE_TO_PCIE_EXTENT_F_RESUME 0x4  /* Continue from cursor */
+#define FILE_TO_PCIE_EXTENT_F_ZONES  0x8  /* Report zoned layout */
+
+struct file_to_pcie_extent {
+    file_offset_t logical;      /* Byte offset in the file */
+    file_offset_t physical;     /* Byte offset on the block device */
+    __u64 length;               /* Length in bytes */
+    file_offset_t sector_start;
+    file_offset_t sector_end;
+    __u32 flags;                /* FIEMAP_EXTENT_* */
+    __u32 dev_major;            /* Block device holding the extent */
+    __u32 dev_minor;
+    /* With FILE_TO_PCIE_EXTENT_F_ZONES: its zones in the zone array */
+    __u32 zone_index;
+    __u32 zone_count;           /* 0 unless on a zoned device */
+    __u32 reserved;
+};
+
+/*
+ * Zones of a zoned block device (ZNS NVMe, SMR) holding extents,
+ * with FILE_TO_PCIE_EXTENT_F_ZONES. Sectors are 512 bytes on the
+ * zoned device, like the extent records. type and cond are the
+ * BLK_ZONE_TYPE_* and BLK_ZONE_COND_* values of <linux/blkzoned.h>.
+ * The write pointer is only meaningful for sequential zones that
+ * are not full, read-only or offline.
+ */
+#define FILE_TO_PCIE_ZONE_F_ENDPOINT 0x1  /* domain/bus/devfn are valid */
+
+struct file_to_pcie_zone {
+    __u64 start;                /* First sector */
+    __u64 len;                  /* Size in sectors */
+    __u64 capacity;             /* Writable sectors, at most len */
+    __u64 wp;                   /* Write pointer sector */
+    __u32 dev_major;            /* Zoned block device */
+    __u32 dev_minor;
+    __u32 domain;               /* PCIe endpoint owning the zone */
+    __u8 bus;
+    __u8 devfn;
+    __u8 type;                  /* BLK_ZONE_TYPE_* */
+    __u8 cond;                  /* BLK_ZONE_COND_* */
+    __u32 flags;                /* FILE_TO_PCIE_ZONE_F_* */
+    __u32 reserved;
+};
+
+/*
+ * Where a segment's mapping continues. Large segments (or a block
+ * device's whole range on a striped array) can need more records than
+ * fit in one buffer: pass the same offset and length again with
+ * FILE_TO_PCIE_EXTENT_F_RESUME and the cursor from the previous call,
+ * until cursor.offset reaches offset + length. Records are never split
+ * across calls. A cursor from an older topology generation fails with
+ * -ESTALE; the file's own extents are not versioned, so a file
+ * rewritten between calls is mapped as it is now.
+ */
+struct file_to_pcie_cursor {
+    file_offset_t offset;       /* Next file offset to map */
+    __u64 generation;           /* Topology generation of the mapping */
+};
+
+#define FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V1 40
+#define FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V2 56 /* + cursor */
+#define FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V3 80 /* + zones */
+
+/*
+ * Extensible like the compact requests below: the kernel takes the
+ * size from the ioctl number
+ */
+struct file_to_pcie_extent_request {
+    int fd;
+    __u32 flags;                /* FILE_TO_PCIE_EXTENT_F_* */
+    file_offset_t offset;
+    __u64 length;
+    __u64 extents;              /* User pointer to extent array */
+    __u32 extent_capacity;      /* Entries available at extents */
+    __u32 extent_count;         /* Out: entries written */
+    struct file_to_pcie_cursor cursor; /* In with _F_RESUME, and out */
+    /*
+     * With FILE_TO_PCIE_EXTENT_F_ZONES. Records that share a zone
+     * share its entry. If zones_needed exceeds zone_capacity, the
+     * records still hold the indices the zones would have had.
+     */
+    __u64 zones;                /* User pointer to zone array */
+    __u32 zone_capacity;        /* Entries available at zones */
+    __u32 zone_count;           /* Out: entries written */
+    __u32 zones_needed;         /* Out: entries the records refer to */
+    __u32 reserved;
+};
+
+/*
+ * Compact (v2) queries. Devices are returned as packed fixed-size
+ * records in a caller-supplied buffer, with a numeric PCI address
+ * instead of a name, and the kernel reports how many records the
+ * full answer needs. There is no limit on the number of devices.
+ *
+ * Set record_size to sizeof(struct file_to_pcie_dev_record): records
+ * are written with that stride, so binaries built against older or
+ * newer versions of this header keep working (fields unknown to the
+ * kernel are zeroed, fields unknown to the caller are dropped). The
+ * request structs themselves are extensible the same way: the kernel
+ * takes their size from the ioctl number.
+ */
+#define FILE_TO_PCIE_DEV_RECORD_SIZE_V1 56
+#define FILE_TO_PCIE_DEV_RECORD_SIZE_V2 64  /* + local CPUs */
+#define FILE_TO_PCIE_DEV_RECORD_SIZE_V3 80  /* + PCIe link */
+#define FILE_TO_PCIE_DEV_RECORD_SIZE_V4 88  /* + NVMe multipath */
+#define FILE_TO_PCIE_DEV_RECORD_SIZE_V5 120 /* + queue limits */
+#define FILE_TO_PCIE_DEV_RECORD_SIZE_V6 144 /* + queue load */
+#define FILE_TO_PCIE_QUERY_SIZE_V1 48
+#define FILE_TO_PCIE_QUERY_SIZE_V2 96       /* + page-cache ranges */
+#define FILE_TO_PCIE_QUERY_SIZE_V3 104      /* + generation */
+#define FILE_TO_PCIE_QUERY_BATCH_SIZE_V1 48
+#define FILE_TO_PCIE_QUERY_BATCH_SIZE_V2 72 /* + generation */
+#define FILE_TO_PCIE_DIR_QUERY_SIZE_V1 88
+#define FILE_TO_PCIE_DIR_QUERY_SIZE_V2 96   /* + generation */
+#define FILE_TO_PCIE_GROUP_QUERY_SIZE_V1 72
+
+/*
+ * Topology generation: bumped whenever the module drops its topology
+ * cache, i.e. whenever a PCI device or a disk or partition comes or
+ * goes. Compact queries report the generation their answer was
+ * built at; it stays valid until the generation moves on. read() on
+ * /dev/file_to_pcie returns the current generation as a __u64, and
+ * poll() signals POLLPRI once it has changed since the last read()
+ * on that open file. Generations are never 0 and are not reused
+ * across module reloads.
+ */
+
+/*
+ * Query flags. Link state is read from config space on every query,
+ * and in-flight requests are counted across CPUs, so both are only
+ * reported on request.
+ *
+ * The last three trim work a caller does not need. ENDPOINT drops
+ * the upstream ports and root port of every chain, leaving one
+ * record per device actually holding data. TOPOLOGY skips the
+ * mapping of the file range to sectors, which for a regular file
+ * means asking the filesystem: every device below the file is
+ * reported for the whole segment, with sectors -1, and the range is
+ * not checked against the file. NO_NAMES only applies to the legacy
+ * batch and leaves each entry's name empty instead of formatting it.
+ */
+#define FILE_TO_PCIE_QUERY_F_LINK   0x1   /* Fill the PCIe link fields */
+#define FILE_TO_PCIE_QUERY_F_FIXED  0x2   /* fd is a registered index */
+#define FILE_TO_PCIE_QUERY_F_PATH   0x4   /* fd is a dirfd, see path */
+#define FILE_TO_PCIE_QUERY_F_LIMITS 0x8   /* Fill the queue limit fields */
+#define FILE_TO_PCIE_QUERY_F_CACHE  0x10  /* Report page-cache residency */
+#define FILE_TO_PCIE_QUERY_F_LOAD   0x20  /* Fill the queue load fields */
+#define FILE_TO_PCIE_QUERY_F_ENDPOINT 0x40  /* Endpoints only */
+#define FILE_TO_PCIE_QUERY_F_TOPOLOGY 0x80  /* No sector ranges */
+#define FILE_TO_PCIE_QUERY_F_NO_NAMES 0x100 /* Legacy batch: no names */
+
+/* Queue flags */
+#define FILE_TO_PCIE_QUEUE_F_ROTATIONAL   0x1
+#define FILE_TO_PCIE_QUEUE_F_ZONED        0x2
+#define FILE_TO_PCIE_QUEUE_F_DISCARD      0x4
+#define FILE_TO_PCIE_QUEUE_F_WRITE_ZEROES 0x8
+
+/* Load flags */
+#define FILE_TO_PCIE_LOAD_F_INFLIGHT 0x1  /* inflight is valid */
+
+/*
+ * NVMe multipath path states: the ANA state of the path's namespace
+ * on its controller. Paths of controllers without ANA are OPTIMIZED.
+ */
+#define FILE_TO_PCIE_PATH_NONE            0 /* Not an NVMe multipath path */
+#define FILE_TO_PCIE_PATH_OPTIMIZED       1
+#define FILE_TO_PCIE_PATH_NON_OPTIMIZED   2
+#define FILE_TO_PCIE_PATH_INACCESSIBLE    3
+#define FILE_TO_PCIE_PATH_PERSISTENT_LOSS 4
+#define FILE_TO_PCIE_PATH_CHANGE          5
+
+/* Path flags */
+#define FILE_TO_PCIE_PATH_F_LIVE    0x1   /* Controller is live */
+#define FILE_TO_PCIE_PATH_F_CURRENT 0x2   /* I/O from the caller's node
+                                           * goes down this path */
+
+struct file_to_pcie_dev_record {
+    __u32 domain;
+    __u16 vendor_id;
+    __u16 device_id;
+    __u8 bus;
+    __u8 devfn;                 /* PCI_SLOT() / PCI_FUNC() encoding */
+    __u8 depth;                 /* Position in the chain, 0 = endpoint */
+    __u8 reserved0;
+    __u32 dev_major;            /* Block device this chain belongs to */
+    __u32 dev_minor;
+    __s32 numa_node;            /* -1 if the device has no NUMA affinity */
+    /*
+     * File offset range on this PCIe device. For a member of a striped
+     * device this is the first and last byte it holds, with the other
+     * members' chunks in between: its share is the sector range.
+     */
+    file_offset_t file_offset_start;
+    file_offset_t file_offset_end;
+    /* Block device sector range, -1 if unknown */
+    file_offset_t sector_start;
+    file_offset_t sector_end;
+    /* CPUs local to numa_node (all online CPUs if it is -1) */
+    __s32 first_local_cpu;      /* -1 if none */
+    __u32 nr_local_cpus;
+    /*
+     * PCIe link, with FILE_TO_PCIE_QUERY_F_LINK. Speeds are link
+     * generations (1 = 2.5 GT/s, 2 = 5 GT/s, 3 = 8 GT/s, ...), widths
+     * are lanes, and all are 0 for devices without a PCIe link.
+     */
+    __u8 link_speed;
+    __u8 link_width;
+    __u8 max_link_speed;
+    __u8 max_link_width;
+    __u32 available_bandwidth;  /* Mb/s, from pcie_bandwidth_available() */
+    /* Device whose link limits available_bandwidth, if it is non-zero */
+    __u32 limit_domain;
+    __u8 limit_bus;
+    __u8 limit_devfn;
+    __u8 limit_link_speed;
+    __u8 limit_link_width;
+    /*
+     * NVMe native multipath: set on the chain of each path below an
+     * NVMe head disk (nvmeXnY), whose dev_major/dev_minor are the
+     * path's own hidden disk (nvmeXcZnY). All zero otherwise.
+     */
+    __u8 path_state;            /* FILE_TO_PCIE_PATH_* */
+    __u8 path_flags;            /* FILE_TO_PCIE_PATH_F_* */
+    __u16 path_controller;      /* Z: the path's controller, /dev/nvmeZ */
+    __u32 reserved1;
+    /*
+     * I/O limits of the request queue of dev_major:dev_minor, with
+     * FILE_TO_PCIE_QUERY_F_LIMITS, as in /sys/block/<disk>/queue/.
+     * Sizes are in bytes unless noted.
+     */
+    __u32 logical_block_size;
+    __u32 physical_block_size;
+    __u32 io_min;
+    __u32 io_opt;               /* 0 if the device reports none */
+    __u32 max_sectors;          /* Per request, in 512-byte sectors */
+    __u32 dma_alignment;        /* Required alignment of buffer addresses */
+    __u16 max_segments;
+    __u16 queue_flags;          /* FILE_TO_PCIE_QUEUE_F_* */
+    __u32 reserved2;
+    /*
+     * Load of the disk dev_major:dev_minor is on, with
+     * FILE_TO_PCIE_QUERY_F_LOAD, from the counters behind
+     * /sys/block/<disk>/stat. busy_ms only grows: the disk's
+     * utilisation over an interval is the growth of busy_ms between
+     * two samples over the growth of sample_ns. Kernels before 6.16
+     * cannot count the in-flight requests of blk-mq disks (NVMe, SCSI)
+     * from a module, and leave FILE_TO_PCIE_LOAD_F_INFLIGHT clear.
+     */
+    __u64 sample_ns;            /* CLOCK_MONOTONIC time of the sample */
+    __u64 busy_ms;              /* Time with requests in flight */
+    __u32 inflight;             /* Reads and writes in flight */
+    __u32 load_flags;           /* FILE_TO_PCIE_LOAD_F_* */
+};
+
+/*
+ * Page-cache residency of a regular file segment, with
+ * FILE_TO_PCIE_QUERY_F_CACHE: runs of cached pages in the same state,
+ * sorted by offset and clipped to the segment. Anything between runs
+ * is not cached. This is a snapshot taken without locking the file,
+ * so pages may be read in or reclaimed as soon as it is returned.
+ */
+#define FILE_TO_PCIE_CACHE_F_DIRTY     0x1  /* Not yet written back */
+#define FILE_TO_PCIE_CACHE_F_WRITEBACK 0x2  /* Being written back */
+
+struct file_to_pcie_cache_range {
+    file_offset_t offset;       /* Bytes from the start of the file */
+    __u64 length;
+    __u32 flags;                /* FILE_TO_PCIE_CACHE_F_* */
+    __u32 reserved;
+};
+
+struct file_to_pcie_query {
+    int fd;
+    __u32 flags;                /* FILE_TO_PCIE_QUERY_F_* */
+    file_offset_t offset;
+    __u64 length;
+    __u64 records;              /* User pointer to record buffer */
+    __u32 record_size;          /* Stride of the record buffer */
+    __u32 record_capacity;      /* Records that fit in the buffer */
+    __u32 record_count;         /* Out: records written */
+    __u32 records_needed;       /* Out: records in the full answer */
+    /*
+     * Optional: one local CPU mask per record, in sched_setaffinity()
+     * cpu_set_t layout, written with a stride of cpumask_size bytes
+     */
+    __u64 cpumasks;
+    __u32 cpumask_size;
+    __u32 reserved;
+    /*
+     * With FILE_TO_PCIE_QUERY_F_PATH: user pointer to a NUL-terminated
+     * path of a regular file, resolved relative to fd (or AT_FDCWD)
+     * like openat() would, but without opening the file
+     */
+    __u64 path;
+    /*
+     * With FILE_TO_PCIE_QUERY_F_CACHE: user pointer to an array of
+     * struct file_to_pcie_cache_range for the segment's cached runs
+     */
+    __u64 cache_ranges;
+    __u32 cache_range_capacity; /* Entries available at cache_ranges */
+    __u32 cache_range_count;    /* Out: runs written */
+    __u32 cache_ranges_needed;  /* Out: runs in the full answer */
+    __u32 reserved2;
+    __u64 generation;           /* Out: topology generation */
+};
+
+/*
+ * Batched compact queries: all segments share one record buffer and
+ * each result points at its slice of it. Once the buffer is full,
+ * later segments still report records_needed but write no records.
+ */
+struct file_to_pcie_query_result {
+    int status;                 /* 0 on success, negative errno on failure */
+    __u32 record_index;         /* First record for this segment */
+    __u32 record_count;         /* Records written */
+    __u32 records_needed;       /* Records in the full answer */
+};
+
+struct file_to_pcie_query_batch {
+    __u64 segments;             /* User pointer to segment array */
+    __u64 results;              /* User pointer to result array */
+    __u64 records;              /* User pointer to shared record buffer */
+    __u32 count;                /* Number of segments (and results) */
+    __u32 completed;            /* Out: number of results written */
+    __u32 record_size;          /* Stride of the record buffer */
+    __u32 record_capacity;      /* Records that fit in the buffer */
+    __u32 records_used;         /* Out: records written in total */
+    __u32 flags;                /* FILE_TO_PCIE_QUERY_F_* */
+    /* Optional per-record CPU masks, as in struct file_to_pcie_query */
+    __u64 cpumasks;
+    __u32 cpumask_size;
+    __u32 reserved;
+    __u64 generation;           /* Out: topology generation */
+};
+
+/*
+ * Directory queries: resolve every regular file of a directory in one
+ * call, without opening any of them. Each file is mapped as a whole
+ * ([0, size)). Entries are written in directory order, with their
+ * names packed NUL-terminated into the name buffer and their records
+ * into the shared record buffer as for a batch. Once the record
+ * buffer is full, later entries still report records_needed but
+ * write no records.
+ *
+ * The call stops when the directory ends (done = 1) or the entry or
+ * name buffer is full; call again with the returned cookie to
+ * continue. Subdirectories are skipped unless FILE_TO_PCIE_DIR_F_SUBDIRS
+ * is set, in which case they are returned with status -EISDIR so the
+ * caller can descend into them.
+ */
+#define FILE_TO_PCIE_DIR_F_SUBDIRS  0x10000
+
+struct file_to_pcie_dir_entry {
+    __u64 ino;
+    __u64 size;                 /* File size in bytes */
+    int status;                 /* 0 on success, negative errno on failure */
+    __u32 name_offset;          /* Name, at this offset in the name buffer */
+    __u32 record_index;         /* First record for this file */
+    __u32 record_count;         /* Records written */
+    __u32 records_needed;       /* Records in the full answer */
+    __u32 reserved;
+};
+
+struct file_to_pcie_dir_query {
+    int dirfd;                  /* Directory opened for reading */
+    __u32 flags;                /* FILE_TO_PCIE_QUERY_F_LINK, _DIR_F_* */
+    __u64 cookie;               /* In/out: position, 0 to start */
+    __u64 entries;              /* User pointer to entry array */
+    __u64 names;                /* User pointer to name buffer */
+    __u64 records;              /* User pointer to shared record buffer */
+    __u32 entry_capacity;       /* Entries that fit at entries */
+    __u32 entry_count;          /* Out: entries written */
+    __u32 names_size;           /* Bytes available at names */
+    __u32 names_used;           /* Out: bytes written */
+    __u32 record_size;          /* Stride of the record buffer */
+    __u32 record_capacity;      /* Records that fit in the buffer */
+    __u32 records_used;         /* Out: records written in total */
+    __u32 done;                 /* Out: 1 once the directory is exhausted */
+    /* Optional per-record CPU masks, as in struct file_to_pcie_query */
+    __u64 cpumasks;
+    __u32 cpumask_size;
+    __u32 reserved;
+    __u64 generation;           /* Out: topology generation */
+};
+
+/*
+ * Group queries: which segments share a PCIe device, switch, root
+ * port or NUMA node. Each distinct device (or node) at the chosen
+ * level that any segment maps to becomes a cluster, numbered from 0
+ * in the order they are first seen, and each segment reports the
+ * clusters it maps to. A segment of length 0 runs from its offset to
+ * the end of the file, or of the disk for a block device.
+ *
+ * A segment on a striped or mirrored device maps to the clusters of
+ * all members holding part of it; one on an NVMe multipath head only
+ * to those of its current paths. A segment with no PCIe device has
+ * cluster_count 0 and cluster _GROUP_NONE.
+ */
+#define FILE_TO_PCIE_GROUP_DEVICE    0  /* The endpoint itself */
+#define FILE_TO_PCIE_GROUP_SWITCH    1  /* Closest switch, else root port */
+#define FILE_TO_PCIE_GROUP_ROOT_PORT 2
+#define FILE_TO_PCIE_GROUP_NUMA_NODE 3  /* The endpoint's node */
+
+#define FILE_TO_PCIE_GROUP_NONE 0xffffffffU
+
+struct file_to_pcie_group_result {
+    int status;                 /* 0 on success, negative errno on failure */
+    __u32 cluster;              /* First cluster the segment maps to */
+    __u32 cluster_count;        /* Distinct clusters it maps to */
+    /* All of them, in the shared member list, if it has room */
+    __u32 member_index;
+    __u32 member_count;         /* Cluster IDs written */
+    __u32 reserved;
+};
+
+/* What a cluster ID is, at index ID of the cluster table */
+struct file_to_pcie_cluster {
+    /* Switch upstream port, root port or endpoint; 0 for NUMA nodes */
+    __u32 domain;
+    __u8 bus;
+    __u8 devfn;
+    __u16 reserved;
+    __s32 numa_node;            /* -1 if the device has no NUMA affinity */
+    __u32 segments;             /* Segments mapping to the cluster */
+};
+
+struct file_to_pcie_group_query {
+    __u64 segments;             /* User pointer to segment array */
+    __u64 results;              /* User pointer to result array */
+    __u32 count;                /* Number of segments (and results) */
+    __u32 completed;            /* Out: number of results written */
+    __u32 level;                /* FILE_TO_PCIE_GROUP_* */
+    __u32 flags;                /* Reserved, must be 0 */
+    /* Optional: the cluster table */
+    __u64 clusters;             /* User pointer to cluster array */
+    __u32 cluster_capacity;     /* Entries available at clusters */
+    __u32 cluster_count;        /* Out: clusters seen */
+    /* Optional: the shared member list, an array of __u32 cluster IDs */
+    __u64 members;
+    __u32 member_capacity;      /* Entries available at members */
+    __u32 members_used;         /* Out: entries written */
+    __u64 generation;           /* Out: topology generation */
+};
+
+/*
+ * Peer-to-peer DMA distance between the PCIe endpoints holding a file
+ * segment and a target PCI device (accelerator, NIC, ...). One path is
+ * reported per endpoint. The target is given by PCI address, or by an
+ * fd with FILE_TO_PCIE_P2P_F_TARGET_FD: a file or block device (its
+ * endpoint is used) or a file in the target's sysfs device directory,
+ * e.g. /sys/bus/pci/devices/0000:65:00.0/resource0. The address of the
+ * resolved target is written back.
+ */
+#define FILE_TO_PCIE_P2P_F_TARGET_FD    0x1
+#define FILE_TO_PCIE_P2P_F_FIXED        0x2 /* fd is a registered index */
+
+/* Path flags */
+#define FILE_TO_PCIE_P2P_PATH_COMMON      0x1 /* common_* is valid */
+#define FILE_TO_PCIE_P2P_PATH_HOST_BRIDGE 0x2 /* Crosses the root complex */
+#define FILE_TO_PCIE_P2P_PATH_SUPPORTED   0x4 /* Allowed by kernel P2PDMA */
+#define FILE_TO_PCIE_P2P_PATH_NO_P2PDMA   0x8 /* Kernel lacks P2PDMA */
+
+struct file_to_pcie_p2p_path {
+    /* Endpoint holding [file_offset_start, file_offset_end] */
+    __u32 domain;
+    __u8 bus;
+    __u8 devfn;
+    __u16 flags;                /* FILE_TO_PCIE_P2P_PATH_* */
+    __u32 dev_major;
+    __u32 dev_minor;
+    /*
+     * Closest device upstream of both ends (a switch or root port,
+     * or one of the ends itself). Neither _COMMON nor _HOST_BRIDGE
+     * means the ends sit under different host bridges.
+     */
+    __u32 common_domain;
+    __u8 common_bus;
+    __u8 common_devfn;
+    __u16 reserved;
+    __s32 hops;                 /* Links from either end up to the split */
+    __s32 distance;             /* pci_p2pdma_distance(), -1 if refused */
+    file_offset_t file_offset_start;
+    file_offset_t file_offset_end;
+};
+
+struct file_to_pcie_p2p_query {
+    int fd;
+    __u32 flags;                /* FILE_TO_PCIE_P2P_F_* */
+    file_offset_t offset;
+    __u64 length;
+    /* Target PCI address, written back when given by target_fd */
+    __u32 target_domain;
+    __u8 target_bus;
+    __u8 target_devfn;
+    __u16 reserved;
+    int target_fd;
+    __u32 path_capacity;        /* Entries available at paths */
+    __u64 paths;                /* User pointer to path array */
+    __u32 path_count;           /* Out: paths written */
+    __u32 paths_needed;         /* Out: paths in the full answer */
+};
+
+/*
+ * Registered files: pin target files into a table on the open
+ * /dev/file_to_pcie and pass their index instead of an fd, with the
+ * request's _F_FIXED flag. Slots [offset, offset + count) are set to
+ * the given fds (-1 clears a slot); the table grows as needed, up to
+ * 65536 slots. Registered files stay open until their slot is
+ * cleared or /dev/file_to_pcie is closed.
+ */
+struct file_to_pcie_register {
+    __u64 fds;                  /* User pointer to an array of int fds */
+    __u32 offset;               /* First slot to set */
+    __u32 count;                /* Number of fds */
+};
+
+/*
+ * io_uring: requests can also be submitted as IORING_OP_URING_CMD on
+ * /dev/file_to_pcie, with cmd_op set to the ioctl number and this in
+ * the SQE command area. The CQE result is the ioctl return value.
+ */
+struct file_to_pcie_uring_cmd {
+    __u64 arg;                  /* User pointer to the ioctl argument */
+    __u64 reserved;             /* Must be 0 */
+};
+
+/*
+ * BPF: in-kernel callers resolve placement with kfuncs instead of
+ * ioctls (see the README for their prototypes), and walk the topology
+ * cache with the open-coded iterator bpf_iter_file_to_pcie, which
+ * returns one entry per cached block device or multi-device
+ * filesystem. Stacked devices have no chain of their own, only
+ * members. The walk takes no lock: entries added or dropped while it
+ * runs may be missed or seen twice, which shows up as a generation
+ * that differs from the current one.
+ */
+#define FILE_TO_PCIE_TOPO_F_FILESYSTEM 0x1  /* dev is a filesystem's s_dev */
+
+struct file_to_pcie_topo_entry {
+    __u32 dev_major;
+    __u32 dev_minor;
+    /* Endpoint of the device's own chain, if nr_devices > 0 */
+    __u32 domain;
+    __u8 bus;
+    __u8 devfn;
+    __u16 nr_devices;           /* Devices in the chain */
+    /* Top of the chain: the root port, unless the walk stopped short */
+    __u32 top_domain;
+    __u8 top_bus;
+    __u8 top_devfn;
+    __u16 nr_members;           /* Members of a stacked device */
+    __s32 numa_node;            /* Of the endpoint, -1 if none */
+    __u32 flags;                /* FILE_TO_PCIE_TOPO_F_* */
+    __u64 generation;           /* Topology generation the walk began at */
 };
 
 #define FILE_TO_PCIE_IOC_MAGIC 'f'
 #define FILE_TO_PCIE_IOCTL_GET_PCIE \
     _IOWR(FILE_TO_PCIE_IOC_MAGIC, 1, \
           struct file_to_pcie_request)
+#define FILE_TO_PCIE_IOCTL_GET_PCIE_BATCH \
+    _IOWR(FILE_TO_PCIE_IOC_MAGIC, 2, \
+          struct file_to_pcie_batch)
+#define FILE_TO_PCIE_IOCTL_GET_EXTENTS \
+    _IOWR(FILE_TO_PCIE_IOC_MAGIC, 3, \
+          struct file_to_pcie_extent_request)
+#define FILE_TO_PCIE_IOCTL_QUERY \
+    _IOWR(FILE_TO_PCIE_IOC_MAGIC, 4, \
+          struct file_to_pcie_query)
+#define FILE_TO_PCIE_IOCTL_QUERY_BATCH \
+    _IOWR(FILE_TO_PCIE_IOC_MAGIC, 5, \
+          struct file_to_pcie_query_batch)
+#define FILE_TO_PCIE_IOCTL_GET_P2P \
+    _IOWR(FILE_TO_PCIE_IOC_MAGIC, 6, \
+          struct file_to_pcie_p2p_query)
+#define FILE_TO_PCIE_IOCTL_REGISTER_FILES \
+    _IOW(FILE_TO_PCIE_IOC_MAGIC, 7, \
+         struct file_to_pcie_register)
+#define FILE_TO_PCIE_IOCTL_QUERY_DIR \
+    _IOWR(FILE_TO_PCIE_IOC_MAGIC, 8, \
+          struct file_to_pcie_dir_query)
+#define FILE_TO_PCIE_IOCTL_QUERY_GROUPS \
+    _IOWR(FILE_TO_PCIE_IOC_MAGIC, 9, \
+          struct file_to_pcie_group_query)
 
 #endif /* FILE_TO_PCIE_H */
 
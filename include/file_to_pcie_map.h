@@ -0,0 +1,332 @@
+/*
+ * file_to_pcie_map.h - On-disk placement map format and reader
+ *
+ * A placement map is what scan_file_to_pcie learned about a dataset,
+ * written so that loaders can mmap() it and look files up without
+ * talking to the kernel module. Everything is little-endian, fixed
+ * width and addressed by offsets from the start of the file:
+ *
+ *   header | device table | file table | extent table | string table
+ *
+ * Files are sorted by path (bytewise, as strcmp() orders them) so
+ * they can be binary searched. Each file owns a contiguous run of
+ * extents, sorted by file offset: one per PCIe endpoint holding part
+ * of the file. Members of a mirrored array overlap, each holding a
+ * full copy. Members holding unknown shares of a range (a striped
+ * array, btrfs, device-mapper) overlap too, and are flagged
+ * FILE_TO_PCIE_MAP_EXTENT_F_SHARED: such an extent only says its
+ * device holds some of the range, not that it holds a given offset.
+ * Devices form a forest through their parent index, from endpoints up
+ * to root ports.
+ *
+ * Table strides are stored in the header: readers must use them
+ * rather than sizeof(), so that later versions can grow records. The
+ * header itself grows the same way, by header_size.
+ */
+
+#ifndef FILE_TO_PCIE_MAP_H
+#define FILE_TO_PCIE_MAP_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#define FILE_TO_PCIE_MAP_MAGIC 0x50414d4943503246ULL  /* "F2PCIMAP" */
+#define FILE_TO_PCIE_MAP_VERSION 1
+#define FILE_TO_PCIE_MAP_NO_PARENT 0xffffffffU
+#define FILE_TO_PCIE_MAP_HEADER_SIZE_V1 96
+#define FILE_TO_PCIE_MAP_HEADER_SIZE_V2 104 /* + generation */
+
+/* Extent flags */
+#define FILE_TO_PCIE_MAP_EXTENT_F_SHARED 0x1 /* Holds an unknown part */
+
+struct file_to_pcie_map_header {
+    __u64 magic;                /* FILE_TO_PCIE_MAP_MAGIC */
+    __u32 version;              /* FILE_TO_PCIE_MAP_VERSION */
+    __u32 header_size;          /* Bytes, at least _HEADER_SIZE_V1 */
+    __u32 device_size;          /* Stride of the device table */
+    __u32 file_size;            /* Stride of the file table */
+    __u32 extent_size;          /* Stride of the extent table */
+    __u32 device_count;
+    __u64 file_count;
+    __u64 extent_count;
+    /* Table offsets from the start of the map */
+    __u64 devices;
+    __u64 files;
+    __u64 extents;
+    __u64 strings;
+    __u64 strings_size;         /* Bytes in the string table */
+    __u64 created;              /* Seconds since the epoch */
+    /*
+     * Oldest topology generation (see file_to_pcie.h) the module
+     * reported while scanning, 0 if unknown
+     */
+    __u64 generation;
+};
+
+struct file_to_pcie_map_device {
+    __u32 domain;
+    __u16 vendor_id;
+    __u16 device_id;
+    __u8 bus;
+    __u8 devfn;                 /* PCI_SLOT() / PCI_FUNC() encoding */
+    __u16 reserved;
+    __s32 numa_node;            /* -1 if the device has no NUMA affinity */
+    __u32 parent;               /* Upstream device, or _NO_PARENT */
+    __s32 first_local_cpu;      /* -1 if none */
+    __u32 nr_local_cpus;
+    __u32 reserved2;
+};
+
+struct file_to_pcie_map_file {
+    __u64 path;                 /* Offset of the NUL-terminated path */
+    __u32 path_len;             /* Bytes, without the NUL */
+    __u32 extent_count;
+    __u64 first_extent;         /* Index into the extent table */
+    __u64 size;                 /* File size in bytes when scanned */
+    __u64 ino;
+};
+
+struct file_to_pcie_map_extent {
+    /* File byte range held by the device, inclusive */
+    __u64 file_offset_start;
+    __u64 file_offset_end;
+    /* Sector range on the block device, -1 if unknown */
+    __s64 sector_start;
+    __s64 sector_end;
+    __u32 device;               /* Endpoint, index into the device table */
+    __u32 dev_major;            /* Block device holding the range */
+    __u32 dev_minor;
+    __u32 flags;                /* FILE_TO_PCIE_MAP_EXTENT_F_* */
+};
+
+/*
+ * Reader
+ */
+struct file_to_pcie_map {
+    const unsigned char *base;
+    size_t size;
+    const struct file_to_pcie_map_header *hdr;
+};
+
+/* Non-zero if a table of count records of stride bytes fits at offset */
+static inline int file_to_pcie_map_fits(const struct file_to_pcie_map *m,
+                                        __u64 offset, __u64 count,
+                                        __u64 stride)
+{
+    if (offset > m->size || offset % 8)
+        return 0;
+    return !stride || count <= (m->size - offset) / stride;
+}
+
+/*
+ * Check that a mapping holds a placement map this reader understands
+ * Only the header and table bounds are checked; entries are checked
+ * as they are looked up, so opening a map stays O(1).
+ */
+static inline int file_to_pcie_map_init(struct file_to_pcie_map *m,
+                                        const void *base, size_t size)
+{
+    const struct file_to_pcie_map_header *hdr = base;
+
+    m->base = base;
+    m->size = size;
+    m->hdr = hdr;
+
+    if (size < FILE_TO_PCIE_MAP_HEADER_SIZE_V1 ||
+        hdr->magic != FILE_TO_PCIE_MAP_MAGIC)
+        return -EINVAL;
+    if (hdr->version != FILE_TO_PCIE_MAP_VERSION)
+        return -EPROTONOSUPPORT;
+    if (hdr->header_size < FILE_TO_PCIE_MAP_HEADER_SIZE_V1 ||
+        hdr->header_size > size ||
+        hdr->device_size < sizeof(struct file_to_pcie_map_device) ||
+        hdr->file_size < sizeof(struct file_to_pcie_map_file) ||
+        hdr->extent_size < sizeof(struct file_to_pcie_map_extent) ||
+        (hdr->device_size | hdr->file_size | hdr->extent_size) % 8)
+        return -EINVAL;
+    if (!file_to_pcie_map_fits(m, hdr->devices, hdr->device_count,
+                               hdr->device_size) ||
+        !file_to_pcie_map_fits(m, hdr->files, hdr->file_count,
+                               hdr->file_size) ||
+        !file_to_pcie_map_fits(m, hdr->extents, hdr->extent_count,
+                               hdr->extent_size) ||
+        !file_to_pcie_map_fits(m, hdr->strings, hdr->strings_size, 1))
+        return -EINVAL;
+    return 0;
+}
+
+/*
+ * Map a placement map file read-only
+ * Returns 0 on success, negative error code on failure
+ */
+static inline int file_to_pcie_map_open(struct file_to_pcie_map *m,
+                                        const char *path)
+{
+    struct stat st;
+    void *base;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+    if ((size_t)st.st_size < FILE_TO_PCIE_MAP_HEADER_SIZE_V1) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ret = -errno;
+    close(fd);
+    if (base == MAP_FAILED)
+        return ret;
+
+    ret = file_to_pcie_map_init(m, base, st.st_size);
+    if (ret < 0)
+        munmap(base, st.st_size);
+    return ret;
+}
+
+static inline void file_to_pcie_map_close(struct file_to_pcie_map *m)
+{
+    munmap((void *)m->base, m->size);
+    m->base = NULL;
+}
+
+/* Topology generation the map was scanned at, 0 if unknown */
+static inline __u64 file_to_pcie_map_generation(const struct file_to_pcie_map *m)
+{
+    if (m->hdr->header_size < FILE_TO_PCIE_MAP_HEADER_SIZE_V2)
+        return 0;
+    return m->hdr->generation;
+}
+
+/*
+ * Check a map against the module's current topology generation, read
+ * from an open /dev/file_to_pcie (which, like any read() of it,
+ * clears a pending POLLPRI on that file)
+ * Returns 1 if the map is still current, 0 if it is stale or its
+ * generation is unknown, negative error code on failure
+ */
+static inline int file_to_pcie_map_current(const struct file_to_pcie_map *m,
+                                           int dev_fd)
+{
+    __u64 gen;
+    ssize_t n;
+
+    n = read(dev_fd, &gen, sizeof(gen));
+    if (n < 0)
+        return -errno;
+    if (n != sizeof(gen))
+        return -EIO;
+    return gen && gen == file_to_pcie_map_generation(m);
+}
+
+static inline const struct file_to_pcie_map_device *
+file_to_pcie_map_device(const struct file_to_pcie_map *m, __u32 index)
+{
+    if (index >= m->hdr->device_count)
+        return NULL;
+    return (const void *)(m->base + m->hdr->devices +
+                          (__u64)index * m->hdr->device_size);
+}
+
+static inline const struct file_to_pcie_map_file *
+file_to_pcie_map_file(const struct file_to_pcie_map *m, __u64 index)
+{
+    if (index >= m->hdr->file_count)
+        return NULL;
+    return (const void *)(m->base + m->hdr->files +
+                          index * m->hdr->file_size);
+}
+
+/* Path of a file entry, or NULL if the map is corrupt */
+static inline const char *
+file_to_pcie_map_path(const struct file_to_pcie_map *m,
+                      const struct file_to_pcie_map_file *f)
+{
+    const char *s = (const char *)m->base + m->hdr->strings;
+
+    if (f->path >= m->hdr->strings_size ||
+        f->path_len >= m->hdr->strings_size - f->path ||
+        s[f->path + f->path_len])
+        return NULL;
+    return s + f->path;
+}
+
+/* The i-th extent of a file, or NULL past its last one */
+static inline const struct file_to_pcie_map_extent *
+file_to_pcie_map_extent(const struct file_to_pcie_map *m,
+                        const struct file_to_pcie_map_file *f, __u32 i)
+{
+    if (i >= f->extent_count || f->first_extent >= m->hdr->extent_count ||
+        i >= m->hdr->extent_count - f->first_extent)
+        return NULL;
+    return (const void *)(m->base + m->hdr->extents +
+                          (f->first_extent + i) * m->hdr->extent_size);
+}
+
+/*
+ * Binary search the file table for path
+ * Returns NULL if the file is not in the map
+ */
+static inline const struct file_to_pcie_map_file *
+file_to_pcie_map_find(const struct file_to_pcie_map *m, const char *path)
+{
+    const struct file_to_pcie_map_file *f;
+    const char *name;
+    __u64 lo = 0, hi = m->hdr->file_count, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        f = file_to_pcie_map_file(m, mid);
+        name = file_to_pcie_map_path(m, f);
+        if (!name)
+            return NULL;
+
+        cmp = strcmp(path, name);
+        if (!cmp)
+            return f;
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+/*
+ * First extent of a file holding offset, searching from extent *pos
+ * on, so all devices holding an offset can be found by calling it
+ * again with *pos advanced past the previous match. A match flagged
+ * FILE_TO_PCIE_MAP_EXTENT_F_SHARED may not hold offset at all: it is
+ * one of the candidates, and every one of them should be considered.
+ */
+static inline const struct file_to_pcie_map_extent *
+file_to_pcie_map_lookup(const struct file_to_pcie_map *m,
+                        const struct file_to_pcie_map_file *f,
+                        __u64 offset, __u32 *pos)
+{
+    const struct file_to_pcie_map_extent *e;
+
+    for (; (e = file_to_pcie_map_extent(m, f, *pos)); (*pos)++) {
+        if (e->file_offset_start > offset)
+            break;
+        if (offset <= e->file_offset_end)
+            return e;
+    }
+    return NULL;
+}
+
+#endif /* FILE_TO_PCIE_MAP_H */
@@ -0,0 +1,87 @@
+/*
+ * libfile_to_pcie.h - Client library for the file_to_pcie module
+ *
+ * One device fd per process, and a process-wide cache of compact
+ * query results. Lookups that hit the cache take no lock and make no
+ * system call; they return a view of the cached records rather than a
+ * copy, which stays valid until it is put, even if the entry is
+ * replaced or the cache dropped in the meantime.
+ *
+ * Entries are keyed by the file's st_dev and st_ino, the exact offset
+ * and length, the query flags and the topology generation. A thread
+ * watches the generation and drops the whole cache when it moves on.
+ * Link speed and width and NVMe path states change without moving it,
+ * so results with FILE_TO_PCIE_QUERY_F_LINK or any path_state are
+ * only kept for a second. The file's own layout is not versioned:
+ * after rewriting or moving a file's data, call
+ * file_to_pcie_invalidate() before looking it up again. Results with
+ * FILE_TO_PCIE_QUERY_F_LOAD change on every call, so they are never
+ * cached.
+ *
+ *     struct file_to_pcie_target t;
+ *     const struct file_to_pcie_view *v;
+ *
+ *     file_to_pcie_init();
+ *     file_to_pcie_target_init(&t, fd);
+ *     if (!file_to_pcie_lookup(&t, offset, length, 0, &v)) {
+ *         ... v->records[0 .. v->count - 1] ...
+ *         file_to_pcie_view_put(v);
+ *     }
+ *     file_to_pcie_fini();
+ *
+ * All functions return 0 on success or a negative errno.
+ */
+
+#ifndef LIBFILE_TO_PCIE_H
+#define LIBFILE_TO_PCIE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "file_to_pcie.h"
+
+/* An open file and the identity its results are cached under */
+struct file_to_pcie_target {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+};
+
+/* Read-only: owned by the cache until file_to_pcie_view_put() */
+struct file_to_pcie_view {
+    const struct file_to_pcie_dev_record *records;
+    uint32_t count;
+    uint32_t flags;             /* FILE_TO_PCIE_QUERY_F_* of the query */
+    uint64_t generation;        /* Topology generation of the records */
+};
+
+/*
+ * Open /dev/file_to_pcie and start the generation watcher. Call once
+ * before any lookup, and file_to_pcie_fini() once the last lookup has
+ * returned.
+ */
+int file_to_pcie_init(void);
+void file_to_pcie_fini(void);
+
+/* The shared device fd, for requests the library does not wrap */
+int file_to_pcie_device_fd(void);
+
+/* Current topology generation, as last seen by the watcher */
+uint64_t file_to_pcie_generation(void);
+
+/* fstat() fd once, so lookups need not */
+int file_to_pcie_target_init(struct file_to_pcie_target *t, int fd);
+
+/*
+ * Map [offset, offset + length) of t to PCIe devices. flags may hold
+ * FILE_TO_PCIE_QUERY_F_LINK, _LIMITS, _LOAD, _ENDPOINT and _TOPOLOGY.
+ * On success *view holds the answer until it is put.
+ */
+int file_to_pcie_lookup(const struct file_to_pcie_target *t,
+                        int64_t offset, uint64_t length, uint32_t flags,
+                        const struct file_to_pcie_view **view);
+void file_to_pcie_view_put(const struct file_to_pcie_view *view);
+
+/* Drop every cached result; views already handed out stay valid */
+void file_to_pcie_invalidate(void);
+
+#endif /* LIBFILE_TO_PCIE_H */
@@ -32,11 +32,144 @@
 #include <linux/bio.h>
 #include <linux/blk_types.h>
 #include <linux/string.h>
+#include <linux/hashtable.h>
+#include <linux/sched/signal.h>
+#include <linux/fiemap.h>
+#include <linux/kernfs.h>
+#include <linux/sysfs.h>
+#include <linux/major.h>
+#include <linux/math64.h>
+#include <linux/rculist.h>
+#include <linux/refcount.h>
+#include <linux/workqueue.h>
+#include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/bitfield.h>
+#include <linux/magic.h>
+#include <linux/dcache.h>
+#include <linux/pci-p2pdma.h>
+#include <linux/srcu.h>
+#include <linux/nospec.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/kobject.h>
+#include <linux/uuid.h>
+#include <linux/pagemap.h>
+#include <linux/xarray.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/part_stat.h>
+#include <linux/buffer_head.h>
+#include <linux/f2fs_fs.h>
+#include <linux/jiffies.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#endif
+/* kfuncs in a module need its BTF; open-coded iterators came in 6.4 */
+#if IS_ENABLED(CONFIG_BPF_SYSCALL) && \
+    IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define FILE_TO_PCIE_BPF
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#endif
 #include "file_to_pcie.h"
 
+#define CREATE_TRACE_POINTS
+#include "file_to_pcie_trace.h"
+
 #define DEVICE_NAME "file_to_pcie"
 #define CLASS_NAME "file_to_pcie"
 
+/* Segments copied in from userspace per step of a batched query */
+#define BATCH_CHUNK 64
+#define BATCH_HASH_BITS 8
+
+/* Compact records buffered on the stack by the lock-free query path */
+#define QUERY_FAST_RECORDS 8
+
+/* Extents requested from the filesystem per fiemap call */
+#define EXTENT_CHUNK 32
+
+/*
+ * Extent records held back per call while they may still grow, one
+ * per device, and the span an extent is cut into when the topology
+ * turns it into several records
+ */
+#define EXTENT_OPEN 8
+#define EXTENT_WINDOW (16ULL << 20)
+
+/* Zones reported by the block layer per blkdev_report_zones() call */
+#define ZONE_CHUNK 16
+
+/*
+ * Zone reports with the zone capacity. Only take zones from the
+ * block layer where that is the case.
+ */
+#if defined(CONFIG_BLK_DEV_ZONED) && \
+    LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+#define FILE_TO_PCIE_ZONES
+#endif
+
+/* Page-cache runs collected under RCU per copy to the caller */
+#define CACHE_RUN_CHUNK 16
+
+/* Member devices resolved below an md or device-mapper device */
+#define MAX_STACK_MEMBERS 16
+
+/* Stacked devices followed below a member, e.g. dm-crypt on md raid0 */
+#define MAX_STACK_DEPTH 4
+
+#define TOPO_LAYOUT_NONE     0  /* Not a stacked device */
+#define TOPO_LAYOUT_STRIPED  1  /* raid0: chunks rotate across members */
+#define TOPO_LAYOUT_MIRRORED 2  /* raid1: every member holds everything */
+#define TOPO_LAYOUT_UNKNOWN  3  /* Members known, mapping is not */
+#define TOPO_LAYOUT_MULTIPATH 4 /* NVMe head: members are paths to it */
+#define TOPO_LAYOUT_CONCAT   5  /* f2fs: members hold consecutive ranges */
+
+/* How long NVMe path states are trusted before the paths are re-read */
+#define PATH_STATE_TTL HZ
+
+/*
+ * How long the member list of a device-mapper device or multi-device
+ * filesystem is trusted: a dm table reload and btrfs device add,
+ * remove and replace all change members without any block device
+ * coming or going
+ */
+#define MEMBERS_TTL (5 * HZ)
+
+/* Buckets in the dev_t -> topology cache */
+#define TOPO_CACHE_BITS 10
+
+/* Slots in a registered file table */
+#define MAX_FIXED_FILES 65536
+
+/* Directory entries, and bytes of their names, collected per read */
+#define DIR_CHUNK 64
+#define DIR_NAMES_SIZE 4096
+
+/* Request flags accepted by each handler */
+#define MAP_FLAGS (FILE_TO_PCIE_QUERY_F_ENDPOINT | \
+                   FILE_TO_PCIE_QUERY_F_TOPOLOGY)
+#define RECORD_FLAGS (FILE_TO_PCIE_QUERY_F_LINK | \
+                      FILE_TO_PCIE_QUERY_F_LIMITS | \
+                      FILE_TO_PCIE_QUERY_F_LOAD | MAP_FLAGS)
+#define LEGACY_BATCH_FLAGS (MAP_FLAGS | FILE_TO_PCIE_QUERY_F_NO_NAMES)
+#define QUERY_FLAGS (RECORD_FLAGS | FILE_TO_PCIE_QUERY_F_FIXED | \
+                     FILE_TO_PCIE_QUERY_F_PATH | FILE_TO_PCIE_QUERY_F_CACHE)
+#define P2P_FLAGS (FILE_TO_PCIE_P2P_F_TARGET_FD | FILE_TO_PCIE_P2P_F_FIXED)
+#define DIR_FLAGS (RECORD_FLAGS | FILE_TO_PCIE_DIR_F_SUBDIRS)
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Your Name");
 MODULE_DESCRIPTION("Find PCIe devices for file segments");
@@ -47,6 +180,159 @@ static struct class *file_to_pcie_class = NULL;
 static struct device *file_to_pcie_device = NULL;
 static struct cdev file_to_pcie_cdev;
 
+/*
+ * PCI devices found walking up from a block device, endpoint first.
+ * A reference is held on each. Sized to the actual hierarchy, so deep
+ * switch topologies are never truncated.
+ */
+struct pcie_chain {
+    int count;
+    struct pci_dev **pdevs;
+};
+
+struct bdev_topology;
+
+struct stack_member {
+    struct block_device *bdev;      /* Holds a bd_device reference */
+    sector_t data_offset;           /* Start of array data on member */
+    /* CONCAT: the filesystem sectors it holds, end exclusive */
+    sector_t fs_start;
+    sector_t fs_end;
+    struct pcie_chain chain;
+    struct bdev_topology *topo;     /* Own members, if stacked itself */
+    /* NVMe multipath paths only */
+    u8 path_state;                  /* FILE_TO_PCIE_PATH_* */
+    u8 path_flags;                  /* FILE_TO_PCIE_PATH_F_LIVE */
+    u16 path_controller;
+    int numa_node;
+};
+
+/*
+ * Everything a query needs to know about a block device: its own
+ * PCIe chain and, for stacked devices, its members and geometry
+ */
+struct bdev_topology {
+    struct hlist_node node;         /* In topo_cache */
+    struct rcu_work free_work;
+    refcount_t ref;
+    dev_t dev;
+    struct block_device *bdev;      /* Holds a bd_device reference, */
+                                    /* NULL for filesystems */
+    sector_t start_sect;            /* Partition start on the disk */
+    struct pcie_chain chain;
+    int layout;                     /* TOPO_LAYOUT_* */
+    u32 chunk_sectors;              /* Stripe chunk for STRIPED */
+    /*
+     * Set for the devices of a multi-device filesystem, keyed by its
+     * s_dev rather than a block device: anonymous for btrfs, the
+     * first device's for f2fs
+     */
+    bool filesystem;
+    uuid_t fs_uuid;
+    /* MULTIPATH: jiffies after which path states are stale */
+    unsigned long expires;
+    bool numa_iopolicy;             /* Paths are picked by NUMA distance */
+    int nr_members;
+    struct stack_member members[MAX_STACK_MEMBERS];
+};
+
+/*
+ * Topology cache, keyed by block dev_t. Readers only take
+ * rcu_read_lock(); writers serialize on topo_cache_lock. The whole
+ * cache is dropped whenever a PCI device or block device comes or
+ * goes, and topo_generation is bumped so that a topology built
+ * concurrently with a change is not inserted. The generation is also
+ * reported to userspace, which waits for it to move on topo_wait.
+ */
+static DEFINE_HASHTABLE(topo_cache, TOPO_CACHE_BITS);
+static DEFINE_SPINLOCK(topo_cache_lock);
+static atomic64_t topo_generation = ATOMIC64_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(topo_wait);
+static struct workqueue_struct *topo_free_wq;
+
+/* The module's own sysfs mount, never a caller's /sys */
+static struct vfsmount *sysfs_mnt;
+
+/* The block class is not exported, so its interface is registered lazily */
+static DEFINE_MUTEX(topo_block_intf_lock);
+static bool topo_block_intf_registered;
+/* Set while registering, which replays ->add_dev for every disk */
+static bool topo_block_intf_replaying;
+
+/*
+ * A file registered with FILE_TO_PCIE_IOCTL_REGISTER_FILES, with the
+ * block device it resolves to looked up once at registration
+ */
+struct fixed_file {
+    struct file *filp;              /* Holds a reference */
+    struct block_device *bdev;
+    int status;                     /* get_target_bdev() result */
+};
+
+struct fixed_table {
+    u32 nr;
+    struct fixed_file __rcu *files[];
+};
+
+/*
+ * Per-open state of /dev/file_to_pcie. Queries look registered files
+ * up under srcu without touching any reference count; updates
+ * serialize on lock and free what they replace after a grace period.
+ * Each open has its own srcu, so a registration only waits for the
+ * queries on the same open file, however long another client's run.
+ */
+struct file_to_pcie_ctx {
+    struct mutex lock;
+    struct srcu_struct srcu;
+    struct fixed_table __rcu *fixed;
+    u64 seen_generation;            /* Last one returned by read() */
+};
+
+/*
+ * Per-CPU statistics, summed when read through debugfs. Every field
+ * is a u64 counter.
+ */
+#define STATS_LATENCY_BUCKETS 40    /* log2(ns), the last one up to 9 min */
+
+#define STATS_ERRNO(e) { e, #e }
+static const struct {
+    int err;
+    const char *name;
+} stats_errnos[] = {
+    STATS_ERRNO(EPERM), STATS_ERRNO(ENOENT), STATS_ERRNO(EINTR),
+    STATS_ERRNO(EBADF), STATS_ERRNO(EAGAIN), STATS_ERRNO(ENOMEM),
+    STATS_ERRNO(EACCES), STATS_ERRNO(EFAULT), STATS_ERRNO(ENODEV),
+    STATS_ERRNO(ENOTDIR), STATS_ERRNO(EISDIR), STATS_ERRNO(EINVAL),
+    STATS_ERRNO(ENOTTY), STATS_ERRNO(ENOSPC), STATS_ERRNO(E2BIG),
+    STATS_ERRNO(EOPNOTSUPP), STATS_ERRNO(ENOTSUPP),
+};
+#undef STATS_ERRNO
+
+struct query_stats {
+    u64 calls;
+    u64 errors;
+    u64 cache_hits;
+    u64 cache_misses;               /* Topologies built */
+    u64 errnos[ARRAY_SIZE(stats_errnos) + 1];  /* The last one: others */
+    u64 latency[STATS_LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct query_stats, query_stats);
+static struct dentry *debugfs_dir;
+
+/*
+ * Stage timing for the tracepoints. The clock is only read while the
+ * event is enabled, so a disabled tracepoint costs a static branch.
+ */
+#define stage_clock(event) (trace_##event##_enabled() ? ktime_get_ns() : 0)
+
+static inline u64 stage_ns(u64 start)
+{
+    return start ? ktime_get_ns() - start : 0;
+}
+
+static const struct file_operations fops;
+
 /*
  * Get struct file* from file descriptor number
  * This requires access to the current task's files_struct
@@ -56,10 +342,13 @@ static struct file *get_file_from_fd(int fd)
     struct file *filp = NULL;
     struct files_struct *files;
     struct fdtable *fdt;
+    u64 start;
 
     if (fd < 0)
         return NULL;
 
+    start = stage_clock(file_to_pcie_get_file);
+
     rcu_read_lock();
     files = current->files;
     if (!files)
@@ -77,112 +366,66 @@ static struct file *get_file_from_fd(int fd)
 
 out_unlock:
     rcu_read_unlock();
+    trace_file_to_pcie_get_file(fd, filp ? 0 : -EBADF, stage_ns(start));
     return filp;
 }
 
 /*
- * Check if filesystem is a pseudo filesystem (no block device)
+ * The inode holding a file's data. Stacked filesystems such as
+ * overlayfs have no block device of their own, so queries go through
+ * to the real inode on the filesystem below; for everything else this
+ * is the inode itself.
  */
-static bool is_pseudo_filesystem(struct super_block *sb)
+static struct inode *data_inode(const struct dentry *dentry)
 {
-    if (!sb)
-        return false;
-
-    /* Pseudo filesystems don't have a block device */
-    if (!sb->s_bdev)
-        return true;
-
-    /* Check filesystem type name for common pseudo filesystems */
-    if (sb->s_type && sb->s_type->name) {
-        const char *name = sb->s_type->name;
-        if (strcmp(name, "proc") == 0 ||
-            strcmp(name, "sysfs") == 0 ||
-            strcmp(name, "tmpfs") == 0 ||
-            strcmp(name, "devtmpfs") == 0 ||
-            strcmp(name, "devpts") == 0 ||
-            strcmp(name, "cgroup") == 0 ||
-            strcmp(name, "cgroup2") == 0 ||
-            strcmp(name, "pstore") == 0 ||
-            strcmp(name, "debugfs") == 0 ||
-            strcmp(name, "tracefs") == 0 ||
-            strcmp(name, "securityfs") == 0 ||
-            strcmp(name, "configfs") == 0 ||
-            strcmp(name, "hugetlbfs") == 0 ||
-            strcmp(name, "mqueue") == 0 ||
-            strcmp(name, "bpf") == 0)
-            return true;
-    }
-
-    return false;
+    return d_real_inode(dentry);
 }
 
-/*
- * Check if filesystem is a network filesystem
- */
-static bool is_network_filesystem(struct super_block *sb)
+static struct inode *file_data_inode(struct file *filp)
 {
-    if (!sb || !sb->s_type || !sb->s_type->name)
-        return false;
-
-    const char *name = sb->s_type->name;
-    return (strcmp(name, "nfs") == 0 ||
-            strcmp(name, "nfs4") == 0 ||
-            strcmp(name, "cifs") == 0 ||
-            strcmp(name, "smb3") == 0 ||
-            strcmp(name, "9p") == 0 ||
-            strcmp(name, "ceph") == 0 ||
-            strcmp(name, "glusterfs") == 0 ||
-            strcmp(name, "fuse") == 0);
+    return data_inode(filp->f_path.dentry);
 }
 
 /*
- * Walk from struct file to find the underlying block device
- * Supports both block device files and regular files on filesystems
- * Returns NULL if file is on pseudo filesystem or network filesystem
+ * Resolve the block device behind an inode, classifying the failure
+ * Returns 0 on success, -ENOTSUPP for filesystems without a local
+ * block device (pseudo and network filesystems), and -ENODEV when the
+ * inode is neither a block device nor a regular file
+ *
+ * The verdict only depends on the superblock, which already caches
+ * it: s_bdev is set exactly for filesystems mounted on a block device
+ * (FS_REQUIRES_DEV), so classifying is one pointer test, whatever the
+ * filesystem type is called.
  */
-static struct block_device *get_block_device_from_file(
-    struct file *filp)
+static int get_inode_bdev(struct inode *inode, struct block_device **bdevp)
 {
-    struct inode *inode;
-    struct super_block *sb;
-    struct block_device *bdev = NULL;
-
-    if (!filp)
-        return NULL;
-
-    inode = file_inode(filp);
-    if (!inode)
-        return NULL;
+    u64 start = stage_clock(file_to_pcie_get_bdev);
+    int ret = 0;
 
-    /* Case 1: Block device file (e.g., /dev/sda1, /dev/md0) */
-    if (S_ISBLK(inode->i_mode)) {
-        bdev = I_BDEV(inode);
+    *bdevp = NULL;
+    if (!inode) {
+        ret = -ENODEV;
+    } else if (S_ISBLK(inode->i_mode)) {
+        /* Block device file (e.g., /dev/sda1, /dev/md0) */
         /* I_BDEV already gives us a valid reference, no need for bdget */
-        return bdev;
+        *bdevp = I_BDEV(inode);
+    } else if (S_ISREG(inode->i_mode)) {
+        /* sb->s_bdev is held by the superblock, no need for bdget */
+        *bdevp = inode->i_sb->s_bdev;
+        if (!*bdevp)
+            ret = -ENOTSUPP; /* Operation not supported */
+    } else {
+        ret = -ENODEV; /* No block device found */
     }
 
-    /* Case 2: Regular file on a filesystem */
-    if (S_ISREG(inode->i_mode)) {
-        sb = inode->i_sb;
-        if (!sb)
-            return NULL;
-
-        /* Check for pseudo filesystems (proc, sysfs, tmpfs, etc.) */
-        if (is_pseudo_filesystem(sb))
-            return NULL;
-
-        /* Check for network filesystems */
-        if (is_network_filesystem(sb))
-            return NULL;
-
-        /* Get the underlying block device from the superblock */
-        if (sb->s_bdev) {
-            bdev = sb->s_bdev;
-            /* sb->s_bdev already holds a reference, no need for bdget */
-        }
-    }
+    trace_file_to_pcie_get_bdev(*bdevp ? (*bdevp)->bd_dev : 0, ret,
+                                stage_ns(start));
+    return ret;
+}
 
-    return bdev;
+static int get_target_bdev(struct file *filp, struct block_device **bdevp)
+{
+    return get_inode_bdev(file_data_inode(filp), bdevp);
 }
 
 /*
@@ -195,22 +438,20 @@ static struct block_device *get_block_device_from_file(
  *                    sectors depend on filesystem layout, fragmentation,
  *                    and metadata placement.
  */
-static int calculate_sector_range(struct file *filp,
-                                  loff_t file_offset,
-                                  size_t length,
-                                  loff_t *sector_start,
-                                  loff_t *sector_end)
+static int inode_sector_range(struct inode *inode,
+                              loff_t file_offset,
+                              size_t length,
+                              loff_t *sector_start,
+                              loff_t *sector_end)
 {
-    struct inode *inode;
     struct super_block *sb;
     unsigned int blkbits;
     loff_t start_sector, end_sector;
     sector_t logical_block_start, logical_block_end;
 
-    if (!filp || !sector_start || !sector_end)
+    if (!sector_start || !sector_end)
         return -EINVAL;
 
-    inode = file_inode(filp);
     if (!inode)
         return -ENODEV;
 
@@ -254,177 +495,4907 @@ static int calculate_sector_range(struct file *filp,
     return -ENODEV;
 }
 
+static int calculate_sector_range(struct inode *inode,
+                                  loff_t file_offset,
+                                  size_t length,
+                                  loff_t *sector_start,
+                                  loff_t *sector_end)
+{
+    u64 start = stage_clock(file_to_pcie_sector_range);
+    dev_t dev = 0;
+    int ret;
+
+    ret = inode_sector_range(inode, file_offset, length, sector_start,
+                             sector_end);
+
+    if (trace_file_to_pcie_sector_range_enabled()) {
+        if (inode)
+            dev = S_ISBLK(inode->i_mode) ? inode->i_rdev :
+                  inode->i_sb->s_dev;
+        trace_file_to_pcie_sector_range(dev, file_offset, length,
+                                        ret < 0 ? -1 : *sector_start,
+                                        ret < 0 ? -1 : *sector_end, ret,
+                                        stage_ns(start));
+    }
+    return ret;
+}
+
 /*
- * Find PCIe devices associated with a block device and map file segment
- * This walks through the device hierarchy to find PCI devices and
- * calculates which parts of the file segment map to each device
+ * Sector range of a segment, or -1 for both with
+ * FILE_TO_PCIE_QUERY_F_TOPOLOGY, which maps the segment onto every
+ * device below the file without asking the filesystem
  */
-static int find_pcie_devices_for_bdev(struct block_device *bdev,
-                                      struct file *filp,
-                                      struct file_to_pcie_request *req)
+static int segment_sector_range(struct inode *inode, loff_t file_offset,
+                                size_t length, u32 flags,
+                                loff_t *sector_start, loff_t *sector_end)
 {
-    struct device *dev;
-    struct pci_dev *pdev;
-    loff_t sector_start, sector_end;
-    int count = 0;
+    if (flags & FILE_TO_PCIE_QUERY_F_TOPOLOGY) {
+        *sector_start = -1;
+        *sector_end = -1;
+        return 0;
+    }
+    return calculate_sector_range(inode, file_offset, length, sector_start,
+                                  sector_end);
+}
+
+/*
+ * Look up a registered file; the caller holds fctx->srcu
+ */
+static struct fixed_file *lookup_fixed_file(struct file_to_pcie_ctx *fctx,
+                                            u32 index)
+{
+    struct fixed_table *table = srcu_dereference(fctx->fixed, &fctx->srcu);
+
+    if (!table || index >= table->nr)
+        return NULL;
+    index = array_index_nospec(index, table->nr);
+    return srcu_dereference(table->files[index], &fctx->srcu);
+}
+
+/*
+ * The file a request is about, and the block device behind it. It is
+ * looked up by fd and referenced, a registered file that stays pinned
+ * while its open's srcu is held, or found by path and never opened.
+ */
+struct target_ref {
+    struct inode *inode;
+    struct block_device *bdev;
+    struct file *filp;              /* NULL when found by path */
+    struct path path;               /* Referenced when found by path */
+    struct srcu_struct *srcu;       /* Holding the table, with srcu_idx */
+    int srcu_idx;                   /* -1 unless pinned by the table */
+};
+
+/*
+ * Resolve fd, an index into the registered table if fixed
+ * Returns 0 on success, negative error code on failure
+ */
+static int get_target(struct file_to_pcie_ctx *fctx, int fd, bool fixed,
+                      struct target_ref *t)
+{
+    struct fixed_file *ff;
     int ret;
 
-    if (!bdev || !req)
+    if (fixed) {
+        t->srcu = &fctx->srcu;
+        t->srcu_idx = srcu_read_lock(t->srcu);
+        ff = lookup_fixed_file(fctx, fd);
+        ret = ff ? ff->status : -EBADF;
+        if (ret < 0) {
+            srcu_read_unlock(t->srcu, t->srcu_idx);
+            return ret;
+        }
+        t->filp = ff->filp;
+        t->inode = file_data_inode(t->filp);
+        t->bdev = ff->bdev;
+        return 0;
+    }
+
+    t->srcu_idx = -1;
+    t->filp = get_file_from_fd(fd);
+    if (!t->filp)
+        return -EBADF;
+
+    t->inode = file_data_inode(t->filp);
+    ret = get_target_bdev(t->filp, &t->bdev);
+    if (ret < 0)
+        fput(t->filp);
+    return ret;
+}
+
+/*
+ * Reading a file's placement by path needs the same permission an
+ * open() for reading would
+ */
+static int may_query_path(const struct path *path)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    return inode_permission(mnt_idmap(path->mnt), d_inode(path->dentry),
+                            MAY_READ);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+    return inode_permission(mnt_user_ns(path->mnt), d_inode(path->dentry),
+                            MAY_READ);
+#else
+    return inode_permission(d_inode(path->dentry), MAY_READ);
+#endif
+}
+
+/*
+ * Check a looked-up path and resolve its block device. Only regular
+ * files are accepted: device nodes have to be opened to reach theirs.
+ */
+static int get_path_bdev(const struct path *path, struct block_device **bdevp)
+{
+    struct inode *inode = d_inode(path->dentry);
+    int ret;
+
+    if (!inode)
+        return -ENOENT;
+    if (S_ISDIR(inode->i_mode))
+        return -EISDIR;
+    if (!S_ISREG(inode->i_mode))
         return -EINVAL;
 
-    /* Calculate sector range for the file segment */
-    ret = calculate_sector_range(filp, req->offset, req->length,
-                                 &sector_start, &sector_end);
+    ret = may_query_path(path);
     if (ret < 0)
         return ret;
+    return get_inode_bdev(data_inode(path->dentry), bdevp);
+}
 
-    /* Get the device from the block device */
-    if (!bdev->bd_disk)
-        return -ENODEV;
+/*
+ * Resolve name relative to dirfd (or AT_FDCWD), following symlinks,
+ * without opening it
+ */
+static int get_path_target(int dirfd, const char __user *name,
+                           struct target_ref *t)
+{
+    int ret;
 
-    /* disk_to_dev macro:
-     * - In kernels < 6.8: defined in genhd.h as &disk->part0.__dev
-     * - In kernels >= 6.8: defined in blkdev.h as &disk->part0->bd_device
-     */
-    dev = disk_to_dev(bdev->bd_disk);
-    if (!dev)
-        return -ENODEV;
+    t->srcu_idx = -1;
+    t->filp = NULL;
+    ret = user_path_at(dirfd, name, LOOKUP_FOLLOW, &t->path);
+    if (ret)
+        return ret;
 
-    /* Walk up the device hierarchy to find PCI devices */
-    while (dev && count < MAX_PCIE_DEVICES) {
-        /* Check if this device is a PCI device */
-        pdev = to_pci_dev(dev);
-        if (pdev) {
-            req->pcie_devices[count].vendor_id = pdev->vendor;
-            req->pcie_devices[count].device_id = pdev->device;
-            req->pcie_devices[count].bus = pdev->bus->number;
-            req->pcie_devices[count].device =
-                PCI_SLOT(pdev->devfn);
-            req->pcie_devices[count].function =
-                PCI_FUNC(pdev->devfn);
-            snprintf(req->pcie_devices[count].name,
-                     sizeof(req->pcie_devices[count].name),
-                     "%s", pci_name(pdev));
+    t->inode = data_inode(t->path.dentry);
+    ret = get_path_bdev(&t->path, &t->bdev);
+    if (ret < 0)
+        path_put(&t->path);
+    return ret;
+}
 
-            /* Map the entire file segment to this PCIe device */
-            /* For now, all segments map to the same device(s) */
-            req->pcie_devices[count].file_offset_start = req->offset;
-            req->pcie_devices[count].file_offset_end =
-                req->offset + req->length - 1;
-            req->pcie_devices[count].sector_start = sector_start;
-            req->pcie_devices[count].sector_end = sector_end;
+static void put_target(struct target_ref *t)
+{
+    if (t->srcu_idx >= 0)
+        srcu_read_unlock(t->srcu, t->srcu_idx);
+    else if (t->filp)
+        fput(t->filp);
+    else
+        path_put(&t->path);
+}
 
-            count++;
-        }
+static struct fixed_file *create_fixed_file(int fd)
+{
+    struct fixed_file *ff;
+
+    ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+    if (!ff)
+        return ERR_PTR(-ENOMEM);
+
+    ff->filp = get_file_from_fd(fd);
+    if (!ff->filp) {
+        kfree(ff);
+        return ERR_PTR(-EBADF);
+    }
 
-        /* Move to parent device */
-        dev = dev->parent;
+    /* A table holding its own file, directly or not, would never go */
+    if (ff->filp->f_op == &fops) {
+        fput(ff->filp);
+        kfree(ff);
+        return ERR_PTR(-EINVAL);
     }
 
-    req->pcie_count = count;
-    return count;
+    ff->status = get_target_bdev(ff->filp, &ff->bdev);
+    return ff;
+}
+
+static void free_fixed_file(struct fixed_file *ff)
+{
+    if (ff) {
+        fput(ff->filp);
+        kfree(ff);
+    }
 }
 
 /*
- * IOCTL handler
+ * FILE_TO_PCIE_IOCTL_REGISTER_FILES: set slots [offset, offset + count)
+ * of the registered table to the given fds, -1 clearing a slot. The
+ * table grows as needed. All slots are updated, or none.
  */
-static long file_to_pcie_ioctl(struct file *filp, unsigned int cmd,
-                                unsigned long arg)
+static long file_to_pcie_register_files(struct file_to_pcie_ctx *fctx,
+                                        void __user *argp)
 {
-    struct file_to_pcie_request req;
-    struct file *target_file = NULL;
-    struct block_device *bdev = NULL;
+    struct file_to_pcie_register reg;
+    struct fixed_table *old, *table;
+    struct fixed_file **files, *prev;
+    int __user *ufds;
+    u32 end, i;
     long ret = 0;
+    int fd;
 
-    if (_IOC_TYPE(cmd) != FILE_TO_PCIE_IOC_MAGIC)
-        return -ENOTTY;
-
-    if (_IOC_NR(cmd) != 1)
-        return -ENOTTY;
-
-    /* Copy request from userspace */
-    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+    if (copy_from_user(&reg, argp, sizeof(reg)))
         return -EFAULT;
 
-    /* Get the struct file* from the file descriptor */
-    target_file = get_file_from_fd(req.fd);
-    if (!target_file) {
-        ret = -EBADF;
-        goto out;
-    }
-
-    /* Get the block device from the file */
-    bdev = get_block_device_from_file(target_file);
-    if (!bdev) {
-        struct inode *inode = file_inode(target_file);
-        struct super_block *sb = NULL;
+    if (reg.count == 0 || reg.offset >= MAX_FIXED_FILES ||
+        reg.count > MAX_FIXED_FILES - reg.offset)
+        return -EINVAL;
+    end = reg.offset + reg.count;
+    ufds = u64_to_user_ptr(reg.fds);
 
-        if (inode && S_ISREG(inode->i_mode))
-            sb = inode->i_sb;
+    files = kvcalloc(reg.count, sizeof(*files), GFP_KERNEL);
+    if (!files)
+        return -ENOMEM;
 
-        /* Check if this is a pseudo filesystem */
-        if (sb && is_pseudo_filesystem(sb)) {
-            ret = -ENOTSUPP; /* Operation not supported */
-            goto out_file;
+    for (i = 0; i < reg.count; i++) {
+        if (get_user(fd, ufds + i)) {
+            ret = -EFAULT;
+            goto out_free;
         }
-
-        /* Check if this is a network filesystem */
-        if (sb && is_network_filesystem(sb)) {
-            ret = -ENOTSUPP; /* Operation not supported */
-            goto out_file;
+        if (fd < 0)
+            continue;
+        files[i] = create_fixed_file(fd);
+        if (IS_ERR(files[i])) {
+            ret = PTR_ERR(files[i]);
+            files[i] = NULL;
+            goto out_free;
         }
-
-        /* No block device found */
-        ret = -ENODEV;
-        goto out_file;
     }
 
-    /* Find PCIe devices */
-    ret = find_pcie_devices_for_bdev(bdev, target_file, &req);
-    if (ret < 0)
-        goto out_bdev;
-
-    /* If no PCIe devices found, that's OK - return success with count=0 */
-    /* This handles non-PCIe block devices (e.g., USB, SCSI, etc.) */
-    req.pcie_count = (ret >= 0) ? ret : 0;
+    mutex_lock(&fctx->lock);
+    old = rcu_dereference_protected(fctx->fixed, lockdep_is_held(&fctx->lock));
+    table = old;
+    if (!old || old->nr < end) {
+        table = kvzalloc(struct_size(table, files, end), GFP_KERNEL);
+        if (!table) {
+            mutex_unlock(&fctx->lock);
+            ret = -ENOMEM;
+            goto out_free;
+        }
+        table->nr = end;
+        for (i = 0; old && i < old->nr; i++)
+            RCU_INIT_POINTER(table->files[i],
+                             rcu_dereference_protected(old->files[i], 1));
+    }
 
-    /* Copy results back to userspace */
-    if (copy_to_user((void __user *)arg, &req, sizeof(req))) {
-        ret = -EFAULT;
-        goto out_bdev;
+    /* Swap the new files in; files[] ends up holding the replaced ones */
+    for (i = 0; i < reg.count; i++) {
+        prev = rcu_dereference_protected(table->files[reg.offset + i],
+                                         lockdep_is_held(&fctx->lock));
+        rcu_assign_pointer(table->files[reg.offset + i], files[i]);
+        files[i] = prev;
     }
 
-    ret = 0; /* Success */
+    if (table != old)
+        rcu_assign_pointer(fctx->fixed, table);
+    mutex_unlock(&fctx->lock);
 
-out_bdev:
-    /* No need to bdput - we didn't take an extra reference */
-out_file:
-    if (target_file)
-        fput(target_file);
-out:
+    synchronize_srcu(&fctx->srcu);
+    if (table != old)
+        kvfree(old);
+
+out_free:
+    for (i = 0; i < reg.count; i++)
+        free_fixed_file(files[i]);
+    kvfree(files);
     return ret;
 }
 
 /*
- * File operations
+ * Drop a registered table once its open file is gone; no query can
+ * be running against it any more
  */
-static int file_to_pcie_open(struct inode *inode, struct file *file)
+static void free_fixed_table(struct file_to_pcie_ctx *fctx)
 {
+    struct fixed_table *table = rcu_dereference_protected(fctx->fixed, 1);
+    u32 i;
+
+    if (!table)
+        return;
+    for (i = 0; i < table->nr; i++)
+        free_fixed_file(rcu_dereference_protected(table->files[i], 1));
+    kvfree(table);
+}
+
+/*
+ * Walk up the device hierarchy from dev and take a reference on
+ * each PCI device found, endpoint first
+ * Returns 0 on success, negative error code on failure
+ */
+static int collect_pcie_chain(struct device *dev, struct pcie_chain *chain)
+{
+    struct device *d;
+    int n = 0;
+
+    chain->count = 0;
+    chain->pdevs = NULL;
+
+    /* to_pci_dev() is a container_of, so check the bus first */
+    for (d = dev; d; d = d->parent)
+        n += dev_is_pci(d);
+    if (!n)
+        return 0;
+
+    chain->pdevs = kcalloc(n, sizeof(*chain->pdevs), GFP_KERNEL);
+    if (!chain->pdevs)
+        return -ENOMEM;
+
+    /* Walk up the device hierarchy to find PCI devices */
+    for (d = dev; d && chain->count < n; d = d->parent) {
+        if (dev_is_pci(d))
+            chain->pdevs[chain->count++] = pci_dev_get(to_pci_dev(d));
+    }
+
+    return 0;
+}
+
+static void release_pcie_chain(struct pcie_chain *chain)
+{
+    int i;
+
+    for (i = 0; i < chain->count; i++)
+        pci_dev_put(chain->pdevs[i]);
+    kfree(chain->pdevs);
+    chain->pdevs = NULL;
+    chain->count = 0;
+}
+
+/*
+ * Fill the identity fields of a device entry, and its name unless
+ * the caller has asked to go without (the name is left empty then)
+ */
+static void fill_device_info(struct file_to_pcie_device_info *info,
+                             struct pci_dev *pdev, bool name)
+{
+    info->vendor_id = pdev->vendor;
+    info->device_id = pdev->device;
+    info->bus = pdev->bus->number;
+    info->device = PCI_SLOT(pdev->devfn);
+    info->function = PCI_FUNC(pdev->devfn);
+    if (name)
+        strscpy(info->name, pci_name(pdev), sizeof(info->name));
+    else
+        info->name[0] = '\0';
+}
+
+/*
+ * Read a sysfs attribute of dev into buf, which must be PAGE_SIZE.
+ * name is relative to the device's directory and may pass through
+ * links ("md/rd0/offset"). Going through the file rather than calling
+ * ->show() directly holds the kernfs active reference that keeps the
+ * attribute's owner alive, so a member removed underneath us makes
+ * the read fail instead of touching freed memory. The path resolves
+ * in the module's own sysfs mount, never in the caller's mounts: what
+ * is read here ends up in the shared topology cache.
+ */
+static ssize_t read_sysfs_attr(struct device *dev, const char *name,
+                               char *buf)
+{
+    struct path root = {
+        .mnt = sysfs_mnt,
+        .dentry = sysfs_mnt->mnt_root,
+    };
+    struct file *file;
+    char *kpath, *path;
+    loff_t pos = 0;
+    ssize_t ret;
+
+    kpath = kobject_get_path(&dev->kobj, GFP_KERNEL);
+    if (!kpath)
+        return -ENOMEM;
+    path = kasprintf(GFP_KERNEL, "%s/%s", kpath, name);
+    kfree(kpath);
+    if (!path)
+        return -ENOMEM;
+
+    /* Lookups, ".." in links included, stay beneath root */
+    file = file_open_root(&root, path, O_RDONLY, 0);
+    kfree(path);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+
+    ret = kernel_read(file, buf, PAGE_SIZE - 1, &pos);
+    fput(file);
+    return ret;
+}
+
+static int read_sysfs_u64(struct device *dev, const char *name,
+                          char *buf, u64 *val)
+{
+    ssize_t ret = read_sysfs_attr(dev, name, buf);
+
+    if (ret < 0)
+        return ret;
+    buf[min_t(ssize_t, ret, PAGE_SIZE - 1)] = '\0';
+    return kstrtoull(strim(buf), 0, val);
+}
+
+/*
+ * Find the block device whose "dev" attribute is name, relative to
+ * dev. Returns a referenced device, or NULL.
+ */
+static struct device *read_sysfs_devt(struct device *dev, const char *name,
+                                      char *buf)
+{
+    unsigned int major, minor;
+    ssize_t len = read_sysfs_attr(dev, name, buf);
+
+    if (len <= 0 || !dev->class)
+        return NULL;
+    buf[min_t(ssize_t, len, PAGE_SIZE - 1)] = '\0';
+    if (sscanf(buf, "%u:%u", &major, &minor) != 2)
+        return NULL;
+    return class_find_device_by_devt(dev->class, MKDEV(major, minor));
+}
+
+/*
+ * Add a member block device. The member takes its own reference.
+ */
+static int add_stack_member(struct bdev_topology *topo, struct device *dev,
+                            sector_t data_offset)
+{
+    struct stack_member *m;
+
+    if (topo->nr_members >= MAX_STACK_MEMBERS)
+        return -E2BIG;
+
+    m = &topo->members[topo->nr_members++];
+    m->bdev = dev_to_bdev(get_device(dev));
+    m->data_offset = data_offset;
+    return 0;
+}
+
+/*
+ * md: the array's "md" directory lists members in raid slot order
+ * as rd0..rdN, each linking to the rdev directory with that member's
+ * data offset, usable size, and a "block" link to its block device.
+ * Only single-zone raid0 (all members the same size) and raid1 have
+ * a mapping we can reproduce; other levels report their members
+ * without splitting.
+ */
+static void resolve_md_members(struct gendisk *disk,
+                               struct bdev_topology *topo, char *buf)
+{
+    struct device *disk_dev = disk_to_dev(disk), *blk;
+    u64 raid_disks, chunk_bytes, offset, size, first_size = 0;
+    char name[32];
+    char level[16];
+    bool same_size = true;
+    ssize_t len;
+    int i;
+
+    /* Not md after all, unless it is md's own major */
+    len = read_sysfs_attr(disk_dev, "md/level", buf);
+    if (len == -ENOENT && disk->major != MD_MAJOR)
+        return;
+
+    topo->layout = TOPO_LAYOUT_UNKNOWN;
+    if (len <= 0)
+        return;
+    buf[min_t(ssize_t, len, PAGE_SIZE - 1)] = '\0';
+    strscpy(level, strim(buf), sizeof(level));
+
+    if (read_sysfs_u64(disk_dev, "md/raid_disks", buf, &raid_disks))
+        return;
+
+    for (i = 0; i < raid_disks && i < MAX_STACK_MEMBERS; i++) {
+        snprintf(name, sizeof(name), "md/rd%d/block/dev", i);
+        blk = read_sysfs_devt(disk_dev, name, buf);
+        if (!blk)
+            break;
+
+        snprintf(name, sizeof(name), "md/rd%d/offset", i);
+        if (read_sysfs_u64(disk_dev, name, buf, &offset))
+            offset = 0;
+        snprintf(name, sizeof(name), "md/rd%d/size", i);
+        if (read_sysfs_u64(disk_dev, name, buf, &size))
+            size = 0;
+        if (i == 0)
+            first_size = size;
+        same_size &= (size == first_size && size != 0);
+
+        add_stack_member(topo, blk, offset);
+        put_device(blk);
+    }
+
+    /* Only claim a layout when every slot resolved to a member */
+    if (topo->nr_members != raid_disks)
+        return;
+
+    if (sysfs_streq(level, "raid1")) {
+        topo->layout = TOPO_LAYOUT_MIRRORED;
+    } else if (sysfs_streq(level, "raid0") && same_size &&
+               !read_sysfs_u64(disk_dev, "md/chunk_size", buf,
+                               &chunk_bytes) &&
+               chunk_bytes >= SECTOR_SIZE) {
+        topo->layout = TOPO_LAYOUT_STRIPED;
+        topo->chunk_sectors = chunk_bytes >> SECTOR_SHIFT;
+    }
+}
+
+/*
+ * Generic holders/slaves: any block device with a holders/ link
+ * named after this disk is one of its members (device-mapper, and
+ * anything else using bd_link_disk_holder()). The target table is
+ * not visible to modules, so the layout is left unknown. A table
+ * reload changes the members in place, so they are re-read after
+ * MEMBERS_TTL.
+ */
+struct holder_scan {
+    struct gendisk *disk;
+    struct bdev_topology *topo;
+};
+
+static int match_holder_member(struct device *dev, void *data)
+{
+    struct holder_scan *scan = data;
+    struct block_device *member = dev_to_bdev(dev);
+    struct kernfs_node *kn;
+
+    if (member->bd_disk == scan->disk || !member->bd_holder_dir)
+        return 0;
+
+    kn = kernfs_find_and_get(member->bd_holder_dir->sd,
+                             scan->disk->disk_name);
+    if (!kn)
+        return 0;
+    kernfs_put(kn);
+
+    return add_stack_member(scan->topo, dev, 0) ? 1 : 0;
+}
+
+static void resolve_holder_members(struct gendisk *disk,
+                                   struct bdev_topology *topo)
+{
+    struct holder_scan scan = { .disk = disk, .topo = topo };
+    struct device *disk_dev = disk_to_dev(disk);
+
+    /* Nothing is stacked on top of anything without a slaves/ dir */
+    if (!disk->slave_dir || !disk_dev->class)
+        return;
+
+    class_for_each_device(disk_dev->class, NULL, &scan,
+                          match_holder_member);
+    if (topo->nr_members) {
+        topo->layout = TOPO_LAYOUT_UNKNOWN;
+        topo->expires = jiffies + MEMBERS_TTL;
+    }
+}
+
+/*
+ * NVMe native multipath: a head disk nvme<S>n<H>, a child of its
+ * subsystem nvme-subsys<S>, is backed by one hidden path disk
+ * nvme<S>c<C>n<H> per controller nvme<C> that reaches the namespace.
+ * Each path disk is a child of its controller, so walking up from it
+ * finds that controller's PCIe function. ANA states change without
+ * any device coming or going, so they are re-read after
+ * PATH_STATE_TTL.
+ */
+static bool is_nvme_head(struct gendisk *disk)
+{
+    struct device *parent = disk_to_dev(disk)->parent;
+
+    return parent && parent->class &&
+           !strcmp(parent->class->name, "nvme-subsystem");
+}
+
+struct nvme_path_scan {
+    int subsys;
+    int head;
+    struct bdev_topology *topo;
+    char *buf;
+};
+
+/* Read a sysfs attribute as a trimmed string, or NULL */
+static const char *read_sysfs_str(struct device *dev, const char *name,
+                                  char *buf)
+{
+    ssize_t len = read_sysfs_attr(dev, name, buf);
+
+    if (len <= 0)
+        return NULL;
+    buf[min_t(ssize_t, len, PAGE_SIZE - 1)] = '\0';
+    return strim(buf);
+}
+
+static u8 read_ana_state(struct device *dev, char *buf)
+{
+    static const char * const names[] = {
+        [FILE_TO_PCIE_PATH_OPTIMIZED] = "optimized",
+        [FILE_TO_PCIE_PATH_NON_OPTIMIZED] = "non-optimized",
+        [FILE_TO_PCIE_PATH_INACCESSIBLE] = "inaccessible",
+        [FILE_TO_PCIE_PATH_PERSISTENT_LOSS] = "persistent-loss",
+        [FILE_TO_PCIE_PATH_CHANGE] = "change",
+    };
+    const char *state = read_sysfs_str(dev, "ana_state", buf);
+    u8 i;
+
+    /* Only controllers using ANA have the attribute */
+    if (!state)
+        return FILE_TO_PCIE_PATH_OPTIMIZED;
+    for (i = FILE_TO_PCIE_PATH_OPTIMIZED; i < ARRAY_SIZE(names); i++) {
+        if (!strcmp(state, names[i]))
+            return i;
+    }
+    return FILE_TO_PCIE_PATH_INACCESSIBLE;
+}
+
+static int match_nvme_path(struct device *dev, void *data)
+{
+    struct nvme_path_scan *scan = data;
+    struct stack_member *m;
+    const char *state;
+    int subsys, ctrl, head, len = 0;
+
+    if (sscanf(dev_name(dev), "nvme%dc%dn%d%n", &subsys, &ctrl, &head,
+               &len) != 3 || dev_name(dev)[len] ||
+        subsys != scan->subsys || head != scan->head)
+        return 0;
+
+    if (add_stack_member(scan->topo, dev, 0))
+        return 1;
+
+    m = &scan->topo->members[scan->topo->nr_members - 1];
+    m->path_state = read_ana_state(dev, scan->buf);
+    m->path_controller = ctrl;
+    m->numa_node = dev_to_node(dev);
+    if (dev->parent) {
+        state = read_sysfs_str(dev->parent, "state", scan->buf);
+        if (state && !strcmp(state, "live"))
+            m->path_flags |= FILE_TO_PCIE_PATH_F_LIVE;
+    }
+    return 0;
+}
+
+static void resolve_nvme_paths(struct gendisk *disk,
+                               struct bdev_topology *topo, char *buf)
+{
+    struct nvme_path_scan scan = { .topo = topo, .buf = buf };
+    struct device *disk_dev = disk_to_dev(disk);
+    const char *policy;
+    int len = 0;
+
+    if (sscanf(disk->disk_name, "nvme%dn%d%n", &scan.subsys, &scan.head,
+               &len) != 2 || disk->disk_name[len] || !disk_dev->class)
+        return;
+
+    class_for_each_device(disk_dev->class, NULL, &scan, match_nvme_path);
+    if (!topo->nr_members)
+        return;
+
+    topo->layout = TOPO_LAYOUT_MULTIPATH;
+    topo->expires = jiffies + PATH_STATE_TTL;
+    policy = read_sysfs_str(disk_dev->parent, "iopolicy", buf);
+    topo->numa_iopolicy = !policy || !strcmp(policy, "numa");
+}
+
+static void free_topology(struct bdev_topology *topo)
+{
+    int i;
+
+    release_pcie_chain(&topo->chain);
+    if (topo->bdev)
+        put_device(&topo->bdev->bd_device);
+    for (i = 0; i < topo->nr_members; i++) {
+        release_pcie_chain(&topo->members[i].chain);
+        /* Members' topologies are private to their parent */
+        if (topo->members[i].topo)
+            free_topology(topo->members[i].topo);
+        put_device(&topo->members[i].bdev->bd_device);
+    }
+    kfree(topo);
+}
+
+static void free_topology_work(struct work_struct *work)
+{
+    free_topology(container_of(to_rcu_work(work), struct bdev_topology,
+                               free_work));
+}
+
+/*
+ * Drop a reference. The last one frees the topology after an RCU
+ * grace period, from process context since dropping the device
+ * references may sleep.
+ */
+static void put_topology(struct bdev_topology *topo)
+{
+    if (topo && refcount_dec_and_test(&topo->ref))
+        queue_rcu_work(topo_free_wq, &topo->free_work);
+}
+
+static bool is_md_disk(struct gendisk *disk)
+{
+    return disk->major == MD_MAJOR || !strncmp(disk->disk_name, "md", 2);
+}
+
+/* md, device-mapper, NVMe multipath, or anything else with members */
+static bool is_stacked_disk(struct gendisk *disk)
+{
+    return is_md_disk(disk) || !strncmp(disk->disk_name, "dm-", 3) ||
+           is_nvme_head(disk);
+}
+
+static struct bdev_topology *alloc_topology(void)
+{
+    struct bdev_topology *topo;
+
+    topo = kzalloc(sizeof(*topo), GFP_KERNEL);
+    if (!topo)
+        return NULL;
+
+    refcount_set(&topo->ref, 1);
+    INIT_RCU_WORK(&topo->free_work, free_topology_work);
+    return topo;
+}
+
+static struct bdev_topology *build_topology(struct block_device *bdev,
+                                            int depth);
+
+/*
+ * Resolve the PCIe chain of each member, and the members of members
+ * that are stacked themselves, so that queries reach the physical
+ * disks through any number of md and dm layers
+ */
+static int resolve_member_chains(struct bdev_topology *topo, int depth)
+{
+    struct stack_member *m;
+    struct bdev_topology *sub;
+    int ret;
+    int i;
+
+    for (i = 0; i < topo->nr_members; i++) {
+        m = &topo->members[i];
+        ret = collect_pcie_chain(disk_to_dev(m->bdev->bd_disk), &m->chain);
+        if (ret < 0)
+            return ret;
+
+        if (depth >= MAX_STACK_DEPTH || !is_stacked_disk(m->bdev->bd_disk))
+            continue;
+
+        sub = build_topology(m->bdev, depth + 1);
+        if (IS_ERR(sub))
+            return PTR_ERR(sub);
+        if (!sub->nr_members) {
+            free_topology(sub);
+            continue;
+        }
+
+        m->topo = sub;
+        /* Path states below expire the whole stack */
+        if (sub->expires && (!topo->expires ||
+                             time_before(sub->expires, topo->expires)))
+            topo->expires = sub->expires;
+    }
+    return 0;
+}
+
+/*
+ * Resolve the PCIe devices behind a block device. For md and
+ * device-mapper devices, also resolve each member device and its own
+ * PCIe chain, plus enough geometry to split ranges across members.
+ * depth counts the stacked devices above bdev.
+ */
+static struct bdev_topology *build_topology(struct block_device *bdev,
+                                            int depth)
+{
+    struct bdev_topology *topo;
+    struct gendisk *disk = bdev->bd_disk;
+    char *buf;
+    int ret;
+
+    if (!disk)
+        return ERR_PTR(-ENODEV);
+
+    topo = alloc_topology();
+    if (!topo)
+        return ERR_PTR(-ENOMEM);
+
+    topo->dev = bdev->bd_dev;
+    topo->bdev = bdev;
+    get_device(&bdev->bd_device);
+    topo->start_sect = get_start_sect(bdev);
+
+    /* disk_to_dev macro:
+     * - In kernels < 6.8: defined in genhd.h as &disk->part0.__dev
+     * - In kernels >= 6.8: defined in blkdev.h as &disk->part0->bd_device
+     */
+    ret = collect_pcie_chain(disk_to_dev(disk), &topo->chain);
+    if (ret < 0)
+        goto out_free;
+
+    if (is_md_disk(disk) || is_nvme_head(disk)) {
+        buf = (char *)__get_free_page(GFP_KERNEL);
+        if (buf) {
+            if (is_md_disk(disk))
+                resolve_md_members(disk, topo, buf);
+            else
+                resolve_nvme_paths(disk, topo, buf);
+            free_page((unsigned long)buf);
+        }
+    } else {
+        resolve_holder_members(disk, topo);
+    }
+
+    ret = resolve_member_chains(topo, depth);
+    if (ret < 0)
+        goto out_free;
+
+    return topo;
+
+out_free:
+    /* Not visible to anyone yet, so there is no need to wait for RCU */
+    free_topology(topo);
+    return ERR_PTR(ret);
+}
+
+/*
+ * btrfs spreads one filesystem over several devices, of which
+ * sb->s_bdev is only one. They are listed by block device name under
+ * /sys/fs/btrfs/<fsid>/devices/. Which of them holds a given range is
+ * recorded in the chunk tree, which is not exported to modules, so
+ * the layout is left unknown.
+ */
+struct fs_member_scan {
+    struct kernfs_node *devices;
+    struct bdev_topology *topo;
+};
+
+static int match_fs_member(struct device *dev, void *data)
+{
+    struct fs_member_scan *scan = data;
+    struct kernfs_node *kn;
+
+    kn = kernfs_find_and_get(scan->devices, dev_name(dev));
+    if (!kn)
+        return 0;
+    kernfs_put(kn);
+
+    return add_stack_member(scan->topo, dev, 0) ? 1 : 0;
+}
+
+static void resolve_btrfs_members(struct super_block *sb,
+                                  struct bdev_topology *topo)
+{
+    struct fs_member_scan scan = { .topo = topo };
+    struct kernfs_node *btrfs, *fsid;
+    char name[UUID_STRING_LEN + 1];
+
+    btrfs = kernfs_find_and_get(fs_kobj->sd, "btrfs");
+    if (!btrfs)
+        return;
+
+    snprintf(name, sizeof(name), "%pU", &sb->s_uuid);
+    fsid = kernfs_find_and_get(btrfs, name);
+    kernfs_put(btrfs);
+    if (!fsid)
+        return;
+
+    scan.devices = kernfs_find_and_get(fsid, "devices");
+    kernfs_put(fsid);
+    if (!scan.devices)
+        return;
+
+    class_for_each_device(disk_to_dev(sb->s_bdev->bd_disk)->class, NULL,
+                          &scan, match_fs_member);
+    kernfs_put(scan.devices);
+}
+
+/*
+ * f2fs on several devices addresses them as one block space, cut into
+ * consecutive ranges in the order of the device list in its
+ * superblock. A zoned drive needs a conventional device for f2fs
+ * metadata, so this is how f2fs runs on ZNS. f2fs holds every device
+ * beyond the first open with the superblock as holder, which is how
+ * members are found; the paths in the list, which resolve differently
+ * in every mount namespace, only tell held devices apart when there
+ * are more than two.
+ */
+struct f2fs_member_scan {
+    struct super_block *sb;
+    struct device *held[MAX_DEVICES];
+    int nr;
+};
+
+static int match_f2fs_member(struct device *dev, void *data)
+{
+    struct f2fs_member_scan *scan = data;
+    struct block_device *bdev = dev_to_bdev(dev);
+
+    if (bdev == scan->sb->s_bdev || READ_ONCE(bdev->bd_holder) != scan->sb)
+        return 0;
+    if (scan->nr == MAX_DEVICES)
+        return 1;
+    scan->held[scan->nr++] = get_device(dev);
+    return 0;
+}
+
+/* The held device for an entry past the first of a list of nr */
+static struct device *pick_f2fs_member(const struct f2fs_member_scan *scan,
+                                       u32 nr, const char *path)
+{
+    int i;
+
+    if (nr == 2 && scan->nr == 1)
+        return scan->held[0];
+    for (i = 0; i < scan->nr; i++) {
+        if (!strcmp(dev_name(scan->held[i]), kbasename(path)))
+            return scan->held[i];
+    }
+    return NULL;
+}
+
+/*
+ * Read the device list of a multi-device f2fs. The layout is CONCAT
+ * if every listed device was found, and left unknown otherwise; a
+ * single-device f2fs gets no members.
+ */
+static void resolve_f2fs_members(struct super_block *sb,
+                                 struct bdev_topology *topo)
+{
+    struct f2fs_member_scan scan = { .sb = sb };
+    const struct f2fs_super_block *raw;
+    struct stack_member *m;
+    struct buffer_head *bh;
+    struct device *dev;
+    char path[MAX_PATH_LEN + 1];
+    u32 blkbits, segbits, nr, i;
+    u64 pos = 0, sectors;
+    bool found = true;
+    int j;
+
+    bh = sb_bread(sb, 0);
+    if (!bh)
+        return;
+
+    raw = (const void *)(bh->b_data + F2FS_SUPER_OFFSET);
+    blkbits = le32_to_cpu(raw->log_blocksize);
+    segbits = le32_to_cpu(raw->log_blocks_per_seg);
+    /* A single device leaves the list empty */
+    if (le32_to_cpu(raw->magic) != F2FS_SUPER_MAGIC ||
+        !raw->devs[0].path[0] || blkbits < SECTOR_SHIFT ||
+        blkbits + segbits >= 32)
+        goto out;
+
+    for (nr = 0; nr < MAX_DEVICES && raw->devs[nr].path[0]; nr++)
+        ;
+    class_for_each_device(disk_to_dev(sb->s_bdev->bd_disk)->class, NULL,
+                          &scan, match_f2fs_member);
+
+    for (i = 0; i < nr; i++) {
+        sectors = (u64)le32_to_cpu(raw->devs[i].total_segments) << segbits;
+        /* The first device also holds what comes before segment 0 */
+        if (i == 0)
+            sectors += le32_to_cpu(raw->segment0_blkaddr);
+        sectors <<= blkbits - SECTOR_SHIFT;
+
+        if (i == 0) {
+            dev = &sb->s_bdev->bd_device;
+        } else {
+            memcpy(path, raw->devs[i].path, MAX_PATH_LEN);
+            path[MAX_PATH_LEN] = '\0';
+            dev = pick_f2fs_member(&scan, nr, path);
+        }
+        if (!dev || add_stack_member(topo, dev, 0)) {
+            found = false;
+        } else {
+            m = &topo->members[topo->nr_members - 1];
+            m->fs_start = pos;
+            m->fs_end = pos + sectors;
+        }
+        pos += sectors;
+    }
+
+    if (topo->nr_members)
+        topo->layout = found ? TOPO_LAYOUT_CONCAT : TOPO_LAYOUT_UNKNOWN;
+    for (j = 0; j < scan.nr; j++)
+        put_device(scan.held[j]);
+out:
+    brelse(bh);
+}
+
+/*
+ * Resolve the devices of a multi-device filesystem. Queries map onto
+ * every member with an unknown sector range, unless they are the
+ * consecutive devices of an f2fs; if none can be found the
+ * filesystem is treated as living on sb->s_bdev alone, as if it were
+ * the only member of a mirror. The members are re-read after
+ * MEMBERS_TTL.
+ */
+static struct bdev_topology *build_fs_topology(struct super_block *sb)
+{
+    struct bdev_topology *topo;
+    int ret;
+
+    topo = alloc_topology();
+    if (!topo)
+        return ERR_PTR(-ENOMEM);
+
+    topo->dev = sb->s_dev;
+    topo->filesystem = true;
+    topo->expires = jiffies + MEMBERS_TTL;
+    uuid_copy(&topo->fs_uuid, &sb->s_uuid);
+
+    if (sb->s_magic == F2FS_SUPER_MAGIC)
+        resolve_f2fs_members(sb, topo);
+    else
+        resolve_btrfs_members(sb, topo);
+    if (topo->nr_members) {
+        if (topo->layout == TOPO_LAYOUT_NONE)
+            topo->layout = TOPO_LAYOUT_UNKNOWN;
+    } else {
+        /* A single copy, at the same sectors */
+        add_stack_member(topo, &sb->s_bdev->bd_device, 0);
+        topo->layout = TOPO_LAYOUT_MIRRORED;
+    }
+
+    ret = resolve_member_chains(topo, 0);
+    if (ret < 0) {
+        free_topology(topo);
+        return ERR_PTR(ret);
+    }
+    return topo;
+}
+
+/*
+ * The superblock to resolve a query through instead of its block
+ * device: set for regular files on filesystems that can span several
+ * devices (btrfs, f2fs), NULL otherwise
+ */
+static struct super_block *topology_sb(struct inode *inode)
+{
+    if (inode && S_ISREG(inode->i_mode) && inode->i_sb->s_bdev &&
+        (inode->i_sb->s_magic == BTRFS_SUPER_MAGIC ||
+         inode->i_sb->s_magic == F2FS_SUPER_MAGIC))
+        return inode->i_sb;
+    return NULL;
+}
+
+/*
+ * Whether a topology is the one for bdev, or for sb if sb is set. An
+ * anonymous s_dev is reused after umount, so filesystem topologies
+ * are also matched on the filesystem UUID.
+ */
+static bool topology_matches(const struct bdev_topology *topo,
+                             struct block_device *bdev,
+                             const struct super_block *sb)
+{
+    if (sb)
+        return topo->filesystem && topo->dev == sb->s_dev &&
+               uuid_equal(&topo->fs_uuid, &sb->s_uuid);
+    return !topo->filesystem && topo->dev == bdev->bd_dev;
+}
+
+static bool topology_expired(const struct bdev_topology *topo)
+{
+    return topo->expires && time_after(jiffies, topo->expires);
+}
+
+/* Whether two topologies have the same member devices, in any order */
+static bool same_members(const struct bdev_topology *a,
+                         const struct bdev_topology *b)
+{
+    int i, j;
+
+    if (a->nr_members != b->nr_members)
+        return false;
+    for (i = 0; i < a->nr_members; i++) {
+        for (j = 0; j < b->nr_members; j++) {
+            if (a->members[i].bdev == b->members[j].bdev)
+                break;
+        }
+        if (j == b->nr_members)
+            return false;
+    }
+    return true;
+}
+
+static dev_t topology_key(struct block_device *bdev,
+                          const struct super_block *sb)
+{
+    return sb ? sb->s_dev : bdev->bd_dev;
+}
+
+/*
+ * Look up a cached topology. The caller holds rcu_read_lock() and the
+ * result is only valid until rcu_read_unlock(), so it must not sleep
+ * while using it.
+ */
+static struct bdev_topology *lookup_topology_rcu(struct block_device *bdev,
+                                                struct super_block *sb)
+{
+    struct bdev_topology *topo;
+
+    hash_for_each_possible_rcu(topo_cache, topo, node,
+                               topology_key(bdev, sb)) {
+        if (topology_matches(topo, bdev, sb) && !topology_expired(topo)) {
+            this_cpu_inc(query_stats.cache_hits);
+            return topo;
+        }
+    }
+    return NULL;
+}
+
+static void invalidate_topology_cache(void)
+{
+    struct bdev_topology *topo;
+    struct hlist_node *tmp;
+    int bkt;
+
+    spin_lock(&topo_cache_lock);
+    hash_for_each_safe(topo_cache, bkt, tmp, topo, node) {
+        hash_del_rcu(&topo->node);
+        put_topology(topo);
+    }
+    /* Only once the entries are gone: see query_generation() */
+    smp_mb__before_atomic();
+    atomic64_inc(&topo_generation);
+    spin_unlock(&topo_cache_lock);
+
+    wake_up_interruptible_poll(&topo_wait, EPOLLPRI);
+}
+
+/*
+ * Generation to report with a query. Read before the topology is
+ * looked up, so an answer is never newer than the generation it
+ * claims: a query that sees a new generation cannot find entries
+ * dropped before it was bumped.
+ */
+static u64 query_generation(void)
+{
+    return atomic64_read_acquire(&topo_generation);
+}
+
+static int topo_pci_notify(struct notifier_block *nb, unsigned long action,
+                           void *data)
+{
+    switch (action) {
+    case BUS_NOTIFY_ADD_DEVICE:
+    case BUS_NOTIFY_DEL_DEVICE:
+        invalidate_topology_cache();
+        break;
+    }
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block topo_pci_nb = {
+    .notifier_call = topo_pci_notify,
+};
+
+/* Disk and partition add/remove, including md/dm members */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static int topo_block_add(struct device *dev)
+{
+    if (!READ_ONCE(topo_block_intf_replaying))
+        invalidate_topology_cache();
+    return 0;
+}
+
+static void topo_block_remove(struct device *dev)
+{
+    invalidate_topology_cache();
+}
+#else
+static int topo_block_add(struct device *dev, struct class_interface *intf)
+{
+    if (!READ_ONCE(topo_block_intf_replaying))
+        invalidate_topology_cache();
+    return 0;
+}
+
+static void topo_block_remove(struct device *dev,
+                              struct class_interface *intf)
+{
+    invalidate_topology_cache();
+}
+#endif
+
+static struct class_interface topo_block_intf = {
+    .add_dev = topo_block_add,
+    .remove_dev = topo_block_remove,
+};
+
+/*
+ * Start watching the block class, found through any disk. Until that
+ * succeeds nothing is cached, since removals would go unnoticed.
+ * Registering calls ->add_dev for every disk and partition there is;
+ * those calls are ignored and the cache dropped once afterwards,
+ * which also covers a disk really added meanwhile.
+ */
+static bool watch_block_class(struct gendisk *disk)
+{
+    bool registered = false;
+
+    if (READ_ONCE(topo_block_intf_registered))
+        return true;
+
+    mutex_lock(&topo_block_intf_lock);
+    if (!topo_block_intf_registered && disk_to_dev(disk)->class) {
+        topo_block_intf.class = disk_to_dev(disk)->class;
+        WRITE_ONCE(topo_block_intf_replaying, true);
+        registered = !class_interface_register(&topo_block_intf);
+        WRITE_ONCE(topo_block_intf_replaying, false);
+        if (registered)
+            WRITE_ONCE(topo_block_intf_registered, true);
+    }
+    mutex_unlock(&topo_block_intf_lock);
+
+    if (registered)
+        invalidate_topology_cache();
+
+    return topo_block_intf_registered;
+}
+
+/*
+ * Get a referenced topology for bdev, or for the filesystem sb when
+ * topology_sb() returned one, from the cache if possible
+ */
+static struct bdev_topology *get_topology(struct block_device *bdev,
+                                          struct super_block *sb)
+{
+    struct bdev_topology *topo;
+    bool cacheable, changed = false;
+    u64 gen, start;
+
+    rcu_read_lock();
+    topo = lookup_topology_rcu(bdev, sb);
+    if (topo && !refcount_inc_not_zero(&topo->ref))
+        topo = NULL;
+    rcu_read_unlock();
+    if (topo)
+        return topo;
+
+    if (!bdev->bd_disk)
+        return ERR_PTR(-ENODEV);
+
+    cacheable = watch_block_class(bdev->bd_disk);
+    gen = atomic64_read(&topo_generation);
+
+    this_cpu_inc(query_stats.cache_misses);
+    start = stage_clock(file_to_pcie_build_topology);
+    topo = sb ? build_fs_topology(sb) : build_topology(bdev, 0);
+    if (trace_file_to_pcie_build_topology_enabled())
+        trace_file_to_pcie_build_topology(topology_key(bdev, sb),
+                                          IS_ERR(topo) ? 0 : topo->chain.count,
+                                          IS_ERR(topo) ? 0 : topo->nr_members,
+                                          PTR_ERR_OR_ZERO(topo),
+                                          stage_ns(start));
+    if (IS_ERR(topo) || !cacheable)
+        return topo;
+
+    spin_lock(&topo_cache_lock);
+    if (atomic64_read(&topo_generation) == gen) {
+        struct bdev_topology *cur;
+        struct hlist_node *tmp;
+        bool found = false;
+
+        hash_for_each_possible_safe(topo_cache, cur, tmp, node, topo->dev) {
+            if (topology_matches(cur, bdev, sb) && !topology_expired(cur)) {
+                found = true;
+                break;
+            }
+            /*
+             * Expired, or a filesystem that used to have this s_dev.
+             * An f2fs shares its s_dev with its first device, whose
+             * own entry stays.
+             */
+            if (cur->dev == topo->dev && cur->filesystem == topo->filesystem) {
+                /* A table reload, or a device added or removed */
+                if (topology_matches(cur, bdev, sb) &&
+                    !same_members(cur, topo))
+                    changed = true;
+                hash_del_rcu(&cur->node);
+                put_topology(cur);
+            }
+        }
+        if (!found) {
+            refcount_inc(&topo->ref);
+            hash_add_rcu(topo_cache, &topo->node, topo->dev);
+        }
+    }
+    spin_unlock(&topo_cache_lock);
+
+    /* Answers from the old members are stale: move the generation on */
+    if (changed)
+        invalidate_topology_cache();
+
+    return topo;
+}
+
+/*
+ * One device entry produced by mapping a segment onto a topology
+ */
+struct map_entry {
+    struct pci_dev *pdev;
+    struct block_device *bdev;  /* Block device the chain belongs to */
+    u16 depth;                  /* Position in that chain, 0 = endpoint */
+    loff_t file_start;
+    loff_t file_end;
+    loff_t sector_start;
+    loff_t sector_end;
+    u8 path_state;              /* NVMe multipath paths only */
+    u8 path_flags;
+    u16 path_controller;
+};
+
+/*
+ * Consumer of map entries, so one mapping pass can fill either the
+ * legacy fixed array or compact records. count is the number of
+ * entries produced, whether or not the consumer had room for them.
+ */
+struct map_sink {
+    void (*add)(struct map_sink *sink, const struct map_entry *e);
+    u32 count;
+    bool estimated;             /* Sectors of the range are a guess */
+};
+
+/* Fills struct file_to_pcie_request::pcie_devices */
+struct legacy_sink {
+    struct map_sink sink;
+    struct file_to_pcie_device_info *devs;
+    u32 flags;                  /* FILE_TO_PCIE_QUERY_F_* */
+};
+
+static void legacy_sink_add(struct map_sink *sink, const struct map_entry *e)
+{
+    struct legacy_sink *ls = container_of(sink, struct legacy_sink, sink);
+    struct file_to_pcie_device_info *info;
+
+    if ((ls->flags & FILE_TO_PCIE_QUERY_F_ENDPOINT) && e->depth)
+        return;
+
+    if (sink->count < MAX_PCIE_DEVICES) {
+        info = &ls->devs[sink->count];
+        fill_device_info(info, e->pdev,
+                         !(ls->flags & FILE_TO_PCIE_QUERY_F_NO_NAMES));
+        info->file_offset_start = e->file_start;
+        info->file_offset_end = e->file_end;
+        info->sector_start = e->sector_start;
+        info->sector_end = e->sector_end;
+    }
+    sink->count++;
+}
+
+static void init_legacy_sink(struct legacy_sink *ls,
+                             struct file_to_pcie_device_info *devs, u32 flags)
+{
+    ls->sink.add = legacy_sink_add;
+    ls->sink.count = 0;
+    ls->devs = devs;
+    ls->flags = flags;
+}
+
+/*
+ * CPUs local to a NUMA node; devices without affinity are treated as
+ * local to every online CPU, as in sysfs local_cpus
+ */
+static const struct cpumask *node_local_cpus(int node)
+{
+    if (node == NUMA_NO_NODE || node >= nr_node_ids)
+        return cpu_online_mask;
+    return cpumask_of_node(node);
+}
+
+/*
+ * Current link of a PCIe device as generation and lanes, straight
+ * from the Link Status register so retrained links show up. Reads
+ * of unimplemented registers return 0.
+ */
+static void read_pcie_link(struct pci_dev *pdev, u8 *speed, u8 *width)
+{
+    u16 lnksta;
+
+    pcie_capability_read_word(pdev, PCI_EXP_LNKSTA, &lnksta);
+    *speed = lnksta & PCI_EXP_LNKSTA_CLS;
+    *width = FIELD_GET(PCI_EXP_LNKSTA_NLW, lnksta);
+}
+
+static void fill_link_info(struct file_to_pcie_dev_record *rec,
+                           struct pci_dev *pdev)
+{
+    struct pci_dev *limit = NULL;
+    u32 lnkcap;
+
+    read_pcie_link(pdev, &rec->link_speed, &rec->link_width);
+    pcie_capability_read_dword(pdev, PCI_EXP_LNKCAP, &lnkcap);
+    rec->max_link_speed = lnkcap & PCI_EXP_LNKCAP_SLS;
+    rec->max_link_width = FIELD_GET(PCI_EXP_LNKCAP_MLW, lnkcap);
+
+    /*
+     * limit is an upstream bridge of pdev, kept alive by the chain's
+     * reference on pdev
+     */
+    rec->available_bandwidth = pcie_bandwidth_available(pdev, &limit,
+                                                        NULL, NULL);
+    if (!limit)
+        return;
+    rec->limit_domain = pci_domain_nr(limit->bus);
+    rec->limit_bus = limit->bus->number;
+    rec->limit_devfn = limit->devfn;
+    read_pcie_link(limit, &rec->limit_link_speed, &rec->limit_link_width);
+}
+
+/*
+ * I/O limits of a block device's request queue, so callers can size
+ * and align O_DIRECT and P2P buffers without reading sysfs. Limits
+ * are plain fields of the queue, so this is safe under RCU.
+ */
+static void fill_queue_limits(struct file_to_pcie_dev_record *rec,
+                              struct block_device *bdev)
+{
+    struct request_queue *q = bdev_get_queue(bdev);
+
+    rec->logical_block_size = bdev_logical_block_size(bdev);
+    rec->physical_block_size = bdev_physical_block_size(bdev);
+    rec->io_min = bdev_io_min(bdev);
+    rec->io_opt = bdev_io_opt(bdev);
+    rec->max_sectors = queue_max_sectors(q);
+    rec->max_segments = queue_max_segments(q);
+    rec->dma_alignment = queue_dma_alignment(q) + 1;
+
+    /* bdev_nonrot() and bdev_max_discard_sectors() came in 5.19 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    if (!bdev_nonrot(bdev))
+        rec->queue_flags |= FILE_TO_PCIE_QUEUE_F_ROTATIONAL;
+    if (bdev_max_discard_sectors(bdev))
+        rec->queue_flags |= FILE_TO_PCIE_QUEUE_F_DISCARD;
+#else
+    if (!blk_queue_nonrot(q))
+        rec->queue_flags |= FILE_TO_PCIE_QUEUE_F_ROTATIONAL;
+    if (blk_queue_discard(q))
+        rec->queue_flags |= FILE_TO_PCIE_QUEUE_F_DISCARD;
+#endif
+    if (bdev_is_zoned(bdev))
+        rec->queue_flags |= FILE_TO_PCIE_QUEUE_F_ZONED;
+    if (bdev_write_zeroes_sectors(bdev))
+        rec->queue_flags |= FILE_TO_PCIE_QUEUE_F_WRITE_ZEROES;
+}
+
+/*
+ * Load of the disk a block device is on. Partitions share their
+ * disk's queue, so the whole disk's counters are what a caller
+ * balancing reads wants. The counters are per-CPU and are summed
+ * without locking, like diskstats does; nothing here sleeps, so this
+ * is safe under RCU.
+ */
+static void fill_queue_load(struct file_to_pcie_dev_record *rec,
+                            struct block_device *bdev)
+{
+    struct block_device *part = bdev->bd_disk->part0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0)
+    unsigned int inflight = 0;
+    int cpu;
+#endif
+
+    rec->sample_ns = ktime_get_ns();
+    rec->busy_ms = jiffies64_to_msecs(part_stat_read(part, io_ticks));
+
+    /* bdev_count_inflight() came in 6.16 and also counts blk-mq tags */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+    rec->inflight = bdev_count_inflight(part);
+    rec->load_flags |= FILE_TO_PCIE_LOAD_F_INFLIGHT;
+#else
+    /* Only bio-based disks (md, dm) count in the per-CPU stats */
+    if (queue_is_mq(bdev_get_queue(part)))
+        return;
+    for_each_possible_cpu(cpu) {
+        inflight += part_stat_local_read_cpu(part, in_flight[READ], cpu);
+        inflight += part_stat_local_read_cpu(part, in_flight[WRITE], cpu);
+    }
+    /* Per-CPU counts can be negative: I/O may end on another CPU */
+    if ((int)inflight < 0)
+        inflight = 0;
+    rec->inflight = inflight;
+    rec->load_flags |= FILE_TO_PCIE_LOAD_F_INFLIGHT;
+#endif
+}
+
+static void fill_dev_record(struct file_to_pcie_dev_record *rec,
+                            const struct map_entry *e, u32 flags)
+{
+    struct pci_dev *pdev = e->pdev;
+    const struct cpumask *mask;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->domain = pci_domain_nr(pdev->bus);
+    rec->vendor_id = pdev->vendor;
+    rec->device_id = pdev->device;
+    rec->bus = pdev->bus->number;
+    rec->devfn = pdev->devfn;
+    rec->depth = e->depth;
+    rec->dev_major = MAJOR(e->bdev->bd_dev);
+    rec->dev_minor = MINOR(e->bdev->bd_dev);
+    rec->file_offset_start = e->file_start;
+    rec->file_offset_end = e->file_end;
+    rec->sector_start = e->sector_start;
+    rec->sector_end = e->sector_end;
+    rec->path_state = e->path_state;
+    rec->path_flags = e->path_flags;
+    rec->path_controller = e->path_controller;
+
+    rec->numa_node = dev_to_node(&pdev->dev);
+    mask = node_local_cpus(rec->numa_node);
+    rec->nr_local_cpus = cpumask_weight(mask);
+    rec->first_local_cpu = rec->nr_local_cpus ? cpumask_first(mask) : -1;
+
+    if (flags & FILE_TO_PCIE_QUERY_F_LINK)
+        fill_link_info(rec, pdev);
+    if (flags & FILE_TO_PCIE_QUERY_F_LIMITS)
+        fill_queue_limits(rec, e->bdev);
+    if (flags & FILE_TO_PCIE_QUERY_F_LOAD)
+        fill_queue_load(rec, e->bdev);
+}
+
+/*
+ * Where compact records, and optionally one CPU mask per record,
+ * are copied to
+ */
+struct record_dest {
+    void __user *records;
+    void __user *cpumasks;      /* NULL if not requested */
+    u32 record_size;
+    u32 cpumask_size;
+    u32 flags;                  /* FILE_TO_PCIE_QUERY_F_* */
+};
+
+static void init_record_dest(struct record_dest *dst, u32 flags, u64 records,
+                             u32 record_size, u64 cpumasks, u32 cpumask_size)
+{
+    dst->flags = flags;
+    dst->records = u64_to_user_ptr(records);
+    dst->record_size = record_size;
+    dst->cpumasks = cpumask_size ? u64_to_user_ptr(cpumasks) : NULL;
+    dst->cpumask_size = cpumask_size;
+}
+
+/*
+ * Copy count bytes of src to dst, zero-filling up to size
+ */
+static int copy_padded_to_user(void __user *dst, size_t size,
+                               const void *src, size_t count)
+{
+    size_t n = min(size, count);
+
+    if (copy_to_user(dst, src, n))
+        return -EFAULT;
+    if (size > n && clear_user(dst + n, size - n))
+        return -EFAULT;
+    return 0;
+}
+
+/*
+ * Copy a record to slot index with the caller's record stride.
+ * Callers built against a newer header get the fields we do not know
+ * about zeroed; older ones get a prefix.
+ */
+static int copy_record_to_user(const struct record_dest *dst, u32 index,
+                               const struct file_to_pcie_dev_record *rec)
+{
+    const struct cpumask *mask;
+    int ret;
+
+    ret = copy_padded_to_user(dst->records + (size_t)index * dst->record_size,
+                              dst->record_size, rec, sizeof(*rec));
+    if (ret || !dst->cpumasks)
+        return ret;
+
+    mask = node_local_cpus(rec->numa_node);
+    return copy_padded_to_user(dst->cpumasks +
+                               (size_t)index * dst->cpumask_size,
+                               dst->cpumask_size, cpumask_bits(mask),
+                               cpumask_size());
+}
+
+/*
+ * Fills compact records, either into a kernel buffer (so it can run
+ * under rcu_read_lock()) or directly into the user's buffer
+ */
+struct record_sink {
+    struct map_sink sink;
+    struct file_to_pcie_dev_record *krecs;
+    const struct record_dest *dst;
+    u32 base;                   /* Index of the first record in dst */
+    u32 capacity;
+    u32 written;
+    int err;
+};
+
+static void record_sink_add(struct map_sink *sink, const struct map_entry *e)
+{
+    struct record_sink *rs = container_of(sink, struct record_sink, sink);
+    struct file_to_pcie_dev_record rec;
+
+    if ((rs->dst->flags & FILE_TO_PCIE_QUERY_F_ENDPOINT) && e->depth)
+        return;
+
+    if (rs->written < rs->capacity && !rs->err) {
+        if (rs->krecs) {
+            fill_dev_record(&rs->krecs[rs->written], e, rs->dst->flags);
+        } else {
+            fill_dev_record(&rec, e, rs->dst->flags);
+            rs->err = copy_record_to_user(rs->dst, rs->base + rs->written,
+                                          &rec);
+        }
+        rs->written++;
+    }
+    sink->count++;
+}
+
+static void init_record_sink(struct record_sink *rs,
+                             struct file_to_pcie_dev_record *krecs,
+                             const struct record_dest *dst, u32 base,
+                             u32 capacity)
+{
+    rs->sink.add = record_sink_add;
+    rs->sink.count = 0;
+    rs->krecs = krecs;
+    rs->dst = dst;
+    rs->base = base;
+    rs->capacity = capacity;
+    rs->written = 0;
+    rs->err = 0;
+}
+
+/*
+ * Add one entry per device of a PCIe chain, all covering the given
+ * file offset and sector ranges
+ */
+static void append_entries(struct map_sink *sink,
+                           const struct pcie_chain *chain,
+                           struct map_entry *e)
+{
+    int i;
+
+    for (i = 0; i < chain->count; i++) {
+        e->pdev = chain->pdevs[i];
+        e->depth = i;
+        sink->add(sink, e);
+    }
+}
+
+static void append_chain(struct map_sink *sink, const struct pcie_chain *chain,
+                         struct block_device *bdev, loff_t file_start,
+                         loff_t file_end, loff_t sector_start,
+                         loff_t sector_end)
+{
+    struct map_entry e = {
+        .bdev = bdev,
+        .file_start = file_start,
+        .file_end = file_end,
+        .sector_start = sector_start,
+        .sector_end = sector_end,
+    };
+
+    append_entries(sink, chain, &e);
+}
+
+static u32 mod_u64(u64 v, u32 n)
+{
+    u32 rem;
+
+    div_u64_rem(v, n, &rem);
+    return rem;
+}
+
+static void map_topology(const struct bdev_topology *topo, loff_t file_start,
+                         loff_t file_end, loff_t sector_start,
+                         loff_t sector_end, loff_t file_base,
+                         struct map_sink *sink);
+
+/*
+ * Map a member's share of a range: its own chain, or the chains of
+ * its members if it is stacked itself. file_base is the file offset
+ * of the member's sector 0, as for map_topology().
+ */
+static void map_member(const struct stack_member *m, struct map_sink *sink,
+                       loff_t file_start, loff_t file_end,
+                       loff_t sector_start, loff_t sector_end,
+                       loff_t file_base)
+{
+    if (m->topo)
+        map_topology(m->topo, file_start, file_end, sector_start,
+                     sector_end, file_base, sink);
+    else
+        append_chain(sink, &m->chain, m->bdev, file_start,
+                     file_end, sector_start, sector_end);
+}
+
+/*
+ * Split a striped range across members. On each member the chunks of
+ * a contiguous range are themselves contiguous, so every member gets
+ * one entry: its member-relative sector range, and the first and last
+ * byte of the segment it serves. The sector range is exact, but the
+ * file range is only the envelope of the member's chunks: it holds
+ * every nr_members-th chunk in between, and the other members' file
+ * ranges overlap it. A stacked member's own layout is
+ * mapped as if its share continued past its first chunk in file
+ * order, so file ranges below it are only approximate.
+ */
+static void map_striped(const struct bdev_topology *topo,
+                        struct map_sink *sink, loff_t offset, loff_t file_end,
+                        loff_t sector_start, loff_t sector_end,
+                        loff_t file_base)
+{
+    u32 chunk = topo->chunk_sectors;
+    u32 n = topo->nr_members;
+    u64 s = sector_start + topo->start_sect;
+    u64 e = sector_end + topo->start_sect;
+    u64 first = div_u64(s, chunk);
+    u64 last = div_u64(e, chunk);
+    u64 c0, c1, ms, me, fs, fe;
+    u32 k;
+
+    for (k = 0; k < n; k++) {
+        const struct stack_member *m = &topo->members[k];
+
+        /* First and last chunk of the range that live on member k */
+        c0 = first + (k + n - mod_u64(first, n)) % n;
+        if (c0 > last)
+            continue;
+        c1 = last - (mod_u64(last, n) + n - k) % n;
+
+        ms = div_u64(c0, n) * chunk + (c0 == first ? s - c0 * chunk : 0);
+        me = div_u64(c1, n) * chunk +
+             (c1 == last ? e - c1 * chunk : chunk - 1);
+        fs = max_t(u64, s, c0 * chunk) - topo->start_sect;
+        fe = min_t(u64, e, c1 * chunk + chunk - 1) - topo->start_sect;
+
+        map_member(m, sink,
+                   max_t(loff_t, offset, file_base + (fs << SECTOR_SHIFT)),
+                   min_t(loff_t, file_end,
+                         file_base + ((fe + 1) << SECTOR_SHIFT) - 1),
+                   ms + m->data_offset, me + m->data_offset,
+                   file_base + ((fs - ms - m->data_offset) << SECTOR_SHIFT));
+    }
+}
+
+/*
+ * Split a range of a filesystem over consecutive devices into each
+ * device's share, at device-relative sectors
+ */
+static void map_concat(const struct bdev_topology *topo,
+                       struct map_sink *sink, loff_t file_start,
+                       loff_t file_end, loff_t sector_start,
+                       loff_t sector_end, loff_t file_base)
+{
+    const struct stack_member *m;
+    loff_t s, e;
+    int i;
+
+    for (i = 0; i < topo->nr_members; i++) {
+        m = &topo->members[i];
+        s = max_t(loff_t, sector_start, m->fs_start);
+        e = min_t(loff_t, sector_end, m->fs_end - 1);
+        if (s > e)
+            continue;
+
+        map_member(m, sink,
+                   max_t(loff_t, file_start, file_base + (s << SECTOR_SHIFT)),
+                   min_t(loff_t, file_end,
+                         file_base + ((e + 1) << SECTOR_SHIFT) - 1),
+                   s - m->fs_start, e - m->fs_start,
+                   file_base + ((loff_t)m->fs_start << SECTOR_SHIFT));
+    }
+}
+
+/*
+ * The paths the NVMe driver would send I/O from node down, as a mask
+ * of members: the live paths in the best ANA state available, and
+ * under the numa iopolicy only the nearest of those (the first one,
+ * on a tie), as nvme_find_path() picks them
+ */
+static u32 current_paths(const struct bdev_topology *topo, int node)
+{
+    const struct stack_member *m;
+    int best_state = 0, best_distance = INT_MAX, distance;
+    u32 mask = 0;
+    int i;
+
+    for (i = 0; i < topo->nr_members; i++) {
+        m = &topo->members[i];
+        if (!(m->path_flags & FILE_TO_PCIE_PATH_F_LIVE) ||
+            (m->path_state != FILE_TO_PCIE_PATH_OPTIMIZED &&
+             m->path_state != FILE_TO_PCIE_PATH_NON_OPTIMIZED))
+            continue;
+
+        distance = LOCAL_DISTANCE;
+        if (topo->numa_iopolicy && node != NUMA_NO_NODE &&
+            m->numa_node != NUMA_NO_NODE)
+            distance = node_distance(node, m->numa_node);
+
+        /* OPTIMIZED sorts before NON_OPTIMIZED */
+        if (!mask || m->path_state < best_state ||
+            (m->path_state == best_state && distance < best_distance)) {
+            best_state = m->path_state;
+            best_distance = distance;
+            mask = BIT(i);
+        } else if (m->path_state == best_state &&
+                   distance == best_distance && !topo->numa_iopolicy) {
+            mask |= BIT(i);
+        }
+    }
+    return mask;
+}
+
+/*
+ * Every path of an NVMe head reaches the same namespace, so each one
+ * gets the whole range at the same sectors, marked with its state
+ */
+static void map_paths(const struct bdev_topology *topo,
+                      struct map_sink *sink, loff_t file_start,
+                      loff_t file_end, loff_t sector_start,
+                      loff_t sector_end)
+{
+    u32 current_mask = current_paths(topo, numa_node_id());
+    const struct stack_member *m;
+    struct map_entry e;
+    int i;
+
+    for (i = 0; i < topo->nr_members; i++) {
+        m = &topo->members[i];
+        e = (struct map_entry) {
+            .bdev = m->bdev,
+            .file_start = file_start,
+            .file_end = file_end,
+            .sector_start = sector_start,
+            .sector_end = sector_end,
+            .path_state = m->path_state,
+            .path_flags = m->path_flags,
+            .path_controller = m->path_controller,
+        };
+        if (current_mask & BIT(i))
+            e.path_flags |= FILE_TO_PCIE_PATH_F_CURRENT;
+        append_entries(sink, &m->chain, &e);
+    }
+}
+
+/*
+ * Map a range of a device onto its PCIe devices. The device's own
+ * chain covers the whole range; members of a stacked device get
+ * their share of it, recursively. Sectors are relative to the device
+ * and -1 if unknown; file_base is the file offset that sector 0 of
+ * the device would hold, which is how striped shares find their file
+ * ranges.
+ */
+static void map_topology(const struct bdev_topology *topo, loff_t file_start,
+                         loff_t file_end, loff_t sector_start,
+                         loff_t sector_end, loff_t file_base,
+                         struct map_sink *sink)
+{
+    const struct stack_member *m;
+    loff_t delta;
+    int layout = topo->layout;
+    int i;
+
+    /*
+     * Chunks and f2fs devices can only be found from real sectors: a
+     * share worked out from a guess would name the wrong member
+     */
+    if (sector_start < 0 ||
+        (sink->estimated && (layout == TOPO_LAYOUT_STRIPED ||
+                             layout == TOPO_LAYOUT_CONCAT)))
+        layout = TOPO_LAYOUT_UNKNOWN;
+
+    append_chain(sink, &topo->chain, topo->bdev, file_start, file_end,
+                 sector_start, sector_end);
+
+    switch (layout) {
+    case TOPO_LAYOUT_STRIPED:
+        map_striped(topo, sink, file_start, file_end, sector_start,
+                    sector_end, file_base);
+        break;
+    case TOPO_LAYOUT_CONCAT:
+        map_concat(topo, sink, file_start, file_end, sector_start,
+                   sector_end, file_base);
+        break;
+    case TOPO_LAYOUT_MIRRORED:
+        /* Every member holds a full copy */
+        for (i = 0; i < topo->nr_members; i++) {
+            m = &topo->members[i];
+            delta = topo->start_sect + m->data_offset;
+            map_member(m, sink, file_start, file_end, sector_start + delta,
+                       sector_end + delta,
+                       file_base - (delta << SECTOR_SHIFT));
+        }
+        break;
+    case TOPO_LAYOUT_UNKNOWN:
+        /* Members are known but not which of them holds the range */
+        for (i = 0; i < topo->nr_members; i++)
+            map_member(&topo->members[i], sink, file_start, file_end,
+                       -1, -1, 0);
+        break;
+    case TOPO_LAYOUT_MULTIPATH:
+        map_paths(topo, sink, file_start, file_end,
+                  sector_start + topo->start_sect,
+                  sector_end + topo->start_sect);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * Map a file segment, already converted to a sector range on bdev,
+ * onto its PCIe devices. inode is the file the range came from, or
+ * NULL if the sectors are the offsets themselves: the sectors of a
+ * regular file are only the linear guess of inode_sector_range(), so
+ * they are not used to split it across striped members, which get
+ * the whole segment with unknown sectors instead. The extents ioctl
+ * splits regular files by their physical extents.
+ * Does not sleep, so it can run on a topology found under RCU.
+ */
+static void map_segment_to_topology(const struct bdev_topology *topo,
+                                    const struct inode *inode,
+                                    loff_t offset, u64 length,
+                                    loff_t sector_start, loff_t sector_end,
+                                    struct map_sink *sink)
+{
+    u64 start = stage_clock(file_to_pcie_map);
+    u32 count = sink->count;
+
+    sink->estimated = inode && S_ISREG(inode->i_mode);
+
+    map_topology(topo, offset, offset + length - 1, sector_start,
+                 sector_end, 0, sink);
+
+    trace_file_to_pcie_map(topo->dev, sink->count - count, stage_ns(start));
+}
+
+/*
+ * Find PCIe devices associated with a block device and map file segment
+ * This walks through the device hierarchy to find PCI devices and
+ * calculates which parts of the file segment map to each device
+ */
+static int find_pcie_devices_for_bdev(struct block_device *bdev,
+                                      struct file *filp,
+                                      struct file_to_pcie_request *req)
+{
+    struct bdev_topology *topo;
+    struct super_block *sb;
+    struct legacy_sink ls;
+    loff_t sector_start, sector_end;
+    int ret;
+
+    if (!bdev || !req)
+        return -EINVAL;
+
+    /* Calculate sector range for the file segment */
+    ret = calculate_sector_range(file_data_inode(filp), req->offset,
+                                 req->length, &sector_start, &sector_end);
+    if (ret < 0)
+        return ret;
+
+    init_legacy_sink(&ls, req->pcie_devices, 0);
+    sb = topology_sb(file_data_inode(filp));
+
+    /* Fast path: map straight from the cache without a reference */
+    rcu_read_lock();
+    topo = lookup_topology_rcu(bdev, sb);
+    if (topo)
+        map_segment_to_topology(topo, file_data_inode(filp), req->offset,
+                                req->length, sector_start, sector_end,
+                                &ls.sink);
+    rcu_read_unlock();
+
+    if (!topo) {
+        topo = get_topology(bdev, sb);
+        if (IS_ERR(topo))
+            return PTR_ERR(topo);
+
+        map_segment_to_topology(topo, file_data_inode(filp), req->offset,
+                                req->length, sector_start, sector_end,
+                                &ls.sink);
+        put_topology(topo);
+    }
+
+    req->pcie_count = min_t(u32, ls.sink.count, MAX_PCIE_DEVICES);
+    return req->pcie_count;
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_GET_PCIE: resolve a single file segment
+ */
+static long file_to_pcie_get_pcie(void __user *argp)
+{
+    struct file_to_pcie_request req;
+    struct file *target_file = NULL;
+    struct block_device *bdev = NULL;
+    long ret = 0;
+
+    /* Copy request from userspace */
+    if (copy_from_user(&req, argp, sizeof(req)))
+        return -EFAULT;
+
+    /* Get the struct file* from the file descriptor */
+    target_file = get_file_from_fd(req.fd);
+    if (!target_file) {
+        ret = -EBADF;
+        goto out;
+    }
+
+    /* Get the block device from the file */
+    ret = get_target_bdev(target_file, &bdev);
+    if (ret < 0)
+        goto out_file;
+
+    /* Find PCIe devices */
+    ret = find_pcie_devices_for_bdev(bdev, target_file, &req);
+    if (ret < 0)
+        goto out_bdev;
+
+    /* If no PCIe devices found, that's OK - return success with count=0 */
+    /* This handles non-PCIe block devices (e.g., USB, SCSI, etc.) */
+    req.pcie_count = (ret >= 0) ? ret : 0;
+
+    /*
+     * Copy results back to userspace. Entries past pcie_count still
+     * hold what the caller passed in, so they need not go back.
+     */
+    if (copy_to_user(argp, &req,
+                     offsetof(struct file_to_pcie_request, pcie_devices) +
+                     req.pcie_count * sizeof(req.pcie_devices[0]))) {
+        ret = -EFAULT;
+        goto out_bdev;
+    }
+
+    ret = 0; /* Success */
+
+out_bdev:
+    /* No need to bdput - we didn't take an extra reference */
+out_file:
+    if (target_file)
+        fput(target_file);
+out:
+    return ret;
+}
+
+/*
+ * Per-batch state. Each distinct fd is looked up once and each
+ * distinct block device has its PCIe chain walked once; every
+ * segment after the first only pays for the sector range math.
+ */
+struct batch_bdev_entry {
+    struct hlist_node node;
+    struct block_device *bdev;
+    struct super_block *sb;     /* From topology_sb() */
+    struct bdev_topology *topo; /* Or ERR_PTR from get_topology() */
+};
+
+struct batch_fd_entry {
+    struct hlist_node node;
+    int fd;
+    int status;
+    struct file *filp;
+    struct batch_bdev_entry *bdev_entry;
+};
+
+struct batch_ctx {
+    struct file_to_pcie_ctx *fctx;
+    int srcu_idx;                   /* Pins registered files */
+    DECLARE_HASHTABLE(fds, BATCH_HASH_BITS);
+    DECLARE_HASHTABLE(bdevs, BATCH_HASH_BITS);
+    struct file_to_pcie_segment segs[BATCH_CHUNK];
+    struct file_to_pcie_segment_result result;
+};
+
+static struct batch_bdev_entry *batch_lookup_bdev(struct batch_ctx *ctx,
+                                                  struct block_device *bdev,
+                                                  struct file *filp)
+{
+    struct super_block *sb = topology_sb(file_data_inode(filp));
+    struct batch_bdev_entry *be;
+
+    hash_for_each_possible(ctx->bdevs, be, node, (unsigned long)bdev) {
+        if (be->bdev == bdev && be->sb == sb)
+            return be;
+    }
+
+    be = kzalloc(sizeof(*be), GFP_KERNEL);
+    if (!be)
+        return NULL;
+
+    be->bdev = bdev;
+    be->sb = sb;
+    be->topo = get_topology(bdev, sb);
+    hash_add(ctx->bdevs, &be->node, (unsigned long)bdev);
+    return be;
+}
+
+static struct batch_fd_entry *batch_lookup_fd(struct batch_ctx *ctx, int fd)
+{
+    struct batch_fd_entry *fe;
+    struct block_device *bdev;
+
+    hash_for_each_possible(ctx->fds, fe, node, fd) {
+        if (fe->fd == fd)
+            return fe;
+    }
+
+    fe = kzalloc(sizeof(*fe), GFP_KERNEL);
+    if (!fe)
+        return NULL;
+
+    fe->fd = fd;
+    fe->filp = get_file_from_fd(fd);
+    if (!fe->filp) {
+        fe->status = -EBADF;
+    } else {
+        fe->status = get_target_bdev(fe->filp, &bdev);
+        if (!fe->status) {
+            fe->bdev_entry = batch_lookup_bdev(ctx, bdev, fe->filp);
+            if (!fe->bdev_entry)
+                fe->status = -ENOMEM;
+        }
+    }
+
+    hash_add(ctx->fds, &fe->node, fd);
+    return fe;
+}
+
+static void batch_ctx_free(struct batch_ctx *ctx)
+{
+    struct batch_fd_entry *fe;
+    struct batch_bdev_entry *be;
+    struct hlist_node *tmp;
+    int bkt;
+
+    hash_for_each_safe(ctx->fds, bkt, tmp, fe, node) {
+        if (fe->filp)
+            fput(fe->filp);
+        kfree(fe);
+    }
+    hash_for_each_safe(ctx->bdevs, bkt, tmp, be, node) {
+        if (!IS_ERR(be->topo))
+            put_topology(be->topo);
+        kfree(be);
+    }
+    srcu_read_unlock(&ctx->fctx->srcu, ctx->srcu_idx);
+    kvfree(ctx);
+}
+
+static struct batch_ctx *batch_ctx_alloc(struct file_to_pcie_ctx *fctx)
+{
+    struct batch_ctx *ctx;
+
+    ctx = kvzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return NULL;
+    ctx->fctx = fctx;
+    ctx->srcu_idx = srcu_read_lock(&fctx->srcu);
+    hash_init(ctx->fds);
+    hash_init(ctx->bdevs);
+    return ctx;
+}
+
+/*
+ * Look up the file and topology of one segment of a batch
+ * Returns 0 on success, negative error code for this segment
+ */
+static int batch_get_segment(struct batch_ctx *ctx,
+                             const struct file_to_pcie_segment *seg,
+                             struct file **filpp,
+                             struct bdev_topology **topop)
+{
+    struct batch_fd_entry *fe;
+    struct batch_bdev_entry *be;
+    struct fixed_file *ff;
+
+    if ((seg->flags & ~FILE_TO_PCIE_SEGMENT_F_FIXED) || seg->offset < 0 ||
+        seg->length > (u64)(LLONG_MAX - seg->offset))
+        return -EINVAL;
+
+    if (seg->flags & FILE_TO_PCIE_SEGMENT_F_FIXED) {
+        ff = lookup_fixed_file(ctx->fctx, seg->fd);
+        if (!ff)
+            return -EBADF;
+        if (ff->status)
+            return ff->status;
+        be = batch_lookup_bdev(ctx, ff->bdev, ff->filp);
+        if (!be)
+            return -ENOMEM;
+        *filpp = ff->filp;
+    } else {
+        fe = batch_lookup_fd(ctx, seg->fd);
+        if (!fe)
+            return -ENOMEM;
+        if (fe->status)
+            return fe->status;
+        be = fe->bdev_entry;
+        *filpp = fe->filp;
+    }
+
+    if (IS_ERR(be->topo))
+        return PTR_ERR(be->topo);
+    *topop = be->topo;
+    return 0;
+}
+
+/*
+ * Resolve one segment of a batch and map it into sink
+ * Returns 0 on success, negative error code for this segment
+ */
+static int batch_map_segment(struct batch_ctx *ctx,
+                             const struct file_to_pcie_segment *seg,
+                             u32 flags, struct map_sink *sink)
+{
+    struct bdev_topology *topo;
+    struct file *filp;
+    loff_t sector_start, sector_end;
+    int ret;
+
+    if (seg->length == 0)
+        return -EINVAL;
+    ret = batch_get_segment(ctx, seg, &filp, &topo);
+    if (ret < 0)
+        return ret;
+
+    ret = segment_sector_range(file_data_inode(filp), seg->offset,
+                               seg->length, flags, &sector_start,
+                               &sector_end);
+    if (ret < 0)
+        return ret;
+
+    map_segment_to_topology(topo, file_data_inode(filp), seg->offset,
+                            seg->length, sector_start, sector_end, sink);
+    return 0;
+}
+
+static void batch_resolve_segment(struct batch_ctx *ctx,
+                                  const struct file_to_pcie_segment *seg,
+                                  u32 flags,
+                                  struct file_to_pcie_segment_result *res)
+{
+    struct legacy_sink ls;
+
+    memset(res, 0, sizeof(*res));
+    init_legacy_sink(&ls, res->pcie_devices, flags);
+    res->status = batch_map_segment(ctx, seg, flags, &ls.sink);
+    if (!res->status)
+        res->pcie_count = min_t(u32, ls.sink.count, MAX_PCIE_DEVICES);
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_GET_PCIE_BATCH: resolve an array of segments
+ * Per-segment failures are reported in each result's status; the
+ * ioctl itself only fails for bad arguments or faulting buffers.
+ * The number of results written is always returned in completed.
+ */
+static long file_to_pcie_get_pcie_batch(struct file_to_pcie_ctx *fctx,
+                                        void __user *argp)
+{
+    struct file_to_pcie_batch batch;
+    struct file_to_pcie_batch __user *ubatch = argp;
+    struct file_to_pcie_segment __user *usegs;
+    struct file_to_pcie_segment_result __user *ures;
+    struct batch_ctx *ctx;
+    size_t result_size;
+    u32 done = 0;
+    u32 n, i;
+    long ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+
+    if ((batch.flags & ~LEGACY_BATCH_FLAGS) || batch.reserved)
+        return -EINVAL;
+
+    usegs = u64_to_user_ptr(batch.segments);
+    ures = u64_to_user_ptr(batch.results);
+
+    ctx = batch_ctx_alloc(fctx);
+    if (!ctx)
+        return -ENOMEM;
+
+    while (done < batch.count) {
+        n = min_t(u32, batch.count - done, BATCH_CHUNK);
+        if (copy_from_user(ctx->segs, usegs + done,
+                           n * sizeof(ctx->segs[0]))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            batch_resolve_segment(ctx, &ctx->segs[i], batch.flags,
+                                  &ctx->result);
+            /* Callers that trim the work also get the copy trimmed */
+            result_size = sizeof(ctx->result);
+            if (batch.flags)
+                result_size = offsetof(struct file_to_pcie_segment_result,
+                                       pcie_devices) +
+                              ctx->result.pcie_count *
+                              sizeof(ctx->result.pcie_devices[0]);
+            if (copy_to_user(ures + done, &ctx->result, result_size)) {
+                ret = -EFAULT;
+                goto out;
+            }
+            done++;
+        }
+
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+
+out:
+    if (put_user(done, &ubatch->completed))
+        ret = -EFAULT;
+    batch_ctx_free(ctx);
+    return ret;
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_QUERY_BATCH: compact version of the batch ioctl
+ * All segments share one record buffer; each result records where
+ * its slice starts and how many records it wanted.
+ */
+static long file_to_pcie_query_batch(struct file_to_pcie_ctx *fctx,
+                                     void __user *argp, size_t usize)
+{
+    struct file_to_pcie_query_batch batch;
+    struct file_to_pcie_query_batch __user *ubatch = argp;
+    struct file_to_pcie_segment __user *usegs;
+    struct file_to_pcie_query_result __user *ures;
+    struct file_to_pcie_query_result res;
+    struct record_dest dst;
+    struct record_sink rs;
+    struct batch_ctx *ctx;
+    u32 done = 0, used = 0;
+    u32 n, i;
+    u64 gen = query_generation();
+    long ret = 0;
+
+    BUILD_BUG_ON(sizeof(struct file_to_pcie_query_batch) !=
+                 FILE_TO_PCIE_QUERY_BATCH_SIZE_V2);
+
+    if (usize < FILE_TO_PCIE_QUERY_BATCH_SIZE_V1)
+        return -EINVAL;
+    ret = copy_struct_from_user(&batch, sizeof(batch), ubatch, usize);
+    if (ret)
+        return ret;
+
+    if ((batch.flags & ~RECORD_FLAGS) || batch.reserved ||
+        batch.record_size < FILE_TO_PCIE_DEV_RECORD_SIZE_V1 ||
+        (batch.cpumasks && !batch.cpumask_size))
+        return -EINVAL;
+
+    usegs = u64_to_user_ptr(batch.segments);
+    ures = u64_to_user_ptr(batch.results);
+    init_record_dest(&dst, batch.flags, batch.records, batch.record_size,
+                     batch.cpumasks, batch.cpumask_size);
+
+    ctx = batch_ctx_alloc(fctx);
+    if (!ctx)
+        return -ENOMEM;
+
+    while (done < batch.count) {
+        n = min_t(u32, batch.count - done, BATCH_CHUNK);
+        if (copy_from_user(ctx->segs, usegs + done,
+                           n * sizeof(ctx->segs[0]))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            init_record_sink(&rs, NULL, &dst, used,
+                             batch.record_capacity - used);
+            memset(&res, 0, sizeof(res));
+            res.status = batch_map_segment(ctx, &ctx->segs[i], batch.flags,
+                                           &rs.sink);
+            if (rs.err) {
+                ret = rs.err;
+                goto out;
+            }
+            res.record_index = used;
+            res.record_count = rs.written;
+            res.records_needed = rs.sink.count;
+            used += rs.written;
+
+            if (copy_to_user(ures + done, &res, sizeof(res))) {
+                ret = -EFAULT;
+                goto out;
+            }
+            done++;
+        }
+
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+
+out:
+    if (put_user(done, &ubatch->completed) ||
+        put_user(used, &ubatch->records_used) ||
+        (usize >= FILE_TO_PCIE_QUERY_BATCH_SIZE_V2 &&
+         put_user(gen, &ubatch->generation)))
+        ret = -EFAULT;
+    batch_ctx_free(ctx);
+    return ret;
+}
+
+/*
+ * Cached runs of a file segment, in pages, and how many of them the
+ * caller has room for
+ */
+struct cache_runs {
+    struct file_to_pcie_cache_range __user *uranges;
+    u32 capacity;
+    u32 written;
+    u32 needed;                     /* Runs closed so far */
+    loff_t start;                   /* Segment bytes, inclusive */
+    loff_t end;
+    /* Run being extended, if cur_pages */
+    pgoff_t cur_first;
+    unsigned long cur_pages;
+    u32 cur_flags;
+    u32 nbuf;
+    struct file_to_pcie_cache_range buf[CACHE_RUN_CHUNK];
+};
+
+static void close_cache_run(struct cache_runs *cr)
+{
+    struct file_to_pcie_cache_range *r;
+    loff_t first, last;
+
+    if (!cr->cur_pages)
+        return;
+
+    first = max_t(loff_t, (loff_t)cr->cur_first << PAGE_SHIFT, cr->start);
+    last = min_t(loff_t, ((loff_t)(cr->cur_first + cr->cur_pages) <<
+                          PAGE_SHIFT) - 1, cr->end);
+    if (cr->written + cr->nbuf < cr->capacity) {
+        r = &cr->buf[cr->nbuf++];
+        r->offset = first;
+        r->length = last - first + 1;
+        r->flags = cr->cur_flags;
+        r->reserved = 0;
+    }
+    cr->needed++;
+    cr->cur_pages = 0;
+}
+
+/*
+ * Add pages [first, first + nr) to the runs. Entries arrive in index
+ * order, but may overlap the previous one on kernels that index every
+ * page of a large page.
+ */
+static void add_cache_pages(struct cache_runs *cr, pgoff_t first,
+                            unsigned long nr, u32 flags)
+{
+    pgoff_t cur_end = cr->cur_first + cr->cur_pages;
+
+    if (cr->cur_pages && first < cur_end) {
+        if (first + nr <= cur_end)
+            return;
+        nr -= cur_end - first;
+        first = cur_end;
+    }
+
+    if (cr->cur_pages && first == cur_end && flags == cr->cur_flags) {
+        cr->cur_pages += nr;
+        return;
+    }
+
+    close_cache_run(cr);
+    cr->cur_first = first;
+    cr->cur_pages = nr;
+    cr->cur_flags = flags;
+}
+
+static int flush_cache_runs(struct cache_runs *cr)
+{
+    if (cr->nbuf && copy_to_user(cr->uranges + cr->written, cr->buf,
+                                 cr->nbuf * sizeof(cr->buf[0])))
+        return -EFAULT;
+    cr->written += cr->nbuf;
+    cr->nbuf = 0;
+    return 0;
+}
+
+/*
+ * Pages covered by a page-cache entry found at xas: its whole folio,
+ * so that large folios are counted once. The entry is not referenced
+ * and may be freed and reused meanwhile; what it then claims is only
+ * trusted while it still covers the index it was found at.
+ */
+static void cache_entry_span(const struct xa_state *xas, void *entry,
+                             pgoff_t *first, unsigned long *nr)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+    struct folio *folio = entry;
+    pgoff_t index = READ_ONCE(folio->index);
+    unsigned long pages = folio_nr_pages(folio);
+#else
+    struct page *page = compound_head((struct page *)entry);
+    pgoff_t index = READ_ONCE(page->index);
+    unsigned long pages = compound_nr(page);
+#endif
+
+    if (index <= xas->xa_index && xas->xa_index - index < pages) {
+        *first = index;
+        *nr = pages;
+    } else {
+        *first = xas->xa_index;
+        *nr = 1;
+    }
+}
+
+/*
+ * Write the cached runs of [offset, offset + length) of a mapping to
+ * the caller, like mincore() but with dirty and writeback state and
+ * without mapping the file. The page cache is walked under RCU, with
+ * the lock dropped to copy each chunk of runs out.
+ * Returns 0 on success, negative error code on failure
+ */
+static int map_page_cache(struct address_space *mapping, loff_t offset,
+                          u64 length, struct cache_runs *cr)
+{
+    pgoff_t first_index = offset >> PAGE_SHIFT;
+    pgoff_t last_index = (offset + length - 1) >> PAGE_SHIFT;
+    XA_STATE(xas, &mapping->i_pages, first_index);
+    unsigned long nr;
+    pgoff_t first;
+    void *entry;
+    u32 flags;
+    int ret;
+
+    cr->start = offset;
+    cr->end = offset + length - 1;
+
+    rcu_read_lock();
+    xas_for_each(&xas, entry, last_index) {
+        if (xas_retry(&xas, entry) || xa_is_value(entry))
+            continue;
+
+        flags = 0;
+        if (xas_get_mark(&xas, PAGECACHE_TAG_DIRTY))
+            flags |= FILE_TO_PCIE_CACHE_F_DIRTY;
+        if (xas_get_mark(&xas, PAGECACHE_TAG_WRITEBACK))
+            flags |= FILE_TO_PCIE_CACHE_F_WRITEBACK;
+
+        cache_entry_span(&xas, entry, &first, &nr);
+        if (first < first_index) {
+            nr -= first_index - first;
+            first = first_index;
+        }
+        nr = min_t(unsigned long, nr, last_index - first + 1);
+        add_cache_pages(cr, first, nr, flags);
+
+        if (cr->nbuf == CACHE_RUN_CHUNK || need_resched()) {
+            xas_pause(&xas);
+            rcu_read_unlock();
+            ret = flush_cache_runs(cr);
+            if (ret < 0)
+                return ret;
+            if (fatal_signal_pending(current))
+                return -EINTR;
+            cond_resched();
+            rcu_read_lock();
+        }
+    }
+    rcu_read_unlock();
+
+    close_cache_run(cr);
+    return flush_cache_runs(cr);
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_QUERY: compact single-segment query
+ * Small answers are built on the stack straight from the cache under
+ * RCU; anything larger is written directly to the user's buffer
+ * while holding a topology reference. With nowait, only the first
+ * is attempted and -EAGAIN is returned instead of the second, or
+ * for page-cache residency, which is copied out as it is walked.
+ */
+static long file_to_pcie_query(struct file_to_pcie_ctx *fctx, void __user *argp,
+                               size_t usize, bool nowait)
+{
+    struct file_to_pcie_query q;
+    struct file_to_pcie_query __user *uq = argp;
+    struct file_to_pcie_dev_record krecs[QUERY_FAST_RECORDS];
+    struct bdev_topology *topo;
+    struct cache_runs *cr = NULL;
+    struct record_dest dst;
+    struct record_sink rs;
+    struct target_ref t;
+    struct block_device *bdev;
+    loff_t sector_start, sector_end;
+    u64 gen = query_generation();
+    long ret;
+    u32 i;
+
+    BUILD_BUG_ON(sizeof(struct file_to_pcie_dev_record) !=
+                 FILE_TO_PCIE_DEV_RECORD_SIZE_V6);
+    BUILD_BUG_ON(offsetofend(struct file_to_pcie_query, records_needed) !=
+                 FILE_TO_PCIE_QUERY_SIZE_V1);
+    BUILD_BUG_ON(offsetofend(struct file_to_pcie_query, reserved2) !=
+                 FILE_TO_PCIE_QUERY_SIZE_V2);
+    BUILD_BUG_ON(sizeof(struct file_to_pcie_query) !=
+                 FILE_TO_PCIE_QUERY_SIZE_V3);
+
+    if (usize < FILE_TO_PCIE_QUERY_SIZE_V1)
+        return -EINVAL;
+    ret = copy_struct_from_user(&q, sizeof(q), uq, usize);
+    if (ret)
+        return ret;
+
+    if ((q.flags & ~QUERY_FLAGS) || q.reserved ||
+        q.record_size < FILE_TO_PCIE_DEV_RECORD_SIZE_V1 ||
+        (q.cpumasks && !q.cpumask_size) ||
+        q.offset < 0 || q.length == 0 ||
+        q.length > (u64)(LLONG_MAX - q.offset))
+        return -EINVAL;
+    /* Runs are counted into fields older callers do not have */
+    if ((q.flags & FILE_TO_PCIE_QUERY_F_CACHE) &&
+        (usize < FILE_TO_PCIE_QUERY_SIZE_V2 || q.reserved2))
+        return -EINVAL;
+    if ((q.flags & FILE_TO_PCIE_QUERY_F_CACHE) && nowait)
+        return -EAGAIN;
+
+    init_record_dest(&dst, q.flags, q.records, q.record_size, q.cpumasks,
+                     q.cpumask_size);
+
+    if (q.flags & FILE_TO_PCIE_QUERY_F_PATH) {
+        /* Path walks may wait for directory I/O */
+        if (nowait)
+            return -EAGAIN;
+        if (q.flags & FILE_TO_PCIE_QUERY_F_FIXED)
+            return -EINVAL;
+        ret = get_path_target(q.fd, u64_to_user_ptr(q.path), &t);
+    } else {
+        ret = get_target(fctx, q.fd, q.flags & FILE_TO_PCIE_QUERY_F_FIXED,
+                         &t);
+    }
+    if (ret < 0)
+        return ret;
+    bdev = t.bdev;
+
+    ret = segment_sector_range(t.inode, q.offset, q.length, q.flags,
+                               &sector_start, &sector_end);
+    if (ret < 0)
+        goto out_file;
+
+    init_record_sink(&rs, krecs, &dst, 0,
+                     min_t(u32, q.record_capacity, QUERY_FAST_RECORDS));
+
+    rcu_read_lock();
+    topo = lookup_topology_rcu(bdev, topology_sb(t.inode));
+    if (topo)
+        map_segment_to_topology(topo, t.inode, q.offset, q.length,
+                                sector_start, sector_end, &rs.sink);
+    rcu_read_unlock();
+
+    if (topo && (rs.sink.count <= rs.written ||
+                 q.record_capacity <= QUERY_FAST_RECORDS)) {
+        for (i = 0; i < rs.written; i++) {
+            ret = copy_record_to_user(&dst, i, &krecs[i]);
+            if (ret < 0)
+                goto out_file;
+        }
+    } else if (nowait) {
+        ret = -EAGAIN;
+        goto out_file;
+    } else {
+        topo = get_topology(bdev, topology_sb(t.inode));
+        if (IS_ERR(topo)) {
+            ret = PTR_ERR(topo);
+            goto out_file;
+        }
+
+        init_record_sink(&rs, NULL, &dst, 0, q.record_capacity);
+        map_segment_to_topology(topo, t.inode, q.offset, q.length,
+                                sector_start, sector_end, &rs.sink);
+        put_topology(topo);
+        if (rs.err) {
+            ret = rs.err;
+            goto out_file;
+        }
+    }
+
+    if (q.flags & FILE_TO_PCIE_QUERY_F_CACHE) {
+        if (!S_ISREG(t.inode->i_mode)) {
+            ret = -EINVAL;
+            goto out_file;
+        }
+        cr = kmalloc(sizeof(*cr), GFP_KERNEL);
+        if (!cr) {
+            ret = -ENOMEM;
+            goto out_file;
+        }
+        memset(cr, 0, offsetof(struct cache_runs, buf));
+        cr->uranges = u64_to_user_ptr(q.cache_ranges);
+        cr->capacity = q.cache_range_capacity;
+
+        ret = map_page_cache(t.inode->i_mapping, q.offset, q.length, cr);
+        if (ret < 0)
+            goto out_file;
+        if (put_user(cr->written, &uq->cache_range_count) ||
+            put_user(cr->needed, &uq->cache_ranges_needed)) {
+            ret = -EFAULT;
+            goto out_file;
+        }
+    }
+
+    if (put_user(rs.written, &uq->record_count) ||
+        put_user(rs.sink.count, &uq->records_needed) ||
+        (usize >= FILE_TO_PCIE_QUERY_SIZE_V3 &&
+         put_user(gen, &uq->generation)))
+        ret = -EFAULT;
+    else
+        ret = 0;
+
+out_file:
+    kfree(cr);
+    put_target(&t);
+    return ret;
+}
+
+/*
+ * Directory entries collected by iterate_dir(). Names are only
+ * looked up once the directory lock is dropped again.
+ */
+struct dir_name {
+    u64 ino;
+    u32 offset;                     /* In dir_collect.names */
+    u32 len;
+};
+
+struct dir_collect {
+    struct dir_context ctx;
+    struct dir_name *ents;
+    char *names;
+    u32 count;
+    u32 names_used;
+    u32 entry_room;                 /* Left in the caller's buffers */
+    u32 name_room;
+    bool subdirs;
+    bool stopped;                   /* Entries are left to read */
+    bool full;                      /* ... and the caller has no room */
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+#define DIR_ACTOR_CONTINUE true
+#define DIR_ACTOR_STOP false
+static bool dir_collect_actor(struct dir_context *ctx, const char *name,
+                              int len, loff_t pos, u64 ino,
+                              unsigned int type)
+#else
+#define DIR_ACTOR_CONTINUE 0
+#define DIR_ACTOR_STOP -ENOSPC
+static int dir_collect_actor(struct dir_context *ctx, const char *name,
+                             int len, loff_t pos, u64 ino,
+                             unsigned int type)
+#endif
+{
+    struct dir_collect *dc = container_of(ctx, struct dir_collect, ctx);
+    struct dir_name *dn;
+
+    if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+        return DIR_ACTOR_CONTINUE;
+
+    /* DT_UNKNOWN is sorted out after the lookup */
+    if (type != DT_REG && type != DT_UNKNOWN &&
+        !(type == DT_DIR && dc->subdirs))
+        return DIR_ACTOR_CONTINUE;
+
+    if (dc->count == dc->entry_room ||
+        dc->names_used + len + 1 > dc->name_room)
+        dc->full = true;
+    if (dc->full || dc->count == DIR_CHUNK ||
+        dc->names_used + len + 1 > DIR_NAMES_SIZE) {
+        dc->stopped = true;
+        return DIR_ACTOR_STOP;
+    }
+
+    dn = &dc->ents[dc->count++];
+    dn->ino = ino;
+    dn->offset = dc->names_used;
+    dn->len = len;
+    memcpy(dc->names + dc->names_used, name, len);
+    dc->names[dc->names_used + len] = '\0';
+    dc->names_used += len + 1;
+    return DIR_ACTOR_CONTINUE;
+}
+
+/*
+ * One directory query: the caller's buffers and how far they are used
+ */
+struct dir_query_state {
+    struct file_to_pcie_dir_query q;
+    struct file_to_pcie_dir_entry __user *uents;
+    char __user *unames;
+    struct record_dest dst;
+    /* Files of a directory nearly always share one block device */
+    struct block_device *bdev;
+    struct super_block *sb;
+    struct bdev_topology *topo;
+};
+
+/*
+ * Map one regular file of the directory into the record buffer
+ * Returns 0 on success, negative error code for this entry
+ */
+static int dir_map_file(struct dir_query_state *st, const struct path *path,
+                        struct file_to_pcie_dir_entry *ent)
+{
+    struct inode *inode = data_inode(path->dentry);
+    struct super_block *sb = topology_sb(inode);
+    struct block_device *bdev;
+    struct record_sink rs;
+    loff_t sector_start, sector_end;
+    int ret;
+
+    ret = get_path_bdev(path, &bdev);
+    if (ret < 0)
+        return ret;
+
+    if (bdev != st->bdev || sb != st->sb) {
+        if (!IS_ERR_OR_NULL(st->topo))
+            put_topology(st->topo);
+        st->bdev = bdev;
+        st->sb = sb;
+        st->topo = get_topology(bdev, sb);
+    }
+    if (IS_ERR(st->topo))
+        return PTR_ERR(st->topo);
+
+    ent->size = i_size_read(inode);
+    if (!ent->size)
+        return 0;
+
+    ret = segment_sector_range(inode, 0, ent->size, st->q.flags,
+                               &sector_start, &sector_end);
+    if (ret < 0)
+        return ret;
+
+    init_record_sink(&rs, NULL, &st->dst, st->q.records_used,
+                     st->q.record_capacity - st->q.records_used);
+    map_segment_to_topology(st->topo, inode, 0, ent->size, sector_start,
+                            sector_end, &rs.sink);
+    if (rs.err)
+        return rs.err;
+
+    ent->record_count = rs.written;
+    ent->records_needed = rs.sink.count;
+    st->q.records_used += rs.written;
+    return 0;
+}
+
+/*
+ * Look up and report one collected name
+ * Returns a negative error code only if the caller's buffers fault
+ */
+static int dir_emit_entry(struct dir_query_state *st, struct file *dir,
+                          const struct dir_name *dn, const char *name)
+{
+    struct file_to_pcie_dir_entry ent;
+    struct inode *inode;
+    struct path path;
+    int ret;
+
+    memset(&ent, 0, sizeof(ent));
+    ent.ino = dn->ino;
+    ent.record_index = st->q.records_used;
+
+    ret = vfs_path_lookup(dir->f_path.dentry, dir->f_path.mnt, name, 0,
+                          &path);
+    if (ret == 0) {
+        inode = d_inode(path.dentry);
+        if (inode && !S_ISREG(inode->i_mode) &&
+            !(S_ISDIR(inode->i_mode) && st->q.flags &
+              FILE_TO_PCIE_DIR_F_SUBDIRS)) {
+            /* A DT_UNKNOWN entry that is not a regular file */
+            path_put(&path);
+            return 0;
+        }
+        ent.status = dir_map_file(st, &path, &ent);
+        path_put(&path);
+    } else {
+        /* Removed since it was read, most likely */
+        ent.status = ret;
+    }
+
+    ent.name_offset = st->q.names_used;
+    if (copy_to_user(st->unames + st->q.names_used, name, dn->len + 1) ||
+        copy_to_user(st->uents + st->q.entry_count, &ent, sizeof(ent)))
+        return -EFAULT;
+
+    st->q.names_used += dn->len + 1;
+    st->q.entry_count++;
+    return 0;
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_QUERY_DIR: map every regular file of a directory
+ * The directory is read through a private file positioned at the
+ * cookie, so the caller's dirfd position and lock are left alone.
+ */
+static long file_to_pcie_query_dir(void __user *argp, size_t usize)
+{
+    struct file_to_pcie_dir_query __user *uq = argp;
+    struct dir_query_state *st;
+    struct dir_collect dc = {
+        .ctx.actor = dir_collect_actor,
+    };
+    struct file *dirf, *dir;
+    u64 gen = query_generation();
+    long ret;
+    u32 i;
+
+    BUILD_BUG_ON(sizeof(struct file_to_pcie_dir_query) !=
+                 FILE_TO_PCIE_DIR_QUERY_SIZE_V2);
+
+    if (usize < FILE_TO_PCIE_DIR_QUERY_SIZE_V1)
+        return -EINVAL;
+
+    st = kvzalloc(sizeof(*st), GFP_KERNEL);
+    dc.ents = kvmalloc_array(DIR_CHUNK, sizeof(*dc.ents), GFP_KERNEL);
+    dc.names = kvmalloc(DIR_NAMES_SIZE, GFP_KERNEL);
+    if (!st || !dc.ents || !dc.names) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    ret = copy_struct_from_user(&st->q, sizeof(st->q), uq, usize);
+    if (ret)
+        goto out_free;
+
+    if ((st->q.flags & ~DIR_FLAGS) || st->q.reserved ||
+        st->q.record_size < FILE_TO_PCIE_DEV_RECORD_SIZE_V1 ||
+        (st->q.cpumasks && !st->q.cpumask_size)) {
+        ret = -EINVAL;
+        goto out_free;
+    }
+
+    st->uents = u64_to_user_ptr(st->q.entries);
+    st->unames = u64_to_user_ptr(st->q.names);
+    init_record_dest(&st->dst, st->q.flags & RECORD_FLAGS,
+                     st->q.records, st->q.record_size, st->q.cpumasks,
+                     st->q.cpumask_size);
+    st->q.entry_count = 0;
+    st->q.names_used = 0;
+    st->q.records_used = 0;
+    st->q.done = 0;
+    dc.subdirs = st->q.flags & FILE_TO_PCIE_DIR_F_SUBDIRS;
+
+    dirf = get_file_from_fd(st->q.dirfd);
+    if (!dirf) {
+        ret = -EBADF;
+        goto out_free;
+    }
+
+    /* Reading is only allowed through a directory opened for it */
+    if (!d_is_dir(dirf->f_path.dentry)) {
+        ret = -ENOTDIR;
+        goto out_dirf;
+    }
+    if (!(dirf->f_mode & FMODE_READ)) {
+        ret = -EBADF;
+        goto out_dirf;
+    }
+
+    dir = dentry_open(&dirf->f_path, O_RDONLY | O_DIRECTORY,
+                      current_cred());
+    if (IS_ERR(dir)) {
+        ret = PTR_ERR(dir);
+        goto out_dirf;
+    }
+
+    ret = vfs_llseek(dir, st->q.cookie, SEEK_SET);
+    if (ret < 0)
+        goto out_dir;
+
+    for (;;) {
+        dc.count = 0;
+        dc.names_used = 0;
+        dc.stopped = false;
+        dc.full = false;
+        dc.entry_room = st->q.entry_capacity - st->q.entry_count;
+        dc.name_room = st->q.names_size - st->q.names_used;
+
+        ret = iterate_dir(dir, &dc.ctx);
+        if (ret < 0)
+            goto out_dir;
+
+        for (i = 0; i < dc.count; i++) {
+            ret = dir_emit_entry(st, dir, &dc.ents[i],
+                                 dc.names + dc.ents[i].offset);
+            if (ret < 0)
+                goto out_dir;
+        }
+
+        if (!dc.stopped) {
+            st->q.done = 1;
+            break;
+        }
+        if (dc.full)
+            break;
+
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            goto out_dir;
+        }
+        cond_resched();
+    }
+    ret = 0;
+
+out_dir:
+    st->q.cookie = dir->f_pos;
+    fput(dir);
+    if (put_user(st->q.cookie, &uq->cookie) ||
+        put_user(st->q.entry_count, &uq->entry_count) ||
+        put_user(st->q.names_used, &uq->names_used) ||
+        put_user(st->q.records_used, &uq->records_used) ||
+        put_user(st->q.done, &uq->done) ||
+        (usize >= FILE_TO_PCIE_DIR_QUERY_SIZE_V2 &&
+         put_user(gen, &uq->generation)))
+        ret = -EFAULT;
+out_dirf:
+    fput(dirf);
+out_free:
+    if (st && !IS_ERR_OR_NULL(st->topo))
+        put_topology(st->topo);
+    kvfree(dc.names);
+    kvfree(dc.ents);
+    kvfree(st);
+    return ret;
+}
+
+/*
+ * Group queries. Map entries arrive one chain at a time, endpoint
+ * first, so the device standing for each chain at the query's level
+ * is picked as its entries go by and counted when the next chain
+ * starts or the segment ends. Clusters are deduplicated by device
+ * (or node) in a per-query hash table.
+ */
+struct group_cluster {
+    struct hlist_node node;
+    unsigned long key;
+    u32 id;
+    u32 last_segment;               /* Last segment counted, + 1 */
+    struct file_to_pcie_cluster info;
+};
+
+struct group_sink {
+    struct map_sink sink;
+    u32 level;
+    DECLARE_HASHTABLE(clusters, BATCH_HASH_BITS);
+    u32 nr_clusters;
+    u32 __user *umembers;
+    u32 member_capacity;
+    u32 members_used;
+    /* Segment being mapped */
+    u32 segment;                    /* Index + 1 */
+    struct file_to_pcie_group_result res;
+    /* Chain being mapped */
+    bool pending;
+    bool picked;                    /* Nothing further up can replace pick */
+    struct pci_dev *pick;
+    int numa_node;
+    int err;
+};
+
+static struct group_cluster *group_get_cluster(struct group_sink *gs,
+                                               unsigned long key)
+{
+    struct group_cluster *c;
+
+    hash_for_each_possible(gs->clusters, c, node, key) {
+        if (c->key == key)
+            return c;
+    }
+
+    c = kzalloc(sizeof(*c), GFP_KERNEL);
+    if (!c)
+        return NULL;
+
+    c->key = key;
+    c->id = gs->nr_clusters++;
+    c->info.numa_node = gs->numa_node;
+    if (gs->level != FILE_TO_PCIE_GROUP_NUMA_NODE) {
+        c->info.domain = pci_domain_nr(gs->pick->bus);
+        c->info.bus = gs->pick->bus->number;
+        c->info.devfn = gs->pick->devfn;
+        c->info.numa_node = dev_to_node(&gs->pick->dev);
+    }
+    hash_add(gs->clusters, &c->node, key);
+    return c;
+}
+
+/* Count the chain just mapped towards its cluster */
+static void group_end_chain(struct group_sink *gs)
+{
+    struct group_cluster *c;
+    unsigned long key;
+
+    if (!gs->pending)
+        return;
+    gs->pending = false;
+
+    if (gs->level == FILE_TO_PCIE_GROUP_NUMA_NODE)
+        key = gs->numa_node + 1;
+    else
+        key = (unsigned long)gs->pick;
+
+    c = group_get_cluster(gs, key);
+    if (!c) {
+        gs->err = -ENOMEM;
+        return;
+    }
+    if (c->last_segment == gs->segment)
+        return;
+    c->last_segment = gs->segment;
+    c->info.segments++;
+
+    if (!gs->res.cluster_count)
+        gs->res.cluster = c->id;
+    gs->res.cluster_count++;
+    if (gs->members_used < gs->member_capacity) {
+        if (put_user(c->id, gs->umembers + gs->members_used)) {
+            gs->err = -EFAULT;
+            return;
+        }
+        gs->members_used++;
+        gs->res.member_count++;
+    }
+}
+
+static void group_sink_add(struct map_sink *sink, const struct map_entry *e)
+{
+    struct group_sink *gs = container_of(sink, struct group_sink, sink);
+    int type;
+
+    sink->count++;
+    if (e->depth == 0) {
+        group_end_chain(gs);
+        /* Only the paths I/O is sent down contend */
+        if (e->path_state && !(e->path_flags & FILE_TO_PCIE_PATH_F_CURRENT))
+            return;
+        gs->pending = true;
+        gs->picked = false;
+        gs->numa_node = dev_to_node(&e->pdev->dev);
+    }
+    if (!gs->pending || gs->picked)
+        return;
+
+    /* Until the level's device turns up, the top of the chain stands in */
+    gs->pick = e->pdev;
+    type = pci_is_pcie(e->pdev) ? pci_pcie_type(e->pdev) : -1;
+    switch (gs->level) {
+    case FILE_TO_PCIE_GROUP_SWITCH:
+        gs->picked = (e->depth && type == PCI_EXP_TYPE_UPSTREAM) ||
+                     type == PCI_EXP_TYPE_ROOT_PORT;
+        break;
+    case FILE_TO_PCIE_GROUP_ROOT_PORT:
+        gs->picked = type == PCI_EXP_TYPE_ROOT_PORT;
+        break;
+    default:
+        gs->picked = true;
+        break;
+    }
+}
+
+/*
+ * Resolve one segment of a group query and count its clusters
+ * Returns 0 on success, negative error code for this segment
+ */
+static int group_map_segment(struct batch_ctx *ctx,
+                             const struct file_to_pcie_segment *seg,
+                             struct group_sink *gs)
+{
+    struct bdev_topology *topo;
+    struct inode *inode;
+    struct file *filp;
+    loff_t sector_start, sector_end, size;
+    u64 length = seg->length;
+    int ret;
+
+    ret = batch_get_segment(ctx, seg, &filp, &topo);
+    if (ret < 0)
+        return ret;
+    inode = file_data_inode(filp);
+
+    if (!length) {
+        /* A device file's own inode has no size: the disk's is wanted */
+        if (S_ISBLK(inode->i_mode))
+            size = bdev_nr_bytes(I_BDEV(inode));
+        else
+            size = i_size_read(inode);
+        length = max_t(loff_t, size - seg->offset, 0);
+        if (!length)
+            return 0;
+        if (length > (u64)(LLONG_MAX - seg->offset))
+            return -EINVAL;
+    }
+
+    ret = calculate_sector_range(inode, seg->offset, length,
+                                 &sector_start, &sector_end);
+    if (ret < 0)
+        return ret;
+
+    map_segment_to_topology(topo, inode, seg->offset, length,
+                            sector_start, sector_end, &gs->sink);
+    group_end_chain(gs);
+    return 0;
+}
+
+/* Write the cluster table, as far as the caller has room for it */
+static int copy_clusters_to_user(struct group_sink *gs,
+                                 struct file_to_pcie_cluster __user *uclusters,
+                                 u32 capacity)
+{
+    struct group_cluster *c;
+    int bkt;
+
+    hash_for_each(gs->clusters, bkt, c, node) {
+        if (c->id < capacity &&
+            copy_to_user(uclusters + c->id, &c->info, sizeof(c->info)))
+            return -EFAULT;
+    }
+    return 0;
+}
+
+static void free_group_sink(struct group_sink *gs)
+{
+    struct group_cluster *c;
+    struct hlist_node *tmp;
+    int bkt;
+
+    hash_for_each_safe(gs->clusters, bkt, tmp, c, node)
+        kfree(c);
+    kfree(gs);
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_QUERY_GROUPS: cluster an array of segments by the
+ * device or node they share at a given level
+ * Per-segment failures are reported in each result's status. The
+ * number of results written is always returned in completed, along
+ * with the cluster table for those results.
+ */
+static long file_to_pcie_query_groups(struct file_to_pcie_ctx *fctx,
+                                      void __user *argp, size_t usize)
+{
+    struct file_to_pcie_group_query q;
+    struct file_to_pcie_group_query __user *uq = argp;
+    struct file_to_pcie_segment __user *usegs;
+    struct file_to_pcie_group_result __user *ures;
+    struct group_sink *gs;
+    struct batch_ctx *ctx;
+    u64 gen = query_generation();
+    u32 done = 0;
+    u32 n, i;
+    long ret = 0;
+
+    BUILD_BUG_ON(sizeof(struct file_to_pcie_group_query) !=
+                 FILE_TO_PCIE_GROUP_QUERY_SIZE_V1);
+
+    if (usize < FILE_TO_PCIE_GROUP_QUERY_SIZE_V1)
+        return -EINVAL;
+    ret = copy_struct_from_user(&q, sizeof(q), uq, usize);
+    if (ret)
+        return ret;
+
+    if (q.flags || q.level > FILE_TO_PCIE_GROUP_NUMA_NODE)
+        return -EINVAL;
+
+    usegs = u64_to_user_ptr(q.segments);
+    ures = u64_to_user_ptr(q.results);
+
+    gs = kzalloc(sizeof(*gs), GFP_KERNEL);
+    if (!gs)
+        return -ENOMEM;
+    gs->sink.add = group_sink_add;
+    gs->level = q.level;
+    hash_init(gs->clusters);
+    gs->umembers = u64_to_user_ptr(q.members);
+    gs->member_capacity = q.members ? q.member_capacity : 0;
+
+    ctx = batch_ctx_alloc(fctx);
+    if (!ctx) {
+        kfree(gs);
+        return -ENOMEM;
+    }
+
+    while (done < q.count) {
+        n = min_t(u32, q.count - done, BATCH_CHUNK);
+        if (copy_from_user(ctx->segs, usegs + done,
+                           n * sizeof(ctx->segs[0]))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            memset(&gs->res, 0, sizeof(gs->res));
+            gs->res.cluster = FILE_TO_PCIE_GROUP_NONE;
+            gs->res.member_index = gs->members_used;
+            gs->segment = done + 1;
+            gs->res.status = group_map_segment(ctx, &ctx->segs[i], gs);
+            if (gs->err) {
+                ret = gs->err;
+                goto out;
+            }
+
+            if (copy_to_user(ures + done, &gs->res, sizeof(gs->res))) {
+                ret = -EFAULT;
+                goto out;
+            }
+            done++;
+        }
+
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+        cond_resched();
+    }
+
+out:
+    if ((q.clusters && copy_clusters_to_user(gs, u64_to_user_ptr(q.clusters),
+                                             q.cluster_capacity)) ||
+        put_user(done, &uq->completed) ||
+        put_user(gs->nr_clusters, &uq->cluster_count) ||
+        put_user(gs->members_used, &uq->members_used) ||
+        put_user(gen, &uq->generation))
+        ret = -EFAULT;
+    batch_ctx_free(ctx);
+    free_group_sink(gs);
+    return ret;
+}
+
+/*
+ * Find the closest device upstream of both a and b (possibly one of
+ * them), counting links on the way as the P2PDMA core does. Returns
+ * NULL if they only meet at the host bridge or not at all, with hops
+ * then counted up to the root ports.
+ */
+static struct pci_dev *p2p_common_upstream(struct pci_dev *a,
+                                           struct pci_dev *b, int *hops)
+{
+    struct pci_dev *up_a, *up_b;
+    int dist_a = 0, dist_b = 0;
+
+    for (up_a = a; up_a; up_a = pci_upstream_bridge(up_a), dist_a++) {
+        dist_b = 0;
+        for (up_b = b; up_b; up_b = pci_upstream_bridge(up_b), dist_b++) {
+            if (up_a == up_b) {
+                *hops = dist_a + dist_b;
+                return up_a;
+            }
+        }
+    }
+
+    *hops = dist_a + dist_b;
+    return NULL;
+}
+
+static void fill_p2p_path(struct file_to_pcie_p2p_path *path,
+                          const struct map_entry *e, struct pci_dev *target)
+{
+    struct pci_dev *src = e->pdev, *common;
+#if IS_ENABLED(CONFIG_PCI_P2PDMA)
+    struct device *client = &src->dev;
+#endif
+    int hops;
+
+    memset(path, 0, sizeof(*path));
+    path->domain = pci_domain_nr(src->bus);
+    path->bus = src->bus->number;
+    path->devfn = src->devfn;
+    path->dev_major = MAJOR(e->bdev->bd_dev);
+    path->dev_minor = MINOR(e->bdev->bd_dev);
+    path->file_offset_start = e->file_start;
+    path->file_offset_end = e->file_end;
+
+    common = p2p_common_upstream(src, target, &hops);
+    path->hops = hops;
+    if (common) {
+        path->flags |= FILE_TO_PCIE_P2P_PATH_COMMON;
+        path->common_domain = pci_domain_nr(common->bus);
+        path->common_bus = common->bus->number;
+        path->common_devfn = common->devfn;
+    } else if (pci_find_host_bridge(src->bus) ==
+               pci_find_host_bridge(target->bus)) {
+        path->flags |= FILE_TO_PCIE_P2P_PATH_HOST_BRIDGE;
+    }
+
+#if IS_ENABLED(CONFIG_PCI_P2PDMA)
+    /* The target provides the memory, the endpoint DMAs into it */
+    path->distance = pci_p2pdma_distance_many(target, &client, 1, false);
+#else
+    path->distance = -1;
+    path->flags |= FILE_TO_PCIE_P2P_PATH_NO_P2PDMA;
+#endif
+    if (path->distance >= 0)
+        path->flags |= FILE_TO_PCIE_P2P_PATH_SUPPORTED;
+}
+
+/*
+ * Map sink writing one P2P path per endpoint straight to user memory.
+ * Only usable on a referenced topology: the P2PDMA core may sleep.
+ */
+struct p2p_sink {
+    struct map_sink sink;
+    struct pci_dev *target;
+    struct file_to_pcie_p2p_path __user *upaths;
+    u32 capacity;
+    u32 written;
+    int err;
+};
+
+static void p2p_sink_add(struct map_sink *sink, const struct map_entry *e)
+{
+    struct p2p_sink *ps = container_of(sink, struct p2p_sink, sink);
+    struct file_to_pcie_p2p_path path;
+
+    /* The rest of each chain is only the endpoint's way upstream */
+    if (e->depth)
+        return;
+
+    if (ps->written < ps->capacity && !ps->err) {
+        fill_p2p_path(&path, e, ps->target);
+        if (copy_to_user(ps->upaths + ps->written, &path, sizeof(path)))
+            ps->err = -EFAULT;
+        ps->written++;
+    }
+    sink->count++;
+}
+
+/*
+ * Resolve a P2P target fd opened in a PCI device's sysfs directory
+ * (the directory itself, or a file directly in it) by device name
+ */
+static int get_sysfs_pci_target(struct file *filp, struct pci_dev **target)
+{
+    struct dentry *dentry;
+    struct name_snapshot name;
+    struct device *dev;
+
+    if (d_is_dir(filp->f_path.dentry))
+        dentry = dget(filp->f_path.dentry);
+    else
+        dentry = dget_parent(filp->f_path.dentry);
+
+    take_dentry_name_snapshot(&name, dentry);
+    dev = bus_find_device_by_name(&pci_bus_type, NULL, name.name.name);
+    release_dentry_name_snapshot(&name);
+    dput(dentry);
+    if (!dev)
+        return -ENODEV;
+
+    *target = to_pci_dev(dev);
+    return 0;
+}
+
+/*
+ * The first non-empty PCIe chain of a topology, looking through
+ * stacked members, or the (empty) top-level chain if there is none
+ */
+static const struct pcie_chain *first_chain(const struct bdev_topology *topo)
+{
+    const struct pcie_chain *chain;
+    int i;
+
+    for (i = 0; !topo->chain.count && i < topo->nr_members; i++) {
+        if (topo->members[i].topo)
+            chain = first_chain(topo->members[i].topo);
+        else
+            chain = &topo->members[i].chain;
+        if (chain->count)
+            return chain;
+    }
+    return &topo->chain;
+}
+
+/*
+ * Resolve a P2P target fd on a file or block device to the endpoint
+ * holding it (the first member's for stacked devices)
+ */
+static int get_file_pci_target(struct file *filp, struct pci_dev **target)
+{
+    const struct pcie_chain *chain;
+    struct bdev_topology *topo;
+    struct block_device *bdev;
+    int ret;
+
+    ret = get_target_bdev(filp, &bdev);
+    if (ret < 0)
+        return ret;
+
+    topo = get_topology(bdev, topology_sb(file_data_inode(filp)));
+    if (IS_ERR(topo))
+        return PTR_ERR(topo);
+
+    chain = first_chain(topo);
+
+    if (chain->count) {
+        *target = pci_dev_get(chain->pdevs[0]);
+        ret = 0;
+    } else {
+        ret = -ENODEV;
+    }
+    put_topology(topo);
+    return ret;
+}
+
+/*
+ * Resolve the target of a P2P query
+ * Returns 0 with a referenced PCI device, or a negative error code.
+ * DMA-buf and VFIO fds do not expose their device and are rejected
+ * with -ENOTSUPP; pass the device's PCI address or sysfs fd instead.
+ */
+static int get_p2p_target(struct file_to_pcie_p2p_query *q,
+                          struct pci_dev **target)
+{
+    struct file *filp;
+    int ret;
+
+    if (!(q->flags & FILE_TO_PCIE_P2P_F_TARGET_FD)) {
+        *target = pci_get_domain_bus_and_slot(q->target_domain,
+                                              q->target_bus,
+                                              q->target_devfn);
+        return *target ? 0 : -ENODEV;
+    }
+
+    filp = get_file_from_fd(q->target_fd);
+    if (!filp)
+        return -EBADF;
+
+    if (filp->f_path.dentry->d_sb->s_magic == SYSFS_MAGIC)
+        ret = get_sysfs_pci_target(filp, target);
+    else
+        ret = get_file_pci_target(filp, target);
+    fput(filp);
+
+    if (ret == 0) {
+        q->target_domain = pci_domain_nr((*target)->bus);
+        q->target_bus = (*target)->bus->number;
+        q->target_devfn = (*target)->devfn;
+    }
+    return ret;
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_GET_P2P: P2P DMA distance from each PCIe
+ * endpoint holding a file segment to a target PCI device
+ */
+static long file_to_pcie_get_p2p(struct file_to_pcie_ctx *fctx,
+                                 void __user *argp)
+{
+    struct file_to_pcie_p2p_query q;
+    struct file_to_pcie_p2p_query __user *uq = argp;
+    struct bdev_topology *topo;
+    struct p2p_sink ps;
+    struct target_ref t;
+    struct block_device *bdev;
+    struct pci_dev *target;
+    loff_t sector_start, sector_end;
+    long ret;
+
+    if (copy_from_user(&q, uq, sizeof(q)))
+        return -EFAULT;
+
+    if ((q.flags & ~P2P_FLAGS) || q.reserved || q.offset < 0 ||
+        q.length == 0 || q.length > (u64)(LLONG_MAX - q.offset))
+        return -EINVAL;
+
+    ret = get_p2p_target(&q, &target);
+    if (ret < 0)
+        return ret;
+
+    ret = get_target(fctx, q.fd, q.flags & FILE_TO_PCIE_P2P_F_FIXED, &t);
+    if (ret < 0)
+        goto out_target;
+    bdev = t.bdev;
+
+    ret = calculate_sector_range(t.inode, q.offset, q.length,
+                                 &sector_start, &sector_end);
+    if (ret < 0)
+        goto out_file;
+
+    topo = get_topology(bdev, topology_sb(t.inode));
+    if (IS_ERR(topo)) {
+        ret = PTR_ERR(topo);
+        goto out_file;
+    }
+
+    memset(&ps, 0, sizeof(ps));
+    ps.sink.add = p2p_sink_add;
+    ps.target = target;
+    ps.upaths = u64_to_user_ptr(q.paths);
+    ps.capacity = q.path_capacity;
+    map_segment_to_topology(topo, t.inode, q.offset, q.length,
+                            sector_start, sector_end, &ps.sink);
+    put_topology(topo);
+    if (ps.err) {
+        ret = ps.err;
+        goto out_file;
+    }
+
+    q.path_count = ps.written;
+    q.paths_needed = ps.sink.count;
+    ret = copy_to_user(uq, &q, sizeof(q)) ? -EFAULT : 0;
+
+out_file:
+    put_target(&t);
+out_target:
+    pci_dev_put(target);
+    return ret;
+}
+
+/*
+ * Fill one extent record, clipped to [start, end)
+ */
+static void fill_extent_record(struct file_to_pcie_extent *rec, dev_t dev,
+                               const struct fiemap_extent *fe,
+                               loff_t start, loff_t end)
+{
+    loff_t lstart = max_t(loff_t, fe->fe_logical, start);
+    loff_t lend = min_t(loff_t, fe->fe_logical + fe->fe_length, end);
+
+    memset(rec, 0, sizeof(*rec));
+    rec->logical = lstart;
+    rec->length = lend - lstart;
+    rec->flags = fe->fe_flags;
+    rec->dev_major = MAJOR(dev);
+    rec->dev_minor = MINOR(dev);
+
+    /* Delayed or unknown extents have no physical location yet */
+    if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC)) {
+        rec->physical = -1;
+        rec->sector_start = -1;
+        rec->sector_end = -1;
+        return;
+    }
+
+    rec->physical = fe->fe_physical + (lstart - fe->fe_logical);
+    rec->sector_start = rec->physical >> 9;
+    rec->sector_end = (rec->physical + rec->length - 1) >> 9;
+}
+
+/*
+ * Destination for extent records in the caller's buffer. Records are
+ * kept open, one per device, until the next extent on that device
+ * does not continue them, so runs of contiguous extents go out as
+ * one record. Output is committed in units: a unit whose records do
+ * not all fit is dropped again, and the call ends at its offset.
+ */
+struct extent_open {
+    struct file_to_pcie_extent rec;
+    u64 seq;                        /* Order of first use, for eviction */
+    struct block_device *bdev;      /* Holding the extent, if known */
+    const struct pcie_chain *chain; /* Of bdev */
+};
+
+struct extent_state {
+    struct extent_open open[EXTENT_OPEN];
+    u32 nr_open;
+    u32 written;
+    /* Zone entries the written records refer to, and the last one */
+    u32 zones;
+    dev_t zone_dev;
+    sector_t zone_start;
+};
+
+struct extent_writer {
+    struct file_to_pcie_extent __user *uext;
+    u32 capacity;
+    struct file_to_pcie_zone __user *uzones;   /* NULL without zones */
+    u32 zone_capacity;
+    struct extent_state cur;
+    struct extent_state mark;       /* At the start of the current unit */
+    u64 seq;
+    loff_t next;                    /* Out: where the next call starts */
+#ifdef FILE_TO_PCIE_ZONES
+    struct blk_zone zone_buf[ZONE_CHUNK];
+    unsigned int nr_zone_buf;
+#endif
+};
+
+static bool extents_contiguous(const struct file_to_pcie_extent *a,
+                               const struct file_to_pcie_extent *b)
+{
+    if (a->dev_major != b->dev_major || a->dev_minor != b->dev_minor ||
+        (a->flags & ~FIEMAP_EXTENT_LAST) !=
+        (b->flags & ~FIEMAP_EXTENT_LAST) ||
+        a->logical + a->length != b->logical)
+        return false;
+
+    /* Extents without a location only merge with each other */
+    if (a->physical < 0 || b->physical < 0)
+        return a->physical == b->physical;
+    return a->physical + a->length == b->physical;
+}
+
+#ifdef FILE_TO_PCIE_ZONES
+static int collect_zone(struct blk_zone *zone, unsigned int idx, void *data)
+{
+    struct extent_writer *w = data;
+
+    if (w->nr_zone_buf < ZONE_CHUNK)
+        w->zone_buf[w->nr_zone_buf++] = *zone;
+    return 0;
+}
+
+static void fill_zone(struct file_to_pcie_zone *z, const struct blk_zone *bz,
+                      dev_t dev, const struct pcie_chain *chain)
+{
+    struct pci_dev *pdev;
+
+    memset(z, 0, sizeof(*z));
+    z->start = bz->start;
+    z->len = bz->len;
+    z->capacity = bz->capacity;
+    z->wp = bz->wp;
+    z->dev_major = MAJOR(dev);
+    z->dev_minor = MINOR(dev);
+    z->type = bz->type;
+    z->cond = bz->cond;
+    if (chain && chain->count) {
+        pdev = chain->pdevs[0];
+        z->domain = pci_domain_nr(pdev->bus);
+        z->bus = pdev->bus->number;
+        z->devfn = pdev->devfn;
+        z->flags = FILE_TO_PCIE_ZONE_F_ENDPOINT;
+    }
+}
+
+/*
+ * Report the zones an extent record spans, if it is on a zoned
+ * device. Consecutive records in the same zone share its entry.
+ * Entries past the caller's capacity are only counted.
+ * Returns 0 on success, negative error code on failure
+ */
+static int report_extent_zones(struct extent_writer *w,
+                               struct extent_open *open)
+{
+    struct file_to_pcie_extent *rec = &open->rec;
+    struct extent_state *st = &w->cur;
+    struct block_device *bdev = open->bdev;
+    struct file_to_pcie_zone z;
+    sector_t zone_sectors, sector, last;
+    unsigned int i, nr;
+    int ret;
+
+    if (!w->uzones || !bdev || !bdev_is_zoned(bdev) ||
+        rec->sector_start < 0)
+        return 0;
+
+    zone_sectors = bdev_zone_sectors(bdev);
+    sector = rec->sector_start & ~(zone_sectors - 1);
+    last = rec->sector_end;
+
+    rec->zone_index = st->zones;
+    rec->zone_count = 0;
+    if (st->zones && st->zone_dev == bdev->bd_dev &&
+        st->zone_start == sector) {
+        rec->zone_index--;
+        rec->zone_count++;
+        sector += zone_sectors;
+    }
+
+    while (sector <= last) {
+        nr = min_t(sector_t, ((last - sector) >> ilog2(zone_sectors)) + 1,
+                   ZONE_CHUNK);
+        w->nr_zone_buf = 0;
+        ret = blkdev_report_zones(bdev, sector, nr, collect_zone, w);
+        if (ret < 0)
+            return ret;
+        if (!w->nr_zone_buf)
+            break;
+
+        for (i = 0; i < w->nr_zone_buf; i++) {
+            if (st->zones < w->zone_capacity) {
+                fill_zone(&z, &w->zone_buf[i], bdev->bd_dev, open->chain);
+                if (copy_to_user(w->uzones + st->zones, &z, sizeof(z)))
+                    return -EFAULT;
+            }
+            st->zones++;
+            rec->zone_count++;
+        }
+
+        st->zone_dev = bdev->bd_dev;
+        st->zone_start = w->zone_buf[i - 1].start;
+        sector = st->zone_start + w->zone_buf[i - 1].len;
+    }
+    return 0;
+}
+#else
+static int report_extent_zones(struct extent_writer *w,
+                               struct extent_open *open)
+{
+    return 0;
+}
+#endif
+
+static int flush_open_extent(struct extent_writer *w, u32 i)
+{
+    struct extent_state *st = &w->cur;
+    int ret;
+
+    ret = report_extent_zones(w, &st->open[i]);
+    if (ret)
+        return ret;
+    if (copy_to_user(w->uext + st->written, &st->open[i].rec,
+                     sizeof(st->open[i].rec)))
+        return -EFAULT;
+    st->written++;
+    st->open[i] = st->open[--st->nr_open];
+    return 0;
+}
+
+/*
+ * Returns 0 on success, 1 if the buffer is full, -EFAULT on fault
+ */
+static int emit_extent(struct extent_writer *w,
+                       const struct file_to_pcie_extent *rec,
+                       struct block_device *bdev,
+                       const struct pcie_chain *chain)
+{
+    struct extent_state *st = &w->cur;
+    struct file_to_pcie_extent *open;
+    u32 i, oldest = 0;
+    int ret;
+
+    for (i = 0; i < st->nr_open; i++) {
+        open = &st->open[i].rec;
+        if (open->dev_major != rec->dev_major ||
+            open->dev_minor != rec->dev_minor)
+            continue;
+        if (extents_contiguous(open, rec)) {
+            open->length += rec->length;
+            open->sector_end = rec->sector_end;
+            open->flags |= rec->flags & FIEMAP_EXTENT_LAST;
+            return 0;
+        }
+        break;
+    }
+
+    /* Closed and open records both hold a place in the buffer */
+    if (st->written + st->nr_open >= w->capacity)
+        return 1;
+
+    if (i == st->nr_open && st->nr_open == EXTENT_OPEN) {
+        for (i = 1; i < st->nr_open; i++)
+            if (st->open[i].seq < st->open[oldest].seq)
+                oldest = i;
+        i = oldest;
+    }
+    if (i < st->nr_open) {
+        ret = flush_open_extent(w, i);
+        if (ret)
+            return ret;
+    }
+
+    st->open[st->nr_open].rec = *rec;
+    st->open[st->nr_open].seq = w->seq++;
+    st->open[st->nr_open].bdev = bdev;
+    st->open[st->nr_open].chain = chain;
+    st->nr_open++;
+    return 0;
+}
+
+/*
+ * Close every open record, in file order
+ */
+static int flush_extents(struct extent_writer *w)
+{
+    struct extent_state *st = &w->cur;
+    u32 i, first;
+    int ret;
+
+    while (st->nr_open) {
+        first = 0;
+        for (i = 1; i < st->nr_open; i++)
+            if (st->open[i].rec.logical < st->open[first].rec.logical ||
+                (st->open[i].rec.logical == st->open[first].rec.logical &&
+                 st->open[i].seq < st->open[first].seq))
+                first = i;
+        ret = flush_open_extent(w, first);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+static int emit_topology_extent(struct extent_writer *w,
+                                const struct bdev_topology *topo,
+                                const struct file_to_pcie_extent *rec);
+
+/*
+ * Flags of one of the records an extent is cut into. Only the last of
+ * them keeps FIEMAP_EXTENT_LAST, so a caller sees it once.
+ */
+static u32 last_piece_flags(const struct file_to_pcie_extent *rec, bool last)
+{
+    return last ? rec->flags : rec->flags & ~FIEMAP_EXTENT_LAST;
+}
+
+/*
+ * Emit a member's piece of an extent, translated further if the
+ * member is stacked itself
+ */
+static int emit_member_extent(struct extent_writer *w,
+                              const struct stack_member *m,
+                              struct file_to_pcie_extent *piece)
+{
+    piece->dev_major = MAJOR(m->bdev->bd_dev);
+    piece->dev_minor = MINOR(m->bdev->bd_dev);
+    if (m->topo)
+        return emit_topology_extent(w, m->topo, piece);
+    return emit_extent(w, piece, m->bdev, &m->chain);
+}
+
+/* Whether the consecutive devices of a topology hold all of rec */
+static bool concat_holds(const struct bdev_topology *topo,
+                         const struct file_to_pcie_extent *rec)
+{
+    return topo->layout == TOPO_LAYOUT_CONCAT &&
+           rec->physical + rec->length <=
+           (topo->members[topo->nr_members - 1].fs_end << SECTOR_SHIFT);
+}
+
+/*
+ * Emit an extent on bdev, translated onto the members of a stacked
+ * device where the mapping is known. Striped extents are split at
+ * chunk boundaries and f2fs extents at device boundaries, with one
+ * record per piece; mirrored extents get one record per copy. On a
+ * multi-device filesystem whose layout is unknown, every device gets
+ * a record without a physical location.
+ * Returns as emit_extent().
+ */
+static int emit_topology_extent(struct extent_writer *w,
+                                const struct bdev_topology *topo,
+                                const struct file_to_pcie_extent *rec)
+{
+    const struct stack_member *m;
+    struct file_to_pcie_extent piece;
+    u64 chunk_bytes, pos, remaining, chunk_no, in_chunk, len;
+    u32 member;
+    int ret;
+    int i;
+
+    piece = *rec;
+
+    if (rec->sector_start < 0 ||
+        (topo->layout != TOPO_LAYOUT_STRIPED &&
+         topo->layout != TOPO_LAYOUT_MIRRORED && !concat_holds(topo, rec))) {
+        if (!topo->filesystem)
+            return emit_extent(w, rec, topo->bdev, first_chain(topo));
+
+        /* A filesystem address, not a sector on any one device */
+        piece.physical = -1;
+        piece.sector_start = -1;
+        piece.sector_end = -1;
+        for (i = 0; i < topo->nr_members; i++) {
+            piece.dev_major = MAJOR(topo->members[i].bdev->bd_dev);
+            piece.dev_minor = MINOR(topo->members[i].bdev->bd_dev);
+            piece.flags = last_piece_flags(rec, i == topo->nr_members - 1);
+            ret = emit_extent(w, &piece, NULL, NULL);
+            if (ret)
+                return ret;
+        }
+        return 0;
+    }
+
+    if (topo->layout == TOPO_LAYOUT_MIRRORED) {
+        for (i = 0; i < topo->nr_members; i++) {
+            m = &topo->members[i];
+            piece.physical = rec->physical +
+                ((topo->start_sect + m->data_offset) << SECTOR_SHIFT);
+            piece.sector_start = piece.physical >> SECTOR_SHIFT;
+            piece.sector_end = (piece.physical + piece.length - 1) >>
+                SECTOR_SHIFT;
+            piece.flags = last_piece_flags(rec, i == topo->nr_members - 1);
+            ret = emit_member_extent(w, m, &piece);
+            if (ret)
+                return ret;
+        }
+        return 0;
+    }
+
+    if (topo->layout == TOPO_LAYOUT_CONCAT) {
+        pos = rec->physical;
+        remaining = rec->length;
+        i = 0;
+        while (remaining) {
+            while (pos >= (topo->members[i].fs_end << SECTOR_SHIFT))
+                i++;
+            m = &topo->members[i];
+            len = min(remaining, (m->fs_end << SECTOR_SHIFT) - pos);
+
+            piece.logical = rec->logical + (rec->length - remaining);
+            piece.length = len;
+            piece.physical = pos - (m->fs_start << SECTOR_SHIFT);
+            piece.sector_start = piece.physical >> SECTOR_SHIFT;
+            piece.sector_end = (piece.physical + len - 1) >> SECTOR_SHIFT;
+            piece.flags = last_piece_flags(rec, len == remaining);
+
+            ret = emit_member_extent(w, m, &piece);
+            if (ret)
+                return ret;
+
+            pos += len;
+            remaining -= len;
+        }
+        return 0;
+    }
+
+    chunk_bytes = (u64)topo->chunk_sectors << SECTOR_SHIFT;
+    pos = rec->physical + (topo->start_sect << SECTOR_SHIFT);
+    remaining = rec->length;
+
+    while (remaining) {
+        chunk_no = div64_u64(pos, chunk_bytes);
+        in_chunk = pos - chunk_no * chunk_bytes;
+        len = min(remaining, chunk_bytes - in_chunk);
+        m = &topo->members[mod_u64(chunk_no, topo->nr_members)];
+        member = div_u64(chunk_no, topo->nr_members);
+
+        piece.logical = rec->logical + (rec->length - remaining);
+        piece.length = len;
+        piece.physical = (u64)member * chunk_bytes + in_chunk +
+            (m->data_offset << SECTOR_SHIFT);
+        piece.sector_start = piece.physical >> SECTOR_SHIFT;
+        piece.sector_end = (piece.physical + len - 1) >> SECTOR_SHIFT;
+        piece.flags = last_piece_flags(rec, len == remaining);
+
+        ret = emit_member_extent(w, m, &piece);
+        if (ret)
+            return ret;
+
+        pos += len;
+        remaining -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Emit an extent as one or more units, each either taken whole or
+ * dropped again if the buffer fills partway through it, so the call
+ * can end cleanly at its offset. Where the topology turns an extent
+ * into several records, it is cut at EXTENT_WINDOW boundaries of the
+ * file to keep units small.
+ * Returns 0 on success, 1 with w->next set if the buffer is full, or
+ * -ENOSPC if it cannot hold even the first unit
+ */
+static int emit_extent_units(struct extent_writer *w,
+                             const struct bdev_topology *topo,
+                             const struct file_to_pcie_extent *rec)
+{
+    struct file_to_pcie_extent unit = *rec;
+    loff_t end = rec->logical + rec->length;
+    bool split = topo->filesystem ||
+        topo->layout == TOPO_LAYOUT_STRIPED ||
+        topo->layout == TOPO_LAYOUT_MIRRORED;
+    u64 skip;
+    int ret;
+
+    while (unit.logical < end) {
+        unit.length = end - unit.logical;
+        if (split)
+            unit.length = min_t(u64, unit.length, EXTENT_WINDOW -
+                                (unit.logical & (EXTENT_WINDOW - 1)));
+        unit.flags = last_piece_flags(rec, unit.logical + unit.length == end);
+        if (rec->physical >= 0) {
+            skip = unit.logical - rec->logical;
+            unit.physical = rec->physical + skip;
+            unit.sector_start = unit.physical >> SECTOR_SHIFT;
+            unit.sector_end = (unit.physical + unit.length - 1) >>
+                SECTOR_SHIFT;
+        }
+
+        w->mark = w->cur;
+        ret = emit_topology_extent(w, topo, &unit);
+        if (ret < 0)
+            return ret;
+        if (ret) {
+            if (!w->mark.written && !w->mark.nr_open)
+                return -ENOSPC;
+            w->cur = w->mark;
+            w->next = unit.logical;
+            return 1;
+        }
+
+        unit.logical += unit.length;
+        w->next = unit.logical;
+
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    return 0;
+}
+
+/*
+ * Walk the real extents of a regular file with the filesystem's
+ * ->fiemap. fiemap only writes to user memory, so each chunk is
+ * mapped into the unused tail of the caller's result buffer, read
+ * back, and rewritten in place as file_to_pcie_extent records (which
+ * are never smaller than struct fiemap_extent, and are only written
+ * after the whole chunk has been read back).
+ * Returns 0 on success, negative error code on failure
+ */
+static int map_file_extents(struct inode *inode,
+                            const struct bdev_topology *topo,
+                            const struct file_to_pcie_extent_request *req,
+                            loff_t start, struct extent_writer *w)
+{
+    struct fiemap_extent_info fieinfo;
+    struct fiemap_extent *kext;
+    struct file_to_pcie_extent rec;
+    loff_t pos = start;
+    loff_t end = req->offset + req->length;
+    u32 room, mapped, i;
+    int ret = 0;
+
+    BUILD_BUG_ON(sizeof(struct file_to_pcie_extent) <
+                 sizeof(struct fiemap_extent));
+
+    if (!inode->i_op->fiemap)
+        return -ENOTSUPP;
+
+    kext = kmalloc_array(EXTENT_CHUNK, sizeof(*kext), GFP_KERNEL);
+    if (!kext)
+        return -ENOMEM;
+
+    while (pos < end) {
+        room = w->capacity - w->cur.written - w->cur.nr_open;
+        if (!room) {
+            ret = 1;
+            break;
+        }
+
+        memset(&fieinfo, 0, sizeof(fieinfo));
+        if (req->flags & FILE_TO_PCIE_EXTENT_F_SYNC)
+            fieinfo.fi_flags = FIEMAP_FLAG_SYNC;
+        fieinfo.fi_extents_max = min_t(u32, room, EXTENT_CHUNK);
+        fieinfo.fi_extents_start =
+            (struct fiemap_extent __user *)(w->uext + w->cur.written);
+
+        ret = inode->i_op->fiemap(inode, &fieinfo, pos, end - pos);
+        if (ret)
+            break;
+
+        mapped = fieinfo.fi_extents_mapped;
+        if (!mapped)
+            break; /* Only holes remain */
+
+        if (copy_from_user(kext, w->uext + w->cur.written,
+                           mapped * sizeof(*kext))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < mapped; i++) {
+            fill_extent_record(&rec, inode->i_sb->s_bdev->bd_dev, &kext[i],
+                               start, end);
+            ret = emit_extent_units(w, topo, &rec);
+            if (ret)
+                goto out;
+        }
+
+        if (kext[mapped - 1].fe_flags & FIEMAP_EXTENT_LAST ||
+            mapped < fieinfo.fi_extents_max)
+            break;
+        pos = kext[mapped - 1].fe_logical + kext[mapped - 1].fe_length;
+    }
+
+out:
+    kfree(kext);
+    return ret;
+}
+
+/*
+ * FILE_TO_PCIE_IOCTL_GET_EXTENTS: map a file segment to its physical
+ * extents. Block device files map to a single extent at the same
+ * offset. Extents on md/dm devices are translated to their members
+ * where the layout is known. If the result buffer fills up, the
+ * cursor says where the next call continues.
+ */
+static long file_to_pcie_get_extents(struct file_to_pcie_ctx *fctx,
+                                     void __user *argp, size_t usize)
+{
+    struct file_to_pcie_extent_request req;
+    struct file_to_pcie_extent_request __user *ureq = argp;
+    struct target_ref t;
+    struct extent_writer *w;
+    struct file_to_pcie_extent rec;
+    struct bdev_topology *topo;
+    struct block_device *bdev;
+    struct inode *inode;
+    loff_t start, end;
+    u64 gen = query_generation();
+    long ret;
+
+    BUILD_BUG_ON(offsetof(struct file_to_pcie_extent_request, cursor) !=
+                 FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V1);
+    BUILD_BUG_ON(offsetof(struct file_to_pcie_extent_request, zones) !=
+                 FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V2);
+    BUILD_BUG_ON(sizeof(struct file_to_pcie_extent_request) !=
+                 FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V3);
+
+    if (usize < FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V1)
+        return -EINVAL;
+    ret = copy_struct_from_user(&req, sizeof(req), ureq, usize);
+    if (ret)
+        return ret;
+
+    if (req.flags & ~(FILE_TO_PCIE_EXTENT_F_SYNC |
+                      FILE_TO_PCIE_EXTENT_F_FIXED |
+                      FILE_TO_PCIE_EXTENT_F_RESUME |
+                      FILE_TO_PCIE_EXTENT_F_ZONES))
+        return -EINVAL;
+    if ((req.flags & FILE_TO_PCIE_EXTENT_F_ZONES) &&
+        (usize < FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V3 ||
+         (req.zone_capacity && !req.zones)))
+        return -EINVAL;
+    if (req.offset < 0 || req.length == 0 || !req.extent_capacity ||
+        req.length > (u64)(LLONG_MAX - req.offset))
+        return -EINVAL;
+
+    start = req.offset;
+    end = req.offset + req.length;
+    if (req.flags & FILE_TO_PCIE_EXTENT_F_RESUME) {
+        if (usize < FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V2 ||
+            req.cursor.offset < start || req.cursor.offset > end)
+            return -EINVAL;
+        if (req.cursor.generation != gen)
+            return -ESTALE;
+        start = req.cursor.offset;
+    }
+
+    /* Two sets of open records: too big for the stack */
+    w = kmalloc(sizeof(*w), GFP_KERNEL);
+    if (!w)
+        return -ENOMEM;
+    w->uext = u64_to_user_ptr(req.extents);
+    w->capacity = req.extent_capacity;
+    w->uzones = NULL;
+    w->zone_capacity = 0;
+    if (req.flags & FILE_TO_PCIE_EXTENT_F_ZONES) {
+        w->uzones = u64_to_user_ptr(req.zones);
+        w->zone_capacity = req.zone_capacity;
+    }
+    w->cur.nr_open = 0;
+    w->cur.written = 0;
+    w->cur.zones = 0;
+    w->seq = 0;
+    w->next = start;
+
+    ret = get_target(fctx, req.fd, req.flags & FILE_TO_PCIE_EXTENT_F_FIXED,
+                     &t);
+    if (ret < 0)
+        goto out_free;
+    bdev = t.bdev;
+
+    topo = get_topology(bdev, topology_sb(t.inode));
+    if (IS_ERR(topo)) {
+        ret = PTR_ERR(topo);
+        goto out_file;
+    }
+
+    inode = t.inode;
+    if (start == end) {
+        ret = 0;
+    } else if (S_ISBLK(inode->i_mode)) {
+        struct fiemap_extent fe = {
+            .fe_logical = start,
+            .fe_physical = start,
+            .fe_length = end - start,
+        };
+
+        fill_extent_record(&rec, bdev->bd_dev, &fe, start, end);
+        ret = emit_extent_units(w, topo, &rec);
+    } else {
+        ret = map_file_extents(inode, topo, &req, start, w);
+    }
+    if (ret >= 0) {
+        if (!ret)
+            w->next = end;
+        ret = flush_extents(w);
+    }
+    /* Open records point into the topology until they are flushed */
+    put_topology(topo);
+    if (ret)
+        goto out_file;
+
+    if (put_user(w->cur.written, &ureq->extent_count) ||
+        (usize >= FILE_TO_PCIE_EXTENT_REQUEST_SIZE_V2 &&
+         (put_user(w->next, &ureq->cursor.offset) ||
+          put_user(gen, &ureq->cursor.generation))) ||
+        ((req.flags & FILE_TO_PCIE_EXTENT_F_ZONES) &&
+         (put_user(min(w->cur.zones, w->zone_capacity), &ureq->zone_count) ||
+          put_user(w->cur.zones, &ureq->zones_needed))))
+        ret = -EFAULT;
+
+out_file:
+    put_target(&t);
+out_free:
+    kfree(w);
+    return ret;
+}
+
+/*
+ * Request dispatch, shared by ioctl and io_uring
+ */
+static long file_to_pcie_dispatch(struct file_to_pcie_ctx *fctx,
+                                  unsigned int cmd, void __user *argp)
+{
+    if (_IOC_TYPE(cmd) != FILE_TO_PCIE_IOC_MAGIC)
+        return -ENOTTY;
+
+    /*
+     * Compact requests are extensible structs: the size encoded in
+     * the ioctl number is whatever the caller was built with
+     */
+    if (_IOC_DIR(cmd) == (_IOC_READ | _IOC_WRITE)) {
+        switch (_IOC_NR(cmd)) {
+        case _IOC_NR(FILE_TO_PCIE_IOCTL_QUERY):
+            return file_to_pcie_query(fctx, argp, _IOC_SIZE(cmd), false);
+        case _IOC_NR(FILE_TO_PCIE_IOCTL_QUERY_BATCH):
+            return file_to_pcie_query_batch(fctx, argp, _IOC_SIZE(cmd));
+        case _IOC_NR(FILE_TO_PCIE_IOCTL_QUERY_DIR):
+            return file_to_pcie_query_dir(argp, _IOC_SIZE(cmd));
+        case _IOC_NR(FILE_TO_PCIE_IOCTL_QUERY_GROUPS):
+            return file_to_pcie_query_groups(fctx, argp, _IOC_SIZE(cmd));
+        case _IOC_NR(FILE_TO_PCIE_IOCTL_GET_EXTENTS):
+            return file_to_pcie_get_extents(fctx, argp, _IOC_SIZE(cmd));
+        }
+    }
+
+    switch (cmd) {
+    case FILE_TO_PCIE_IOCTL_GET_PCIE:
+        return file_to_pcie_get_pcie(argp);
+    case FILE_TO_PCIE_IOCTL_GET_PCIE_BATCH:
+        return file_to_pcie_get_pcie_batch(fctx, argp);
+    case FILE_TO_PCIE_IOCTL_GET_P2P:
+        return file_to_pcie_get_p2p(fctx, argp);
+    case FILE_TO_PCIE_IOCTL_REGISTER_FILES:
+        return file_to_pcie_register_files(fctx, argp);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * Count a completed request in the per-CPU statistics
+ */
+static void account_request(unsigned int cmd, long ret, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    unsigned int i;
+
+    this_cpu_inc(query_stats.calls);
+    this_cpu_inc(query_stats.latency[min_t(int, ns ? ilog2(ns) : 0,
+                                           STATS_LATENCY_BUCKETS - 1)]);
+    if (ret < 0) {
+        for (i = 0; i < ARRAY_SIZE(stats_errnos); i++) {
+            if (stats_errnos[i].err == -ret)
+                break;
+        }
+        this_cpu_inc(query_stats.errors);
+        this_cpu_inc(query_stats.errnos[i]);
+    }
+
+    trace_file_to_pcie_request(cmd, ret, ns);
+}
+
+/*
+ * IOCTL handler
+ */
+static long file_to_pcie_ioctl(struct file *filp, unsigned int cmd,
+                                unsigned long arg)
+{
+    u64 start = ktime_get_ns();
+    long ret;
+
+    ret = file_to_pcie_dispatch(filp->private_data, cmd,
+                                (void __user *)arg);
+    account_request(cmd, ret, start);
+    return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+static const struct file_to_pcie_uring_cmd *
+uring_cmd_arg(struct io_uring_cmd *ioucmd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    return io_uring_sqe_cmd(ioucmd->sqe);
+#else
+    return ioucmd->cmd;
+#endif
+}
+
+/*
+ * io_uring IORING_OP_URING_CMD handler. cmd_op is an ioctl number and
+ * the SQE carries its argument. Compact queries on a cached topology
+ * complete inline; everything that may block returns -EAGAIN on the
+ * non-blocking issue, and io_uring retries it from an io-wq worker.
+ */
+static int file_to_pcie_uring_cmd(struct io_uring_cmd *ioucmd,
+                                  unsigned int issue_flags)
+{
+    const struct file_to_pcie_uring_cmd *ucmd = uring_cmd_arg(ioucmd);
+    struct file_to_pcie_ctx *fctx = ioucmd->file->private_data;
+    unsigned int cmd = ioucmd->cmd_op;
+    u64 start = ktime_get_ns();
+    void __user *argp;
+    int ret;
+
+    if (READ_ONCE(ucmd->reserved))
+        return -EINVAL;
+    argp = u64_to_user_ptr(READ_ONCE(ucmd->arg));
+
+    if (!(issue_flags & IO_URING_F_NONBLOCK)) {
+        ret = file_to_pcie_dispatch(fctx, cmd, argp);
+    } else if (_IOC_TYPE(cmd) == FILE_TO_PCIE_IOC_MAGIC &&
+               _IOC_DIR(cmd) == (_IOC_READ | _IOC_WRITE) &&
+               _IOC_NR(cmd) == _IOC_NR(FILE_TO_PCIE_IOCTL_QUERY)) {
+        ret = file_to_pcie_query(fctx, argp, _IOC_SIZE(cmd), true);
+        /* Not counted until the retry from io-wq completes */
+        if (ret == -EAGAIN)
+            return ret;
+    } else {
+        return -EAGAIN;
+    }
+
+    account_request(cmd, ret, start);
+    return ret;
+}
+#endif
+
+/*
+ * File operations
+ */
+static int file_to_pcie_open(struct inode *inode, struct file *file)
+{
+    struct file_to_pcie_ctx *fctx;
+
+    fctx = kzalloc(sizeof(*fctx), GFP_KERNEL);
+    if (!fctx)
+        return -ENOMEM;
+    if (init_srcu_struct(&fctx->srcu)) {
+        kfree(fctx);
+        return -ENOMEM;
+    }
+
+    mutex_init(&fctx->lock);
+    fctx->seen_generation = atomic64_read(&topo_generation);
+    file->private_data = fctx;
     return 0;
 }
 
 static int file_to_pcie_release(struct inode *inode, struct file *file)
 {
+    struct file_to_pcie_ctx *fctx = file->private_data;
+
+    free_fixed_table(fctx);
+    cleanup_srcu_struct(&fctx->srcu);
+    mutex_destroy(&fctx->lock);
+    kfree(fctx);
     return 0;
 }
 
+/*
+ * read(): the current topology generation, as a u64. Never blocks;
+ * wait for a change with poll() instead.
+ */
+static ssize_t file_to_pcie_read(struct file *file, char __user *buf,
+                                 size_t count, loff_t *ppos)
+{
+    struct file_to_pcie_ctx *fctx = file->private_data;
+    u64 gen;
+
+    if (count < sizeof(gen))
+        return -EINVAL;
+
+    gen = atomic64_read(&topo_generation);
+    if (copy_to_user(buf, &gen, sizeof(gen)))
+        return -EFAULT;
+    WRITE_ONCE(fctx->seen_generation, gen);
+    return sizeof(gen);
+}
+
+/*
+ * poll(): always readable, and POLLPRI once the generation has moved
+ * past the last one read() returned on this open file, as sysfs
+ * attributes signal a change
+ */
+static __poll_t file_to_pcie_poll(struct file *file, poll_table *wait)
+{
+    struct file_to_pcie_ctx *fctx = file->private_data;
+    __poll_t mask = EPOLLIN | EPOLLRDNORM;
+
+    poll_wait(file, &topo_wait, wait);
+    if (atomic64_read(&topo_generation) != READ_ONCE(fctx->seen_generation))
+        mask |= EPOLLPRI;
+    return mask;
+}
+
 static const struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = file_to_pcie_open,
     .release = file_to_pcie_release,
+    .read = file_to_pcie_read,
+    .poll = file_to_pcie_poll,
+    .llseek = noop_llseek,
     .unlocked_ioctl = file_to_pcie_ioctl,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+    .uring_cmd = file_to_pcie_uring_cmd,
+#endif
+};
+
+/*
+ * debugfs statistics: file_to_pcie/stats and file_to_pcie/latency
+ */
+static void sum_stats(struct query_stats *sum)
+{
+    const u64 *src;
+    u64 *dst = (u64 *)sum;
+    unsigned int i;
+    int cpu;
+
+    BUILD_BUG_ON(sizeof(*sum) % sizeof(u64));
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        src = (const u64 *)per_cpu_ptr(&query_stats, cpu);
+        for (i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+            dst[i] += src[i];
+    }
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+    struct query_stats sum;
+    unsigned int i;
+
+    sum_stats(&sum);
+    seq_printf(m, "calls %llu\n", sum.calls);
+    seq_printf(m, "errors %llu\n", sum.errors);
+    seq_printf(m, "cache_hits %llu\n", sum.cache_hits);
+    seq_printf(m, "cache_misses %llu\n", sum.cache_misses);
+    for (i = 0; i < ARRAY_SIZE(stats_errnos); i++) {
+        if (sum.errnos[i])
+            seq_printf(m, "errno %s %llu\n", stats_errnos[i].name,
+                       sum.errnos[i]);
+    }
+    if (sum.errnos[i])
+        seq_printf(m, "errno other %llu\n", sum.errnos[i]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/* One line per non-empty bucket: lowest ns, highest ns, count */
+static int latency_show(struct seq_file *m, void *v)
+{
+    struct query_stats sum;
+    int i;
+
+    sum_stats(&sum);
+    for (i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        if (sum.latency[i])
+            seq_printf(m, "%llu %llu %llu\n", i ? 1ULL << i : 0,
+                       i == STATS_LATENCY_BUCKETS - 1 ? U64_MAX :
+                       (2ULL << i) - 1, sum.latency[i]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static void stats_debugfs_init(void)
+{
+    /* Statistics are optional: failures here are not fatal */
+    debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("stats", 0444, debugfs_dir, NULL, &stats_fops);
+    debugfs_create_file("latency", 0444, debugfs_dir, NULL, &latency_fops);
+}
+
+/*
+ * Topology cache setup and teardown
+ */
+static int topo_cache_init(void)
+{
+    struct file_system_type *sysfs_type;
+
+    /* Never 0, and past anything an earlier load of the module reported */
+    atomic64_set(&topo_generation, ktime_get_real_ns());
+
+    /* Built in, so the reference get_fs_type() takes pins nothing */
+    sysfs_type = get_fs_type("sysfs");
+    if (!sysfs_type)
+        return -ENODEV;
+    sysfs_mnt = kern_mount(sysfs_type);
+    if (IS_ERR(sysfs_mnt))
+        return PTR_ERR(sysfs_mnt);
+
+    topo_free_wq = alloc_workqueue("file_to_pcie", 0, 0);
+    if (!topo_free_wq) {
+        kern_unmount(sysfs_mnt);
+        return -ENOMEM;
+    }
+
+    if (bus_register_notifier(&pci_bus_type, &topo_pci_nb)) {
+        destroy_workqueue(topo_free_wq);
+        kern_unmount(sysfs_mnt);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void topo_cache_exit(void)
+{
+    bus_unregister_notifier(&pci_bus_type, &topo_pci_nb);
+    if (topo_block_intf_registered)
+        class_interface_unregister(&topo_block_intf);
+
+    invalidate_topology_cache();
+    /* Wait for queue_rcu_work() callbacks, then for the frees */
+    rcu_barrier();
+    destroy_workqueue(topo_free_wq);
+    kern_unmount(sysfs_mnt);
+}
+
+#ifdef FILE_TO_PCIE_BPF
+/*
+ * BPF interface. bpf_file_to_pcie_dev() never sleeps and only reads
+ * the topology cache, so it can run in tracepoints on the I/O path;
+ * bpf_file_to_pcie_file() is the full query for sleepable programs
+ * and fills the cache as it goes. Both write compact records with
+ * the layout of this module's header and return the number of
+ * records in the full answer, as records_needed.
+ */
+#define BPF_DEV_FLAGS (FILE_TO_PCIE_QUERY_F_LIMITS | \
+                       FILE_TO_PCIE_QUERY_F_LOAD | \
+                       FILE_TO_PCIE_QUERY_F_ENDPOINT)
+
+/* Iterator state, on the program's stack */
+struct bpf_iter_file_to_pcie {
+    __u64 __opaque[6];
+} __aligned(8);
+
+struct bpf_iter_file_to_pcie_kern {
+    struct file_to_pcie_topo_entry entry;
+    u32 bucket;
+    u32 pos;                    /* Entries of bucket already returned */
+} __aligned(8);
+
+/* __bpf_kfunc_start_defs() came in 6.7 */
+#ifndef __bpf_kfunc_start_defs
+#define __bpf_kfunc_start_defs() \
+    __diag_push(); \
+    __diag_ignore_all("-Wmissing-prototypes", \
+                      "Global kfuncs as their definitions will be in BTF")
+#define __bpf_kfunc_end_defs() __diag_pop()
+#endif
+
+/* BTF_KFUNCS_START() came in 6.9 */
+#ifndef BTF_KFUNCS_START
+#define BTF_KFUNCS_START BTF_SET8_START
+#define BTF_KFUNCS_END BTF_SET8_END
+#endif
+
+/*
+ * Cached topology of a block device by number. Filesystem entries
+ * never match, including an f2fs's under its first device's number.
+ */
+static struct bdev_topology *lookup_topology_dev_rcu(dev_t dev)
+{
+    struct bdev_topology *topo;
+
+    hash_for_each_possible_rcu(topo_cache, topo, node, dev) {
+        if (!topo->filesystem && topo->dev == dev &&
+            !topology_expired(topo)) {
+            this_cpu_inc(query_stats.cache_hits);
+            return topo;
+        }
+    }
+    return NULL;
+}
+
+static void fill_topo_entry(struct file_to_pcie_topo_entry *ent,
+                            const struct bdev_topology *topo)
+{
+    const struct pcie_chain *chain = &topo->chain;
+    struct pci_dev *pdev;
+    u64 gen = ent->generation;
+
+    memset(ent, 0, sizeof(*ent));
+    ent->generation = gen;
+    ent->dev_major = MAJOR(topo->dev);
+    ent->dev_minor = MINOR(topo->dev);
+    ent->nr_devices = chain->count;
+    ent->nr_members = topo->nr_members;
+    ent->numa_node = NUMA_NO_NODE;
+    if (topo->filesystem)
+        ent->flags |= FILE_TO_PCIE_TOPO_F_FILESYSTEM;
+    if (!chain->count)
+        return;
+
+    pdev = chain->pdevs[0];
+    ent->domain = pci_domain_nr(pdev->bus);
+    ent->bus = pdev->bus->number;
+    ent->devfn = pdev->devfn;
+    ent->numa_node = dev_to_node(&pdev->dev);
+
+    pdev = chain->pdevs[chain->count - 1];
+    ent->top_domain = pci_domain_nr(pdev->bus);
+    ent->top_bus = pdev->bus->number;
+    ent->top_devfn = pdev->devfn;
+}
+
+__bpf_kfunc_start_defs();
+
+/*
+ * Map [offset, offset + length) of block device dev (a kernel dev_t,
+ * as in bd_dev and the block tracepoints) onto its PCIe devices.
+ * A device that is not cached yet gives -ENOENT.
+ */
+__bpf_kfunc int bpf_file_to_pcie_dev(u32 dev, u64 offset, u64 length,
+                                     u32 flags, void *recs, u32 recs__sz)
+{
+    struct record_dest dst = { .flags = flags };
+    struct bdev_topology *topo;
+    struct record_sink rs;
+
+    if ((flags & ~BPF_DEV_FLAGS) || !length || offset > LLONG_MAX ||
+        length > (u64)(LLONG_MAX - offset))
+        return -EINVAL;
+
+    init_record_sink(&rs, recs, &dst, 0,
+                     recs__sz / sizeof(struct file_to_pcie_dev_record));
+
+    rcu_read_lock();
+    topo = lookup_topology_dev_rcu(dev);
+    if (topo)
+        map_segment_to_topology(topo, NULL, offset, length,
+                                offset >> SECTOR_SHIFT,
+                                (offset + length - 1) >> SECTOR_SHIFT,
+                                &rs.sink);
+    rcu_read_unlock();
+
+    return topo ? rs.sink.count : -ENOENT;
+}
+
+/*
+ * Map [offset, offset + length) of a file, as FILE_TO_PCIE_IOCTL_QUERY
+ * does. Takes the record flags of a compact query.
+ */
+__bpf_kfunc int bpf_file_to_pcie_file(struct file *file, u64 offset,
+                                      u64 length, u32 flags, void *recs,
+                                      u32 recs__sz)
+{
+    struct record_dest dst = { .flags = flags };
+    struct inode *inode = file_data_inode(file);
+    struct bdev_topology *topo;
+    struct block_device *bdev;
+    struct record_sink rs;
+    loff_t sector_start, sector_end;
+    int ret;
+
+    if ((flags & ~RECORD_FLAGS) || !length || offset > LLONG_MAX ||
+        length > (u64)(LLONG_MAX - offset))
+        return -EINVAL;
+
+    ret = get_target_bdev(file, &bdev);
+    if (ret < 0)
+        return ret;
+    ret = segment_sector_range(inode, offset, length, flags, &sector_start,
+                               &sector_end);
+    if (ret < 0)
+        return ret;
+
+    topo = get_topology(bdev, topology_sb(inode));
+    if (IS_ERR(topo))
+        return PTR_ERR(topo);
+
+    init_record_sink(&rs, recs, &dst, 0,
+                     recs__sz / sizeof(struct file_to_pcie_dev_record));
+    map_segment_to_topology(topo, inode, offset, length, sector_start,
+                            sector_end, &rs.sink);
+    put_topology(topo);
+    return rs.sink.count;
+}
+
+__bpf_kfunc int bpf_iter_file_to_pcie_new(struct bpf_iter_file_to_pcie *it)
+{
+    struct bpf_iter_file_to_pcie_kern *kit = (void *)it;
+
+    BUILD_BUG_ON(sizeof(*kit) > sizeof(*it));
+    BUILD_BUG_ON(__alignof__(*kit) != __alignof__(*it));
+
+    memset(kit, 0, sizeof(*kit));
+    kit->entry.generation = query_generation();
+    return 0;
+}
+
+/*
+ * Next cached topology, or NULL at the end. The position is kept as
+ * a bucket and a count within it, so no reference is held between
+ * calls.
+ */
+__bpf_kfunc struct file_to_pcie_topo_entry *
+bpf_iter_file_to_pcie_next(struct bpf_iter_file_to_pcie *it)
+{
+    struct bpf_iter_file_to_pcie_kern *kit = (void *)it;
+    struct bdev_topology *topo;
+    u32 i;
+
+    rcu_read_lock();
+    for (; kit->bucket < HASH_SIZE(topo_cache); kit->bucket++, kit->pos = 0) {
+        i = 0;
+        hlist_for_each_entry_rcu(topo, &topo_cache[kit->bucket], node) {
+            if (i++ < kit->pos)
+                continue;
+            kit->pos++;
+            fill_topo_entry(&kit->entry, topo);
+            rcu_read_unlock();
+            return &kit->entry;
+        }
+    }
+    rcu_read_unlock();
+    return NULL;
+}
+
+__bpf_kfunc void bpf_iter_file_to_pcie_destroy(struct bpf_iter_file_to_pcie *it)
+{
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(file_to_pcie_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_file_to_pcie_dev)
+BTF_ID_FLAGS(func, bpf_file_to_pcie_file, KF_TRUSTED_ARGS | KF_SLEEPABLE)
+BTF_ID_FLAGS(func, bpf_iter_file_to_pcie_new, KF_ITER_NEW)
+BTF_ID_FLAGS(func, bpf_iter_file_to_pcie_next, KF_ITER_NEXT | KF_RET_NULL)
+BTF_ID_FLAGS(func, bpf_iter_file_to_pcie_destroy, KF_ITER_DESTROY)
+BTF_KFUNCS_END(file_to_pcie_kfunc_ids)
+
+static const struct btf_kfunc_id_set file_to_pcie_kfunc_set = {
+    .owner = THIS_MODULE,
+    .set = &file_to_pcie_kfunc_ids,
 };
 
+/*
+ * Make the kfuncs available to tracing (fentry, tp_btf, ...),
+ * struct_ops (sched_ext) and syscall programs. They go away with the
+ * module's BTF; loaded programs using them hold a module reference.
+ */
+static int file_to_pcie_bpf_init(void)
+{
+    int ret;
+
+    ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING,
+                                    &file_to_pcie_kfunc_set);
+    if (!ret)
+        ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_STRUCT_OPS,
+                                        &file_to_pcie_kfunc_set);
+    if (!ret)
+        ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_SYSCALL,
+                                        &file_to_pcie_kfunc_set);
+    return ret;
+}
+#else
+static int file_to_pcie_bpf_init(void)
+{
+    return 0;
+}
+#endif /* FILE_TO_PCIE_BPF */
+
 /*
  * Module initialization
  */
@@ -432,9 +5403,16 @@ static int __init file_to_pcie_init(void)
 {
     dev_t dev = 0;
 
+    /* Set up the topology cache before any query can run */
+    if (topo_cache_init() < 0) {
+        pr_err("Failed to set up topology cache\n");
+        return -1;
+    }
+
     /* Allocate major number */
     if (alloc_chrdev_region(&dev, 0, 1, DEVICE_NAME) < 0) {
         pr_err("Failed to allocate chrdev region\n");
+        topo_cache_exit();
         return -1;
     }
     major_number = MAJOR(dev);
@@ -444,6 +5422,7 @@ static int __init file_to_pcie_init(void)
     if (cdev_add(&file_to_pcie_cdev, dev, 1) < 0) {
         pr_err("Failed to add cdev\n");
         unregister_chrdev_region(dev, 1);
+        topo_cache_exit();
         return -1;
     }
 
@@ -458,6 +5437,7 @@ static int __init file_to_pcie_init(void)
         pr_err("Failed to create device class\n");
         cdev_del(&file_to_pcie_cdev);
         unregister_chrdev_region(dev, 1);
+        topo_cache_exit();
         return -1;
     }
 
@@ -469,9 +5449,16 @@ static int __init file_to_pcie_init(void)
         class_destroy(file_to_pcie_class);
         cdev_del(&file_to_pcie_cdev);
         unregister_chrdev_region(dev, 1);
+        topo_cache_exit();
         return -1;
     }
 
+    stats_debugfs_init();
+
+    /* Not fatal: the ioctl interface works without BPF */
+    if (file_to_pcie_bpf_init() < 0)
+        pr_warn("Failed to register BPF kfuncs\n");
+
     pr_info("file_to_pcie module loaded (major %d)\n", major_number);
     return 0;
 }
@@ -483,10 +5470,12 @@ static void __exit file_to_pcie_exit(void)
 {
     dev_t dev = MKDEV(major_number, 0);
 
+    debugfs_remove_recursive(debugfs_dir);
     device_destroy(file_to_pcie_class, dev);
     class_destroy(file_to_pcie_class);
     cdev_del(&file_to_pcie_cdev);
     unregister_chrdev_region(dev, 1);
+    topo_cache_exit();
 
     pr_info("file_to_pcie module unloaded\n");
 }
@@ -0,0 +1,152 @@
+/*
+ * file_to_pcie_trace.h - Tracepoints for the file_to_pcie kernel module
+ *
+ * One event per stage of a query, each with the time it took:
+ *
+ *   file_to_pcie_get_file       fd lookup
+ *   file_to_pcie_get_bdev       file or inode to block device
+ *   file_to_pcie_sector_range   file range to sector range
+ *   file_to_pcie_build_topology PCIe walk up from the block device,
+ *                               on a topology cache miss
+ *   file_to_pcie_map            sector range onto the PCIe devices
+ *   file_to_pcie_request        whole ioctl or io_uring command
+ *
+ * Elapsed times are only measured while the event is enabled, and
+ * are 0 for an event enabled in the middle of its stage.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM file_to_pcie
+
+#if !defined(_FILE_TO_PCIE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FILE_TO_PCIE_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/kdev_t.h>
+
+TRACE_EVENT(file_to_pcie_get_file,
+    TP_PROTO(int fd, int ret, u64 ns),
+    TP_ARGS(fd, ret, ns),
+    TP_STRUCT__entry(
+        __field(int, fd)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->fd = fd;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("fd=%d ret=%d ns=%llu", __entry->fd, __entry->ret,
+              __entry->ns)
+);
+
+TRACE_EVENT(file_to_pcie_get_bdev,
+    TP_PROTO(dev_t dev, int ret, u64 ns),
+    TP_ARGS(dev, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev=%d:%d ret=%d ns=%llu", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(file_to_pcie_sector_range,
+    TP_PROTO(dev_t dev, loff_t offset, u64 length, loff_t sector_start,
+             loff_t sector_end, int ret, u64 ns),
+    TP_ARGS(dev, offset, length, sector_start, sector_end, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(loff_t, offset)
+        __field(u64, length)
+        __field(loff_t, sector_start)
+        __field(loff_t, sector_end)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->offset = offset;
+        __entry->length = length;
+        __entry->sector_start = sector_start;
+        __entry->sector_end = sector_end;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev=%d:%d offset=%lld length=%llu sectors=%lld-%lld "
+              "ret=%d ns=%llu", MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->offset, __entry->length, __entry->sector_start,
+              __entry->sector_end, __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(file_to_pcie_build_topology,
+    TP_PROTO(dev_t dev, int devices, int members, int ret, u64 ns),
+    TP_ARGS(dev, devices, members, ret, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(int, devices)
+        __field(int, members)
+        __field(int, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->devices = devices;
+        __entry->members = members;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev=%d:%d devices=%d members=%d ret=%d ns=%llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->devices,
+              __entry->members, __entry->ret, __entry->ns)
+);
+
+TRACE_EVENT(file_to_pcie_map,
+    TP_PROTO(dev_t dev, u32 devices, u64 ns),
+    TP_ARGS(dev, devices, ns),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u32, devices)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->devices = devices;
+        __entry->ns = ns;
+    ),
+    TP_printk("dev=%d:%d devices=%u ns=%llu", MAJOR(__entry->dev),
+              MINOR(__entry->dev), __entry->devices, __entry->ns)
+);
+
+TRACE_EVENT(file_to_pcie_request,
+    TP_PROTO(unsigned int cmd, long ret, u64 ns),
+    TP_ARGS(cmd, ret, ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(long, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("cmd=%#x ret=%ld ns=%llu", __entry->cmd, __entry->ret,
+              __entry->ns)
+);
+
+#endif /* _FILE_TO_PCIE_TRACE_H */
+
+/* The header lives next to the module, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE file_to_pcie_trace
+#include <trace/define_trace.h>
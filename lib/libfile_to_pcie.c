@@ -0,0 +1,480 @@
+/*
+ * libfile_to_pcie.c - Client library for the file_to_pcie module
+ *
+ * The cache is a direct-mapped table of entry pointers. Readers load
+ * a slot and take a reference on its entry without a lock; writers
+ * swap entries in with an atomic exchange and retire the old ones.
+ * Retired entries are reclaimed with epochs: each reading thread
+ * publishes the global epoch while it looks at a slot, and an entry
+ * retired at epoch E is only released once no thread is still inside
+ * an epoch at or before E. The cache's reference is dropped then, and
+ * the entry is freed when the last view of it is put.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "libfile_to_pcie.h"
+
+#define DEVICE_PATH "/dev/file_to_pcie"
+
+/* Slots in the result cache, a power of two */
+#define CACHE_SLOTS 65536
+
+/* Records asked for on the first try of a miss */
+#define FIRST_RECORDS 8
+
+/*
+ * Lifetime of results that can change without the generation moving:
+ * link speed and width, and NVMe path states, which the module itself
+ * re-reads after a second
+ */
+#define VOLATILE_TTL_NS 1000000000ULL
+
+#define LOOKUP_FLAGS (FILE_TO_PCIE_QUERY_F_LINK | \
+                      FILE_TO_PCIE_QUERY_F_LIMITS | \
+                      FILE_TO_PCIE_QUERY_F_LOAD | \
+                      FILE_TO_PCIE_QUERY_F_ENDPOINT | \
+                      FILE_TO_PCIE_QUERY_F_TOPOLOGY)
+
+struct cache_entry {
+    struct file_to_pcie_view view;  /* First: views point here */
+    atomic_uint ref;
+    /* Key */
+    dev_t dev;
+    ino_t ino;
+    int64_t offset;
+    uint64_t length;
+    uint64_t expires;               /* CLOCK_MONOTONIC ns, 0 for never */
+    /* On the retire list */
+    uint64_t retire_epoch;
+    struct cache_entry *retire_next;
+    struct file_to_pcie_dev_record records[];
+};
+
+/*
+ * Per-thread reclamation state. Records are never freed: a thread
+ * that exits hands its record to the next new thread.
+ */
+struct reader {
+    atomic_uint_fast64_t epoch;     /* 0 while not reading the cache */
+    atomic_int used;
+    struct reader *next;
+};
+
+static int dev_fd = -1;
+static int stop_fd = -1;
+static pthread_t watcher;
+static atomic_uint_fast64_t generation;
+
+static _Atomic(struct cache_entry *) slots[CACHE_SLOTS];
+static atomic_uint_fast64_t global_epoch = 1;
+static _Atomic(struct reader *) readers;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static __thread struct reader *self;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *retired;
+
+static void reader_exit(void *arg)
+{
+    struct reader *r = arg;
+
+    atomic_store(&r->epoch, 0);
+    atomic_store_explicit(&r->used, 0, memory_order_release);
+}
+
+static void reader_key_init(void)
+{
+    pthread_key_create(&reader_key, reader_exit);
+}
+
+static struct reader *get_reader(void)
+{
+    struct reader *r;
+    int unused;
+
+    if (self)
+        return self;
+
+    for (r = atomic_load(&readers); r; r = r->next) {
+        unused = 0;
+        if (atomic_compare_exchange_strong(&r->used, &unused, 1))
+            goto found;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    atomic_init(&r->used, 1);
+    r->next = atomic_load(&readers);
+    while (!atomic_compare_exchange_weak(&readers, &r->next, r))
+        ;
+
+found:
+    pthread_once(&reader_once, reader_key_init);
+    pthread_setspecific(reader_key, r);
+    self = r;
+    return r;
+}
+
+static void put_entry(struct cache_entry *e)
+{
+    if (atomic_fetch_sub_explicit(&e->ref, 1, memory_order_acq_rel) == 1)
+        free(e);
+}
+
+/*
+ * Release the cache's reference on every retired entry no reader can
+ * still be looking at. Called with retire_lock held.
+ */
+static void reclaim(void)
+{
+    struct cache_entry **p = &retired, *e;
+    uint_fast64_t oldest = UINT64_MAX, epoch;
+    struct reader *r;
+
+    for (r = atomic_load(&readers); r; r = r->next) {
+        epoch = atomic_load(&r->epoch);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    while ((e = *p)) {
+        if (e->retire_epoch < oldest) {
+            *p = e->retire_next;
+            put_entry(e);
+        } else {
+            p = &e->retire_next;
+        }
+    }
+}
+
+static void retire(struct cache_entry *e)
+{
+    pthread_mutex_lock(&retire_lock);
+    /* Readers entering from now on can no longer find e */
+    e->retire_epoch = atomic_fetch_add(&global_epoch, 1);
+    e->retire_next = retired;
+    retired = e;
+    reclaim();
+    pthread_mutex_unlock(&retire_lock);
+}
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+static unsigned int slot_of(const struct file_to_pcie_target *t,
+                            int64_t offset, uint64_t length, uint32_t flags)
+{
+    uint64_t h = 0;
+
+    h = mix(h, t->dev);
+    h = mix(h, t->ino);
+    h = mix(h, offset);
+    h = mix(h, length);
+    h = mix(h, flags);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h & (CACHE_SLOTS - 1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int entry_matches(const struct cache_entry *e,
+                         const struct file_to_pcie_target *t,
+                         int64_t offset, uint64_t length, uint32_t flags,
+                         uint64_t gen)
+{
+    if (e->ino != t->ino || e->dev != t->dev || e->offset != offset ||
+        e->length != length || e->view.flags != flags ||
+        e->view.generation != gen)
+        return 0;
+    return !e->expires || now_ns() < e->expires;
+}
+
+/*
+ * Whether the entry holds anything the generation does not cover: link
+ * state from FILE_TO_PCIE_QUERY_F_LINK, or an NVMe path state
+ */
+static int entry_volatile(const struct cache_entry *e)
+{
+    uint32_t i;
+
+    if (e->view.flags & FILE_TO_PCIE_QUERY_F_LINK)
+        return 1;
+    for (i = 0; i < e->view.count; i++) {
+        if (e->records[i].path_state)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Ask the module, growing the entry until every record fits
+ */
+static int query_entry(const struct file_to_pcie_target *t, int64_t offset,
+                       uint64_t length, uint32_t flags,
+                       struct cache_entry **entry)
+{
+    struct file_to_pcie_query q;
+    struct cache_entry *e = NULL, *grown;
+    uint32_t capacity = FIRST_RECORDS;
+
+    for (;;) {
+        grown = realloc(e, sizeof(*e) + capacity * sizeof(e->records[0]));
+        if (!grown) {
+            free(e);
+            return -ENOMEM;
+        }
+        e = grown;
+
+        memset(&q, 0, sizeof(q));
+        q.fd = t->fd;
+        q.flags = flags;
+        q.offset = offset;
+        q.length = length;
+        q.records = (uintptr_t)e->records;
+        q.record_size = sizeof(e->records[0]);
+        q.record_capacity = capacity;
+        if (ioctl(dev_fd, FILE_TO_PCIE_IOCTL_QUERY, &q) < 0) {
+            free(e);
+            return -errno;
+        }
+        if (q.record_count == q.records_needed)
+            break;
+        capacity = q.records_needed;
+    }
+
+    e->view.records = e->records;
+    e->view.count = q.record_count;
+    e->view.flags = flags;
+    e->view.generation = q.generation;
+    e->dev = t->dev;
+    e->ino = t->ino;
+    e->offset = offset;
+    e->length = length;
+    e->expires = entry_volatile(e) ? now_ns() + VOLATILE_TTL_NS : 0;
+    *entry = e;
+    return 0;
+}
+
+int file_to_pcie_lookup(const struct file_to_pcie_target *t,
+                        int64_t offset, uint64_t length, uint32_t flags,
+                        const struct file_to_pcie_view **view)
+{
+    _Atomic(struct cache_entry *) *slot;
+    struct cache_entry *e, *old;
+    struct reader *r;
+    uint64_t gen;
+    int ret;
+
+    if (dev_fd < 0)
+        return -EBADF;
+    if ((flags & ~LOOKUP_FLAGS) || offset < 0 || !length)
+        return -EINVAL;
+
+    slot = &slots[slot_of(t, offset, length, flags)];
+    gen = atomic_load_explicit(&generation, memory_order_acquire);
+
+    if (!(flags & FILE_TO_PCIE_QUERY_F_LOAD)) {
+        r = get_reader();
+        if (!r)
+            return -ENOMEM;
+
+        /* A full barrier: the epoch must be visible before the load */
+        atomic_exchange(&r->epoch, atomic_load(&global_epoch));
+        e = atomic_load(slot);
+        if (e && entry_matches(e, t, offset, length, flags, gen)) {
+            atomic_fetch_add_explicit(&e->ref, 1, memory_order_relaxed);
+            atomic_store_explicit(&r->epoch, 0, memory_order_release);
+            *view = &e->view;
+            return 0;
+        }
+        atomic_store_explicit(&r->epoch, 0, memory_order_release);
+    }
+
+    ret = query_entry(t, offset, length, flags, &e);
+    if (ret < 0)
+        return ret;
+
+    if (flags & FILE_TO_PCIE_QUERY_F_LOAD) {
+        atomic_init(&e->ref, 1);
+    } else {
+        /* One reference for the caller, one for the cache */
+        atomic_init(&e->ref, 2);
+        old = atomic_exchange(slot, e);
+        if (old)
+            retire(old);
+    }
+
+    *view = &e->view;
+    return 0;
+}
+
+void file_to_pcie_view_put(const struct file_to_pcie_view *view)
+{
+    if (view)
+        put_entry((struct cache_entry *)view);
+}
+
+void file_to_pcie_invalidate(void)
+{
+    struct cache_entry *e;
+    unsigned int i;
+
+    for (i = 0; i < CACHE_SLOTS; i++) {
+        if (!atomic_load_explicit(&slots[i], memory_order_relaxed))
+            continue;
+        e = atomic_exchange(&slots[i], NULL);
+        if (e)
+            retire(e);
+    }
+}
+
+int file_to_pcie_target_init(struct file_to_pcie_target *t, int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return -errno;
+    t->fd = fd;
+    t->dev = st.st_dev;
+    t->ino = st.st_ino;
+    return 0;
+}
+
+int file_to_pcie_device_fd(void)
+{
+    return dev_fd;
+}
+
+uint64_t file_to_pcie_generation(void)
+{
+    return atomic_load_explicit(&generation, memory_order_acquire);
+}
+
+static int read_generation(void)
+{
+    uint64_t gen;
+
+    if (read(dev_fd, &gen, sizeof(gen)) != sizeof(gen))
+        return -errno;
+    if (gen != atomic_load(&generation)) {
+        atomic_store_explicit(&generation, gen, memory_order_release);
+        file_to_pcie_invalidate();
+    }
+    return 0;
+}
+
+/*
+ * Wait for the topology generation to move on, and drop the cache
+ * when it does. Entries built at the old generation would already
+ * miss, since the generation is part of the key: dropping them frees
+ * their memory and slots.
+ */
+static void *watch_generation(void *arg)
+{
+    struct pollfd pfd[2];
+
+    (void)arg;
+    pfd[0].fd = dev_fd;
+    pfd[0].events = POLLPRI;
+    pfd[1].fd = stop_fd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents)
+            break;
+        if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+            break;
+        if (pfd[0].revents && read_generation() < 0)
+            break;
+    }
+    return NULL;
+}
+
+int file_to_pcie_init(void)
+{
+    int ret;
+
+    if (dev_fd >= 0)
+        return -EBUSY;
+
+    dev_fd = open(DEVICE_PATH, O_RDWR | O_CLOEXEC);
+    if (dev_fd < 0)
+        return -errno;
+
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (stop_fd < 0) {
+        ret = -errno;
+        goto out_dev;
+    }
+
+    ret = read_generation();
+    if (ret < 0)
+        goto out_stop;
+    ret = -pthread_create(&watcher, NULL, watch_generation, NULL);
+    if (ret < 0)
+        goto out_stop;
+    return 0;
+
+out_stop:
+    close(stop_fd);
+    stop_fd = -1;
+out_dev:
+    close(dev_fd);
+    dev_fd = -1;
+    return ret;
+}
+
+void file_to_pcie_fini(void)
+{
+    uint64_t one = 1;
+
+    if (dev_fd < 0)
+        return;
+
+    if (write(stop_fd, &one, sizeof(one)) != sizeof(one))
+        pthread_cancel(watcher);
+    pthread_join(watcher, NULL);
+
+    file_to_pcie_invalidate();
+    pthread_mutex_lock(&retire_lock);
+    reclaim();
+    pthread_mutex_unlock(&retire_lock);
+
+    close(stop_fd);
+    stop_fd = -1;
+    close(dev_fd);
+    dev_fd = -1;
+    atomic_store(&generation, 0);
+}
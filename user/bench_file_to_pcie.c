@@ -0,0 +1,678 @@
+/*
+ * bench_file_to_pcie.c - Latency and throughput benchmark for the
+ * file_to_pcie ioctl path
+ *
+ * Hammers /dev/file_to_pcie from a configurable number of threads,
+ * for every combination of target path, request type, segment size
+ * and thread count given, and reports per-call latency percentiles,
+ * queries per second and per-thread scaling efficiency as CSV or
+ * JSON Lines, one result per combination.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include "file_to_pcie.h"
+
+#define DEVICE_PATH "/dev/file_to_pcie"
+#define MODULE_VERSION_PATH "/sys/module/file_to_pcie/version"
+#define MAX_RECORDS 64
+#define MAX_BATCH 1024
+#define MAX_LIST 32
+#define WARMUP_CALLS 100
+
+enum bench_mode {
+    MODE_LEGACY,                /* FILE_TO_PCIE_IOCTL_GET_PCIE */
+    MODE_QUERY,                 /* FILE_TO_PCIE_IOCTL_QUERY */
+    MODE_BATCH,                 /* FILE_TO_PCIE_IOCTL_QUERY_BATCH */
+};
+
+static const char *const mode_names[] = {
+    [MODE_LEGACY] = "legacy",
+    [MODE_QUERY] = "query",
+    [MODE_BATCH] = "batch",
+};
+
+/* One benchmark run: every thread issues the same number of calls */
+struct bench_config {
+    int dev_fd;
+    const char *path;
+    uint64_t target_size;       /* Bytes in the file or block device */
+    enum bench_mode mode;
+    uint64_t segment_size;
+    uint32_t batch;             /* Segments per call in MODE_BATCH */
+    uint64_t calls;             /* Per thread */
+    int threads;
+    int pin;                    /* Pin thread i to the i-th allowed CPU */
+    pthread_barrier_t start;
+};
+
+struct bench_thread {
+    pthread_t thread;
+    struct bench_config *cfg;
+    int index;
+    uint64_t *lat_ns;           /* One sample per call */
+    uint64_t errors;
+    int first_error;
+    struct timespec begin, end;
+};
+
+struct bench_result {
+    uint64_t calls;
+    uint64_t errors;
+    int first_error;
+    double seconds;
+    double qps;                 /* Segments resolved per second */
+    uint64_t mean_ns, p50_ns, p99_ns, p999_ns, max_ns;
+};
+
+static void print_usage(const char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-m modes] [-t threads] [-s sizes] "
+            "[-n calls] [-b batch]\n", prog_name);
+    fprintf(stderr, "       [-p] [-f csv|json] [-o output] <path>...\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -m  Request types, comma separated: legacy, query, "
+            "batch\n");
+    fprintf(stderr, "      (default: legacy,query,batch)\n");
+    fprintf(stderr, "  -t  Thread counts, comma separated (default: "
+            "powers of two\n");
+    fprintf(stderr, "      up to the number of online CPUs)\n");
+    fprintf(stderr, "  -s  Segment sizes, comma separated, with k/m/g "
+            "suffixes\n");
+    fprintf(stderr, "      (default: 4k,1m,1g)\n");
+    fprintf(stderr, "  -n  Calls per thread (default: 100000)\n");
+    fprintf(stderr, "  -b  Segments per batch call (default: 64)\n");
+    fprintf(stderr, "  -p  Pin each thread to its own CPU\n");
+    fprintf(stderr, "  -f  Output format (default: csv)\n");
+    fprintf(stderr, "  -o  Write results to a file instead of stdout\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Each path is a regular file or a block device. "
+            "Example:\n");
+    fprintf(stderr, "  %s -t 1,8,32 -s 4k /dev/nvme0n1 /mnt/xfs/file "
+            "/mnt/btrfs/file\n", prog_name);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double elapsed(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Per-thread xorshift, so offsets do not serialize on rand() */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Parse a size with an optional k/m/g/t suffix
+ * Returns 0 on a malformed size
+ */
+static uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+
+    switch (*end) {
+    case 't': case 'T':
+        v <<= 10;
+        /* fall through */
+    case 'g': case 'G':
+        v <<= 10;
+        /* fall through */
+    case 'm': case 'M':
+        v <<= 10;
+        /* fall through */
+    case 'k': case 'K':
+        v <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return *end ? 0 : v;
+}
+
+/*
+ * Split a comma-separated list in place
+ * Returns the number of items, or -1 if there are too many
+ */
+static int split_list(char *s, char **items)
+{
+    int n = 0;
+    char *tok, *save;
+
+    for (tok = strtok_r(s, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (n == MAX_LIST)
+            return -1;
+        items[n++] = tok;
+    }
+    return n;
+}
+
+static const char *fs_name(const char *path, const struct stat *st)
+{
+    struct statfs sfs;
+
+    if (S_ISBLK(st->st_mode))
+        return "block";
+    if (statfs(path, &sfs) < 0)
+        return "unknown";
+
+    switch ((unsigned long)sfs.f_type) {
+    case EXT4_SUPER_MAGIC:
+        return "ext4";
+    case XFS_SUPER_MAGIC:
+        return "xfs";
+    case BTRFS_SUPER_MAGIC:
+        return "btrfs";
+    case F2FS_SUPER_MAGIC:
+        return "f2fs";
+    default:
+        return "other";
+    }
+}
+
+static void read_module_version(char *buf, size_t size)
+{
+    FILE *f = fopen(MODULE_VERSION_PATH, "r");
+
+    snprintf(buf, size, "unknown");
+    if (!f)
+        return;
+    if (fgets(buf, size, f))
+        buf[strcspn(buf, "\n")] = '\0';
+    fclose(f);
+}
+
+static int pin_thread(int index)
+{
+    cpu_set_t allowed, one;
+    int cpu, seen = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return -errno;
+
+    /* The index-th allowed CPU, wrapping around if there are fewer */
+    index %= CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || seen++ != index)
+            continue;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        return pthread_setaffinity_np(pthread_self(), sizeof(one), &one) ?
+               -EINVAL : 0;
+    }
+    return -EINVAL;
+}
+
+/* Random segment-aligned offset, clamping the segment to the target */
+static void pick_segment(const struct bench_config *cfg, uint64_t *rng,
+                         int64_t *offset, uint64_t *length)
+{
+    uint64_t slots;
+
+    if (cfg->segment_size >= cfg->target_size) {
+        *offset = 0;
+        *length = cfg->target_size;
+        return;
+    }
+    slots = cfg->target_size / cfg->segment_size;
+    *offset = (next_random(rng) % slots) * cfg->segment_size;
+    *length = cfg->segment_size;
+}
+
+static void *bench_main(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_config *cfg = t->cfg;
+    struct file_to_pcie_request req;
+    struct file_to_pcie_query q;
+    struct file_to_pcie_query_batch qb;
+    struct file_to_pcie_segment *segs = NULL;
+    struct file_to_pcie_query_result *results = NULL;
+    struct file_to_pcie_dev_record *recs;
+    uint64_t rng = 0x9e3779b97f4a7c15ULL * (t->index + 1);
+    uint64_t i, n, start, length;
+    uint32_t j;
+    int64_t offset;
+    int fd, ret;
+
+    recs = calloc(MAX_RECORDS * (size_t)cfg->batch, sizeof(*recs));
+    if (cfg->mode == MODE_BATCH) {
+        segs = calloc(cfg->batch, sizeof(*segs));
+        results = calloc(cfg->batch, sizeof(*results));
+    }
+    /* Each thread has its own fd, as independent loaders would */
+    fd = open(cfg->path, O_RDONLY);
+    if (fd < 0 || !recs || (cfg->mode == MODE_BATCH && (!segs || !results))) {
+        t->first_error = fd < 0 ? errno : ENOMEM;
+        t->errors = cfg->calls;
+        pthread_barrier_wait(&cfg->start);
+        goto out;
+    }
+    if (cfg->pin)
+        pin_thread(t->index);
+
+    pthread_barrier_wait(&cfg->start);
+    clock_gettime(CLOCK_MONOTONIC, &t->begin);
+
+    for (n = 0; n < WARMUP_CALLS + cfg->calls; n++) {
+        switch (cfg->mode) {
+        case MODE_LEGACY:
+            memset(&req, 0, sizeof(req));
+            req.fd = fd;
+            pick_segment(cfg, &rng, &offset, &length);
+            req.offset = offset;
+            req.length = length;
+            start = now_ns();
+            ret = ioctl(cfg->dev_fd, FILE_TO_PCIE_IOCTL_GET_PCIE, &req);
+            break;
+        case MODE_QUERY:
+            memset(&q, 0, sizeof(q));
+            q.fd = fd;
+            pick_segment(cfg, &rng, &offset, &length);
+            q.offset = offset;
+            q.length = length;
+            q.records = (uintptr_t)recs;
+            q.record_size = sizeof(*recs);
+            q.record_capacity = MAX_RECORDS;
+            start = now_ns();
+            ret = ioctl(cfg->dev_fd, FILE_TO_PCIE_IOCTL_QUERY, &q);
+            break;
+        default:
+            for (j = 0; j < cfg->batch; j++) {
+                segs[j].fd = fd;
+                pick_segment(cfg, &rng, &offset, &length);
+                segs[j].offset = offset;
+                segs[j].length = length;
+            }
+            memset(&qb, 0, sizeof(qb));
+            qb.segments = (uintptr_t)segs;
+            qb.results = (uintptr_t)results;
+            qb.records = (uintptr_t)recs;
+            qb.count = cfg->batch;
+            qb.record_size = sizeof(*recs);
+            qb.record_capacity = MAX_RECORDS * cfg->batch;
+            start = now_ns();
+            ret = ioctl(cfg->dev_fd, FILE_TO_PCIE_IOCTL_QUERY_BATCH, &qb);
+            break;
+        }
+
+        if (n < WARMUP_CALLS) {
+            /* Untimed: fills the module's topology cache */
+            if (n == WARMUP_CALLS - 1)
+                clock_gettime(CLOCK_MONOTONIC, &t->begin);
+            continue;
+        }
+        i = n - WARMUP_CALLS;
+        t->lat_ns[i] = now_ns() - start;
+        if (ret < 0) {
+            if (!t->errors++)
+                t->first_error = errno;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t->end);
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(recs);
+    free(segs);
+    free(results);
+    return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, uint64_t n, double p)
+{
+    uint64_t i = (uint64_t)(p * (n - 1) + 0.5);
+
+    return sorted[i < n ? i : n - 1];
+}
+
+/*
+ * Run one configuration
+ * Returns 0 on success, negative error code if it could not run
+ */
+static int run_bench(struct bench_config *cfg, struct bench_result *res)
+{
+    struct bench_thread *threads;
+    uint64_t *lat, total = cfg->calls * cfg->threads, sum = 0, i;
+    double seconds = 0;
+    int started;
+
+    memset(res, 0, sizeof(*res));
+    threads = calloc(cfg->threads, sizeof(*threads));
+    lat = calloc(total, sizeof(*lat));
+    if (!threads || !lat) {
+        free(threads);
+        free(lat);
+        return -ENOMEM;
+    }
+    pthread_barrier_init(&cfg->start, NULL, cfg->threads);
+
+    for (started = 0; started < cfg->threads; started++) {
+        threads[started].cfg = cfg;
+        threads[started].index = started;
+        threads[started].lat_ns = lat + started * cfg->calls;
+        if (pthread_create(&threads[started].thread, NULL, bench_main,
+                           &threads[started])) {
+            /* The barrier would never release: give up on the whole run */
+            fprintf(stderr, "Error: failed to start %d threads\n",
+                    cfg->threads);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (started = 0; started < cfg->threads; started++)
+        pthread_join(threads[started].thread, NULL);
+
+    for (started = 0; started < cfg->threads; started++) {
+        struct bench_thread *t = &threads[started];
+
+        if (t->errors && !res->errors)
+            res->first_error = t->first_error;
+        res->errors += t->errors;
+        /* Threads start together, so the slowest one sets the pace */
+        if (elapsed(&t->begin, &t->end) > seconds)
+            seconds = elapsed(&t->begin, &t->end);
+    }
+
+    qsort(lat, total, sizeof(*lat), u64_cmp);
+    for (i = 0; i < total; i++)
+        sum += lat[i];
+
+    res->calls = total;
+    res->seconds = seconds;
+    if (seconds > 0)
+        res->qps = total * (cfg->mode == MODE_BATCH ? cfg->batch : 1) /
+                   seconds;
+    res->mean_ns = sum / total;
+    res->p50_ns = percentile(lat, total, 0.5);
+    res->p99_ns = percentile(lat, total, 0.99);
+    res->p999_ns = percentile(lat, total, 0.999);
+    res->max_ns = lat[total - 1];
+
+    pthread_barrier_destroy(&cfg->start);
+    free(threads);
+    free(lat);
+    return 0;
+}
+
+static void print_header(FILE *out, int json)
+{
+    if (json)
+        return;
+    fprintf(out, "module_version,path,fs,mode,segment_size,batch,threads,"
+            "calls,errors,seconds,qps,mean_ns,p50_ns,p99_ns,p999_ns,"
+            "max_ns,efficiency\n");
+}
+
+static void print_result(FILE *out, int json, const char *version,
+                         const struct bench_config *cfg, const char *fs,
+                         const struct bench_result *res, double efficiency)
+{
+    if (json) {
+        fprintf(out, "{\"module_version\": \"%s\", \"path\": \"%s\", "
+                "\"fs\": \"%s\", \"mode\": \"%s\", \"segment_size\": %llu, "
+                "\"batch\": %u, \"threads\": %d, \"calls\": %llu, "
+                "\"errors\": %llu, \"seconds\": %.6f, \"qps\": %.1f, "
+                "\"mean_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+                "\"p999_ns\": %llu, \"max_ns\": %llu, "
+                "\"efficiency\": %.3f}\n",
+                version, cfg->path, fs, mode_names[cfg->mode],
+                (unsigned long long)cfg->segment_size, cfg->batch,
+                cfg->threads, (unsigned long long)res->calls,
+                (unsigned long long)res->errors, res->seconds, res->qps,
+                (unsigned long long)res->mean_ns,
+                (unsigned long long)res->p50_ns,
+                (unsigned long long)res->p99_ns,
+                (unsigned long long)res->p999_ns,
+                (unsigned long long)res->max_ns, efficiency);
+        return;
+    }
+    fprintf(out, "%s,%s,%s,%s,%llu,%u,%d,%llu,%llu,%.6f,%.1f,%llu,%llu,"
+            "%llu,%llu,%llu,%.3f\n",
+            version, cfg->path, fs, mode_names[cfg->mode],
+            (unsigned long long)cfg->segment_size, cfg->batch, cfg->threads,
+            (unsigned long long)res->calls, (unsigned long long)res->errors,
+            res->seconds, res->qps, (unsigned long long)res->mean_ns,
+            (unsigned long long)res->p50_ns, (unsigned long long)res->p99_ns,
+            (unsigned long long)res->p999_ns,
+            (unsigned long long)res->max_ns, efficiency);
+}
+
+/*
+ * Target size, from the block device or the file
+ * Returns 0 on success, negative error code on failure
+ */
+static int target_size(const char *path, const struct stat *st,
+                       uint64_t *size)
+{
+    int fd, ret = 0;
+
+    if (!S_ISBLK(st->st_mode)) {
+        *size = st->st_size;
+        return *size ? 0 : -EINVAL;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+    if (ioctl(fd, BLKGETSIZE64, size) < 0)
+        ret = -errno;
+    close(fd);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char default_modes[] = "legacy,query,batch";
+    char default_sizes[] = "4k,1m,1g";
+    char *mode_list[MAX_LIST], *size_list[MAX_LIST];
+    char *thread_list[MAX_LIST];
+    char *modes_arg = default_modes, *sizes_arg = default_sizes;
+    char *threads_arg = NULL;
+    int thread_counts[MAX_LIST];
+    enum bench_mode modes[MAX_LIST];
+    uint64_t sizes[MAX_LIST];
+    int nr_modes, nr_sizes, nr_threads = 0;
+    struct bench_config cfg;
+    struct bench_result res;
+    struct stat st;
+    char version[64];
+    const char *output = NULL, *fs;
+    FILE *out = stdout;
+    double base_qps;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int json = 0, failed = 0;
+    int i, m, s, t, opt, ret;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.batch = 64;
+    cfg.calls = 100000;
+
+    while ((opt = getopt(argc, argv, "m:t:s:n:b:pf:o:")) != -1) {
+        switch (opt) {
+        case 'm':
+            modes_arg = optarg;
+            break;
+        case 't':
+            threads_arg = optarg;
+            break;
+        case 's':
+            sizes_arg = optarg;
+            break;
+        case 'n':
+            cfg.calls = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            cfg.batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            cfg.pin = 1;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "json")) {
+                json = 1;
+            } else if (strcmp(optarg, "csv")) {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    nr_modes = split_list(modes_arg, mode_list);
+    nr_sizes = split_list(sizes_arg, size_list);
+    if (threads_arg)
+        nr_threads = split_list(threads_arg, thread_list);
+    if (optind >= argc || nr_modes <= 0 || nr_sizes <= 0 ||
+        nr_threads < 0 || !cfg.calls || !cfg.batch ||
+        cfg.batch > MAX_BATCH) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (m = 0; m < nr_modes; m++) {
+        for (i = 0; i <= MODE_BATCH; i++) {
+            if (!strcmp(mode_list[m], mode_names[i]))
+                break;
+        }
+        if (i > MODE_BATCH) {
+            fprintf(stderr, "Error: unknown mode %s\n", mode_list[m]);
+            return EXIT_FAILURE;
+        }
+        modes[m] = i;
+    }
+    for (s = 0; s < nr_sizes; s++) {
+        sizes[s] = parse_size(size_list[s]);
+        if (!sizes[s]) {
+            fprintf(stderr, "Error: invalid size %s\n", size_list[s]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (threads_arg) {
+        for (t = 0; t < nr_threads; t++) {
+            thread_counts[t] = atoi(thread_list[t]);
+            if (thread_counts[t] < 1) {
+                fprintf(stderr, "Error: invalid thread count %s\n",
+                        thread_list[t]);
+                return EXIT_FAILURE;
+            }
+        }
+    } else {
+        for (t = 1; t < cpus && nr_threads < MAX_LIST - 1; t *= 2)
+            thread_counts[nr_threads++] = t;
+        thread_counts[nr_threads++] = cpus;
+    }
+
+    cfg.dev_fd = open(DEVICE_PATH, O_RDWR);
+    if (cfg.dev_fd < 0) {
+        perror("Failed to open device");
+        fprintf(stderr, "Make sure the kernel module is loaded\n");
+        return EXIT_FAILURE;
+    }
+    read_module_version(version, sizeof(version));
+
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror("Failed to open output");
+            close(cfg.dev_fd);
+            return EXIT_FAILURE;
+        }
+    }
+    print_header(out, json);
+
+    for (i = optind; i < argc; i++) {
+        cfg.path = argv[i];
+        ret = stat(cfg.path, &st) < 0 ? -errno :
+              target_size(cfg.path, &st, &cfg.target_size);
+        if (ret < 0) {
+            fprintf(stderr, "Error: %s: %s\n", cfg.path, strerror(-ret));
+            failed = 1;
+            continue;
+        }
+        fs = fs_name(cfg.path, &st);
+
+        for (m = 0; m < nr_modes; m++) {
+            cfg.mode = modes[m];
+            for (s = 0; s < nr_sizes; s++) {
+                cfg.segment_size = sizes[s];
+                base_qps = 0;
+                for (t = 0; t < nr_threads; t++) {
+                    cfg.threads = thread_counts[t];
+                    ret = run_bench(&cfg, &res);
+                    if (ret < 0) {
+                        fprintf(stderr, "Error: %s\n", strerror(-ret));
+                        failed = 1;
+                        continue;
+                    }
+                    if (res.errors) {
+                        fprintf(stderr, "Warning: %s %s: %llu failed "
+                                "calls (%s)\n", cfg.path,
+                                mode_names[cfg.mode],
+                                (unsigned long long)res.errors,
+                                strerror(res.first_error));
+                        failed = 1;
+                    }
+                    /* Per-thread throughput relative to the first count */
+                    if (!t)
+                        base_qps = res.qps / cfg.threads;
+                    print_result(out, json, version, &cfg, fs, &res,
+                                 base_qps > 0 ?
+                                 res.qps / cfg.threads / base_qps : 0);
+                    fflush(out);
+                }
+            }
+        }
+    }
+
+    if (out != stdout && fclose(out)) {
+        perror("Failed to write output");
+        failed = 1;
+    }
+    close(cfg.dev_fd);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
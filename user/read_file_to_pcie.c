@@ -0,0 +1,909 @@
+/*
+ * read_file_to_pcie.c - Device-sharded reader for the file_to_pcie
+ * kernel module
+ *
+ * Reads a file (or block device) at the combined bandwidth of the
+ * drives behind it. The file is cut into blocks and every block is
+ * mapped to the PCIe endpoint holding it with
+ * FILE_TO_PCIE_IOCTL_QUERY_BATCH. Each endpoint then gets its own
+ * shard: a thread pinned to the endpoint's local CPUs, with its own
+ * io_uring and read buffers on the endpoint's NUMA node, reading its
+ * blocks in file order with O_DIRECT. Completed blocks are merged back
+ * into file order and written out, or counted and dropped.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/mempolicy.h>
+#include "file_to_pcie.h"
+#include "uring.h"
+
+#define DEVICE_PATH "/dev/file_to_pcie"
+#define PLAN_SEGMENTS 256       /* Blocks mapped per batch query */
+#define PLAN_RECORDS 16         /* Records per block */
+#define MAX_SHARDS 256
+#define MAX_NUMA_NODES 1024
+#define NO_SLOT -1
+
+/*
+ * A read buffer. Busy from the read being queued until the merge has
+ * written the block out.
+ */
+struct slot {
+    unsigned char *buf;
+    struct iovec iov;
+    uint64_t block;
+    uint32_t want;              /* Bytes of file in the block */
+    uint32_t len;               /* Bytes to read, aligned for O_DIRECT */
+    uint32_t done;              /* Bytes read so far */
+    int busy;
+};
+
+/*
+ * A block of the file. Blocks are block_size long, apart from the last
+ * one and the pieces of blocks split where a stripe's chunks meet.
+ */
+struct block {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t shard;             /* Shard reading it */
+};
+
+struct reader;
+
+/* Blocks held by one PCIe endpoint, or not held by any */
+struct shard {
+    struct reader *r;
+    pthread_t thread;
+    int mapped;                 /* 0 for blocks with no PCIe device */
+    uint32_t domain;
+    uint8_t bus;
+    uint8_t devfn;
+    int numa_node;
+    cpu_set_t cpus;
+    uint64_t *blocks;           /* In file order */
+    uint64_t nr_blocks;
+    uint64_t blocks_cap;
+    uint64_t bytes;             /* File bytes in those blocks */
+    struct slot *slots;
+    double seconds;             /* First read queued to last one done */
+    int error;
+};
+
+/* Where a block is once read: slot of its shard, or an error */
+struct block_done {
+    int32_t slot;
+    int32_t status;
+};
+
+struct reader {
+    int fd;
+    int direct;
+    uint64_t offset;
+    uint64_t end;               /* Offset past the last byte read */
+    uint64_t block_size;
+    struct block *blocks;       /* In file order, once planned */
+    uint64_t nr_blocks;
+    uint64_t blocks_cap;
+    uint32_t align;             /* O_DIRECT alignment of all devices */
+    unsigned int depth;         /* Reads in flight per shard */
+    int pin;
+    struct shard shards[MAX_SHARDS];
+    uint32_t nr_shards;
+    struct block_done *done;
+    pthread_mutex_t lock;
+    pthread_cond_t completed;   /* A block was read */
+    pthread_cond_t released;    /* The merge freed a slot */
+    int failed;
+};
+
+static void print_usage(const char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-b block_size] [-q depth] [-o output] "
+            "[-B] [-P] <path> [offset length]\n", prog_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -b  Block size: the unit of reads and of mapping "
+            "(default: 1m)\n");
+    fprintf(stderr, "  -q  Reads in flight per device (default: 16)\n");
+    fprintf(stderr, "  -o  Write the data, in file order, to a file "
+            "(- for stdout)\n");
+    fprintf(stderr, "  -B  Buffered reads instead of O_DIRECT\n");
+    fprintf(stderr, "  -P  Do not pin device threads to local CPUs\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Reads the whole path unless a range is given, and "
+            "reports per-device\n");
+    fprintf(stderr, "throughput as CSV. Example:\n");
+    fprintf(stderr, "  %s -b 4m /mnt/raid0/shard0\n", prog_name);
+}
+
+/*
+ * Parse a size with an optional k/m/g/t suffix
+ * Returns 0 on a malformed size
+ */
+static uint64_t parse_size(const char *s)
+{
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+
+    switch (*end) {
+    case 't': case 'T':
+        v <<= 10;
+        /* fall through */
+    case 'g': case 'G':
+        v <<= 10;
+        /* fall through */
+    case 'm': case 'M':
+        v <<= 10;
+        /* fall through */
+    case 'k': case 'K':
+        v <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return *end ? 0 : v;
+}
+
+static double elapsed(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+static uint32_t get_shard(struct reader *r,
+                          const struct file_to_pcie_dev_record *rec,
+                          const cpu_set_t *mask)
+{
+    struct shard *sh;
+    uint32_t i;
+
+    for (i = 0; i < r->nr_shards; i++) {
+        sh = &r->shards[i];
+        if (rec ? sh->mapped && sh->domain == rec->domain &&
+                  sh->bus == rec->bus && sh->devfn == rec->devfn :
+                  !sh->mapped)
+            return i;
+    }
+    if (r->nr_shards == MAX_SHARDS)
+        return 0;
+
+    sh = &r->shards[r->nr_shards];
+    sh->r = r;
+    sh->numa_node = -1;
+    if (sched_getaffinity(0, sizeof(sh->cpus), &sh->cpus) < 0)
+        CPU_ZERO(&sh->cpus);
+    if (rec) {
+        sh->mapped = 1;
+        sh->domain = rec->domain;
+        sh->bus = rec->bus;
+        sh->devfn = rec->devfn;
+        sh->numa_node = rec->numa_node;
+        if (CPU_COUNT(mask))
+            sh->cpus = *mask;
+    }
+    return r->nr_shards++;
+}
+
+static int add_block(struct shard *sh, uint64_t block)
+{
+    uint64_t *v;
+
+    if (sh->nr_blocks == sh->blocks_cap) {
+        sh->blocks_cap = sh->blocks_cap ? 2 * sh->blocks_cap : 64;
+        v = realloc(sh->blocks, sh->blocks_cap * sizeof(*v));
+        if (!v)
+            return -ENOMEM;
+        sh->blocks = v;
+    }
+    sh->blocks[sh->nr_blocks++] = block;
+    return 0;
+}
+
+static int push_block(struct block **v, uint64_t *nr, uint64_t *cap,
+                      uint64_t offset, uint32_t len, uint32_t shard)
+{
+    struct block *p;
+
+    if (*nr == *cap) {
+        *cap = *cap ? 2 * *cap : 1024;
+        p = realloc(*v, *cap * sizeof(*p));
+        if (!p)
+            return -ENOMEM;
+        *v = p;
+    }
+    (*v)[*nr].offset = offset;
+    (*v)[*nr].len = len;
+    (*v)[(*nr)++].shard = shard;
+    return 0;
+}
+
+/*
+ * Records a block may be read through: endpoints only, and of NVMe
+ * multipath paths only the ones I/O currently goes down
+ */
+static int usable_record(const struct file_to_pcie_dev_record *rec)
+{
+    return rec->depth == 0 &&
+           (!rec->path_state ||
+            (rec->path_flags & FILE_TO_PCIE_PATH_F_CURRENT));
+}
+
+static void note_alignment(struct reader *r,
+                           const struct file_to_pcie_dev_record *recs,
+                           uint32_t count)
+{
+    uint32_t align, i;
+
+    for (i = 0; i < count; i++) {
+        if (!usable_record(&recs[i]))
+            continue;
+        align = recs[i].logical_block_size > recs[i].dma_alignment ?
+                recs[i].logical_block_size : recs[i].dma_alignment;
+        if (align > r->align)
+            r->align = align;
+    }
+}
+
+/*
+ * Where to split [start, end) if its endpoints hold different parts
+ * of it, as a stripe's members do once it crosses a chunk boundary:
+ * at the first range boundary inside it. Each piece is mapped again,
+ * until every piece lies in one chunk. Mirror copies, the paths of a
+ * namespace and members holding unknown shares all report the whole
+ * block, so those are never split.
+ * Returns the offset to split at, or 0 to keep the block whole
+ */
+static uint64_t split_offset(const struct reader *r, uint64_t start,
+                             uint64_t end,
+                             const struct file_to_pcie_dev_record *recs,
+                             uint32_t count)
+{
+    uint64_t split = end, b;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!usable_record(&recs[i]))
+            continue;
+        b = recs[i].file_offset_start;
+        if (b > start && b < split)
+            split = b;
+        b = recs[i].file_offset_end + 1;
+        if (b > start && b < split)
+            split = b;
+    }
+    /* A boundary O_DIRECT cannot read from is left inside the block */
+    return split < end && !(split % r->align) ? split : 0;
+}
+
+/*
+ * Pick the shard for a block: the only endpoint holding it for a
+ * plain drive or a block within one chunk of a stripe, the least
+ * loaded so far for a mirror
+ */
+static uint32_t pick_shard(struct reader *r, uint64_t bytes,
+                           const struct file_to_pcie_dev_record *recs,
+                           const cpu_set_t *masks, uint32_t count)
+{
+    uint32_t best = UINT32_MAX, i, s;
+
+    for (i = 0; i < count; i++) {
+        if (!usable_record(&recs[i]))
+            continue;
+        s = get_shard(r, &recs[i], &masks[i]);
+        if (best == UINT32_MAX || r->shards[s].bytes < r->shards[best].bytes)
+            best = s;
+    }
+    if (best == UINT32_MAX)
+        best = get_shard(r, NULL, NULL);
+
+    r->shards[best].bytes += bytes;
+    return best;
+}
+
+static int block_cmp(const void *a, const void *b)
+{
+    const struct block *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static uint64_t block_offset(const struct reader *r, uint64_t block)
+{
+    return r->blocks[block].offset;
+}
+
+static uint32_t block_bytes(const struct reader *r, uint64_t block)
+{
+    return r->blocks[block].len;
+}
+
+/*
+ * Cut the range into blocks and map every block to its shard,
+ * PLAN_SEGMENTS blocks per query, then put the blocks in file order
+ * Returns 0 on success, negative error code on failure
+ */
+static int plan_blocks(struct reader *r, int dev_fd)
+{
+    struct file_to_pcie_segment *segs;
+    struct file_to_pcie_query_result *res;
+    struct file_to_pcie_dev_record *recs;
+    struct file_to_pcie_query_batch qb;
+    struct block *todo = NULL;  /* Pieces of split blocks */
+    uint64_t nr_todo = 0, todo_cap = 0;
+    uint64_t cursor = r->offset, start, end, split, b;
+    const struct file_to_pcie_dev_record *rr;
+    cpu_set_t *masks;
+    uint32_t i, n;
+    int ret = -ENOMEM;
+
+    segs = calloc(PLAN_SEGMENTS, sizeof(*segs));
+    res = calloc(PLAN_SEGMENTS, sizeof(*res));
+    recs = calloc(PLAN_SEGMENTS * PLAN_RECORDS, sizeof(*recs));
+    masks = calloc(PLAN_SEGMENTS * PLAN_RECORDS, sizeof(*masks));
+    if (!segs || !res || !recs || !masks)
+        goto out;
+
+    for (;;) {
+        for (n = 0; n < PLAN_SEGMENTS && (nr_todo || cursor < r->end);
+             n++) {
+            segs[n].fd = r->fd;
+            if (nr_todo) {
+                nr_todo--;
+                segs[n].offset = todo[nr_todo].offset;
+                segs[n].length = todo[nr_todo].len;
+            } else {
+                segs[n].offset = cursor;
+                segs[n].length = r->end - cursor < r->block_size ?
+                                 r->end - cursor : r->block_size;
+                cursor += segs[n].length;
+            }
+        }
+        if (!n)
+            break;
+
+        memset(&qb, 0, sizeof(qb));
+        qb.segments = (uintptr_t)segs;
+        qb.results = (uintptr_t)res;
+        qb.records = (uintptr_t)recs;
+        qb.count = n;
+        qb.record_size = sizeof(*recs);
+        qb.record_capacity = PLAN_SEGMENTS * PLAN_RECORDS;
+        qb.flags = FILE_TO_PCIE_QUERY_F_LIMITS | FILE_TO_PCIE_QUERY_F_ENDPOINT;
+        qb.cpumasks = (uintptr_t)masks;
+        qb.cpumask_size = sizeof(*masks);
+        if (ioctl(dev_fd, FILE_TO_PCIE_IOCTL_QUERY_BATCH, &qb) < 0) {
+            ret = -errno;
+            goto out;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (res[i].status < 0) {
+                ret = res[i].status;
+                goto out;
+            }
+            rr = recs + res[i].record_index;
+            note_alignment(r, rr, res[i].record_count);
+
+            start = segs[i].offset;
+            end = start + segs[i].length;
+            split = split_offset(r, start, end, rr, res[i].record_count);
+            if (split) {
+                ret = push_block(&todo, &nr_todo, &todo_cap, start,
+                                 split - start, 0);
+                if (!ret)
+                    ret = push_block(&todo, &nr_todo, &todo_cap, split,
+                                     end - split, 0);
+            } else {
+                ret = push_block(&r->blocks, &r->nr_blocks, &r->blocks_cap,
+                                 start, segs[i].length,
+                                 pick_shard(r, segs[i].length, rr,
+                                            masks + res[i].record_index,
+                                            res[i].record_count));
+            }
+            if (ret < 0)
+                goto out;
+        }
+    }
+
+    /* Split pieces were mapped out of order */
+    qsort(r->blocks, r->nr_blocks, sizeof(*r->blocks), block_cmp);
+    for (b = 0; b < r->nr_blocks; b++) {
+        ret = add_block(&r->shards[r->blocks[b].shard], b);
+        if (ret < 0)
+            goto out;
+    }
+    ret = 0;
+
+out:
+    free(todo);
+    free(masks);
+    free(recs);
+    free(res);
+    free(segs);
+    return ret;
+}
+
+/*
+ * Allocate a shard's buffers on its endpoint's node, falling back to
+ * the node of the CPU touching them first: the shard's own, once it
+ * is pinned
+ */
+static int alloc_slots(struct shard *sh)
+{
+    struct reader *r = sh->r;
+    unsigned long nodes[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    size_t size = r->depth * r->block_size;
+    unsigned char *mem;
+    unsigned int i;
+
+    sh->slots = calloc(r->depth, sizeof(*sh->slots));
+    if (!sh->slots)
+        return -ENOMEM;
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return -ENOMEM;
+
+    if (sh->numa_node >= 0 && sh->numa_node < MAX_NUMA_NODES) {
+        memset(nodes, 0, sizeof(nodes));
+        nodes[sh->numa_node / (8 * sizeof(unsigned long))] |=
+            1UL << (sh->numa_node % (8 * sizeof(unsigned long)));
+        /* Best effort: MPOL_PREFERRED still works if the node is full */
+        syscall(SYS_mbind, mem, size, MPOL_PREFERRED, nodes,
+                sizeof(nodes) * 8 + 1, 0);
+    }
+    /* Fault the buffers in now rather than on the first reads */
+    memset(mem, 0, size);
+
+    for (i = 0; i < r->depth; i++)
+        sh->slots[i].buf = mem + i * r->block_size;
+    return 0;
+}
+
+static void free_slots(struct shard *sh)
+{
+    if (!sh->slots)
+        return;
+    if (sh->slots[0].buf)
+        munmap(sh->slots[0].buf, sh->r->depth * sh->r->block_size);
+    free(sh->slots);
+    sh->slots = NULL;
+}
+
+static void fail(struct reader *r, int err, struct shard *sh)
+{
+    pthread_mutex_lock(&r->lock);
+    if (sh && !sh->error)
+        sh->error = err;
+    r->failed = 1;
+    pthread_cond_broadcast(&r->completed);
+    pthread_cond_broadcast(&r->released);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int queue_read(struct shard *sh, struct uring *ring, int index)
+{
+    struct slot *slot = &sh->slots[index];
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (!sqe)
+        return -EBUSY;
+
+    slot->iov.iov_base = slot->buf + slot->done;
+    slot->iov.iov_len = slot->len - slot->done;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = sh->r->fd;
+    sqe->off = block_offset(sh->r, slot->block) + slot->done;
+    sqe->addr = (uintptr_t)&slot->iov;
+    sqe->len = 1;
+    sqe->user_data = index;
+    return 0;
+}
+
+/*
+ * Queue reads of the shard's next blocks into its free slots
+ * Returns the number of reads queued
+ */
+static unsigned int queue_blocks(struct shard *sh, struct uring *ring,
+                                 uint64_t *next)
+{
+    struct reader *r = sh->r;
+    struct slot *slot;
+    unsigned int i, n = 0;
+
+    pthread_mutex_lock(&r->lock);
+    for (i = 0; i < r->depth && *next < sh->nr_blocks; i++) {
+        slot = &sh->slots[i];
+        if (slot->busy)
+            continue;
+        slot->busy = 1;
+        slot->block = sh->blocks[(*next)++];
+        slot->want = block_bytes(r, slot->block);
+        slot->len = (slot->want + r->align - 1) / r->align * r->align;
+        slot->done = 0;
+        /* No room in the ring: try again after the next completion */
+        if (queue_read(sh, ring, i) < 0) {
+            slot->busy = 0;
+            (*next)--;
+            break;
+        }
+        n++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+static void complete_block(struct shard *sh, int index, int status)
+{
+    struct reader *r = sh->r;
+    struct slot *slot = &sh->slots[index];
+
+    pthread_mutex_lock(&r->lock);
+    r->done[slot->block].slot = index;
+    r->done[slot->block].status = status;
+    pthread_cond_broadcast(&r->completed);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int has_free_slot(const struct shard *sh)
+{
+    unsigned int i;
+
+    for (i = 0; i < sh->r->depth; i++) {
+        if (!sh->slots[i].busy)
+            return 1;
+    }
+    return 0;
+}
+
+static void *shard_main(void *arg)
+{
+    struct shard *sh = arg;
+    struct reader *r = sh->r;
+    struct io_uring_cqe *cqe;
+    struct timespec begin, end;
+    struct uring ring;
+    struct slot *slot;
+    unsigned int inflight = 0;
+    uint64_t next = 0;
+    int index, res, ret;
+
+    /* Pin before allocating, so first touch lands on the local node */
+    if (r->pin && sh->mapped)
+        pthread_setaffinity_np(pthread_self(), sizeof(sh->cpus), &sh->cpus);
+
+    ret = alloc_slots(sh);
+    if (!ret)
+        ret = uring_init(&ring, r->depth);
+    if (ret < 0) {
+        fail(r, ret, sh);
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (;;) {
+        inflight += queue_blocks(sh, &ring, &next);
+        if (!inflight) {
+            if (next == sh->nr_blocks)
+                break;
+            /* Every slot holds a block the merge has not written yet */
+            pthread_mutex_lock(&r->lock);
+            while (!has_free_slot(sh) && !r->failed)
+                pthread_cond_wait(&r->released, &r->lock);
+            pthread_mutex_unlock(&r->lock);
+            if (r->failed)
+                break;
+            continue;
+        }
+
+        ret = uring_submit_and_wait(&ring, 1);
+        if (ret < 0) {
+            fail(r, ret, sh);
+            break;
+        }
+
+        while ((cqe = uring_peek_cqe(&ring))) {
+            index = cqe->user_data;
+            res = cqe->res;
+            uring_cqe_seen(&ring);
+            inflight--;
+
+            slot = &sh->slots[index];
+            if (res < 0) {
+                complete_block(sh, index, res);
+                continue;
+            }
+            slot->done += res;
+            /* Short read: go on from where it stopped, unless at EOF */
+            if (res > 0 && slot->done < slot->want) {
+                ret = queue_read(sh, &ring, index);
+                if (ret < 0)
+                    complete_block(sh, index, ret);
+                else
+                    inflight++;
+                continue;
+            }
+            if (slot->done < slot->want)
+                slot->want = slot->done;
+            complete_block(sh, index, 0);
+        }
+        if (r->failed && !inflight)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sh->seconds = elapsed(&begin, &end);
+
+    uring_exit(&ring);
+    return NULL;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Hand blocks to the output in file order as the shards complete
+ * them, freeing each slot once its block is written
+ * Returns 0 on success, negative error code on failure
+ */
+static int merge_blocks(struct reader *r, int out_fd)
+{
+    struct shard *sh;
+    struct slot *slot;
+    uint64_t b;
+    int status, ret;
+
+    for (b = 0; b < r->nr_blocks; b++) {
+        pthread_mutex_lock(&r->lock);
+        while (r->done[b].slot == NO_SLOT && !r->failed)
+            pthread_cond_wait(&r->completed, &r->lock);
+        status = r->done[b].slot == NO_SLOT ? -ECANCELED : r->done[b].status;
+        pthread_mutex_unlock(&r->lock);
+
+        sh = &r->shards[r->blocks[b].shard];
+        if (status < 0) {
+            fail(r, status, sh);
+            return status;
+        }
+
+        slot = &sh->slots[r->done[b].slot];
+        if (out_fd >= 0) {
+            ret = write_all(out_fd, slot->buf, slot->want);
+            if (ret < 0) {
+                fail(r, ret, NULL);
+                return ret;
+            }
+        }
+
+        pthread_mutex_lock(&r->lock);
+        slot->busy = 0;
+        pthread_cond_broadcast(&r->released);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return 0;
+}
+
+static void print_report(FILE *out, const struct reader *r, double seconds,
+                         double plan_seconds)
+{
+    const struct shard *sh;
+    uint64_t bytes = 0, blocks = 0;
+    uint32_t i;
+
+    fprintf(out, "device,numa_node,cpus,blocks,bytes,seconds,mb_per_s\n");
+    for (i = 0; i < r->nr_shards; i++) {
+        sh = &r->shards[i];
+        if (sh->mapped)
+            fprintf(out, "%04x:%02x:%02x.%x,", sh->domain, sh->bus,
+                    sh->devfn >> 3, sh->devfn & 7);
+        else
+            fprintf(out, "unmapped,");
+        fprintf(out, "%d,%d,%llu,%llu,%.3f,%.1f\n", sh->numa_node,
+                CPU_COUNT(&sh->cpus), (unsigned long long)sh->nr_blocks,
+                (unsigned long long)sh->bytes, sh->seconds,
+                sh->seconds > 0 ? sh->bytes / sh->seconds / 1e6 : 0.0);
+        bytes += sh->bytes;
+        blocks += sh->nr_blocks;
+    }
+    fprintf(out, "total,-1,-,%llu,%llu,%.3f,%.1f\n",
+            (unsigned long long)blocks, (unsigned long long)bytes, seconds,
+            seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+    fprintf(out, "plan,-1,-,%llu,0,%.3f,0\n", (unsigned long long)blocks,
+            plan_seconds);
+}
+
+static int get_size(int fd, uint64_t *size)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return -errno;
+    if (S_ISBLK(st.st_mode))
+        return ioctl(fd, BLKGETSIZE64, size) < 0 ? -errno : 0;
+    if (!S_ISREG(st.st_mode))
+        return -EINVAL;
+    *size = st.st_size;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static struct reader r;
+    struct timespec t0, t1, t2;
+    const char *output = NULL;
+    FILE *report = stdout;
+    uint64_t size, length = 0;
+    uint64_t b;
+    uint32_t i;
+    int dev_fd, out_fd = -1;
+    int opt, ret, err = 0;
+
+    r.block_size = 1 << 20;
+    r.depth = 16;
+    r.direct = 1;
+    r.pin = 1;
+    r.align = 512;
+
+    while ((opt = getopt(argc, argv, "b:q:o:BP")) != -1) {
+        switch (opt) {
+        case 'b':
+            r.block_size = parse_size(optarg);
+            break;
+        case 'q':
+            r.depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'B':
+            r.direct = 0;
+            break;
+        case 'P':
+            r.pin = 0;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((argc - optind != 1 && argc - optind != 3) || !r.block_size ||
+        r.block_size > UINT32_MAX / 2 || !r.depth || r.depth > 4096) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    r.fd = open(argv[optind], O_RDONLY | (r.direct ? O_DIRECT : 0));
+    if (r.fd < 0) {
+        perror("Failed to open target");
+        return EXIT_FAILURE;
+    }
+    ret = get_size(r.fd, &size);
+    if (ret < 0) {
+        fprintf(stderr, "Error: %s: %s\n", argv[optind], strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    if (argc - optind == 3) {
+        r.offset = parse_size(argv[optind + 1]);
+        length = parse_size(argv[optind + 2]);
+    } else {
+        length = size;
+    }
+    if (r.offset >= size || !length) {
+        fprintf(stderr, "Error: nothing to read\n");
+        return EXIT_FAILURE;
+    }
+    r.end = size - r.offset < length ? size : r.offset + length;
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.completed, NULL);
+    pthread_cond_init(&r.released, NULL);
+
+    dev_fd = open(DEVICE_PATH, O_RDWR);
+    if (dev_fd < 0) {
+        perror("Failed to open device");
+        fprintf(stderr, "Make sure the kernel module is loaded\n");
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret = plan_blocks(&r, dev_fd);
+    close(dev_fd);
+    if (ret < 0) {
+        fprintf(stderr, "Error: mapping %s failed: %s\n", argv[optind],
+                strerror(-ret));
+        return EXIT_FAILURE;
+    }
+
+    r.done = calloc(r.nr_blocks, sizeof(*r.done));
+    if (!r.done) {
+        fprintf(stderr, "Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (b = 0; b < r.nr_blocks; b++)
+        r.done[b].slot = NO_SLOT;
+    if (!r.direct)
+        r.align = 1;
+    if ((r.direct && (r.offset % r.align || r.block_size % r.align)) ||
+        r.align > (uint32_t)sysconf(_SC_PAGESIZE)) {
+        fprintf(stderr, "Error: offset and block size must be multiples "
+                "of %u bytes for O_DIRECT (or use -B)\n", r.align);
+        return EXIT_FAILURE;
+    }
+
+    if (output) {
+        if (!strcmp(output, "-")) {
+            out_fd = STDOUT_FILENO;
+            report = stderr;
+        } else {
+            out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (out_fd < 0) {
+                perror("Failed to open output");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < r.nr_shards; i++) {
+        ret = pthread_create(&r.shards[i].thread, NULL, shard_main,
+                             &r.shards[i]);
+        if (ret) {
+            fail(&r, -ret, NULL);
+            r.nr_shards = i;
+            break;
+        }
+    }
+    ret = merge_blocks(&r, out_fd);
+    for (i = 0; i < r.nr_shards; i++)
+        pthread_join(r.shards[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    for (i = 0; i < r.nr_shards; i++) {
+        if (r.shards[i].error && !err)
+            err = r.shards[i].error;
+        free_slots(&r.shards[i]);
+        free(r.shards[i].blocks);
+    }
+    if (ret < 0 && !err)
+        err = ret;
+    if (out_fd > STDOUT_FILENO && close(out_fd) < 0 && !err)
+        err = -errno;
+    close(r.fd);
+
+    if (err) {
+        fprintf(stderr, "Error: read failed: %s\n", strerror(-err));
+        return EXIT_FAILURE;
+    }
+    print_report(report, &r, elapsed(&t1, &t2), elapsed(&t0, &t1));
+    return EXIT_SUCCESS;
+}
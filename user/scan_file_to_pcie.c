@@ -0,0 +1,1090 @@
+/*
+ * scan_file_to_pcie.c - Parallel dataset placement scanner for the
+ * file_to_pcie kernel module
+ *
+ * Walks one or more directory trees with a pool of worker threads,
+ * maps every regular file through FILE_TO_PCIE_IOCTL_QUERY_DIR (one
+ * ioctl per directory chunk, no file is opened), and reports how many
+ * bytes live behind each PCIe device, NUMA node and root port, as CSV
+ * or JSON. Optionally writes a placement map (see file_to_pcie_map.h)
+ * that loaders can mmap() instead of querying the module themselves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "file_to_pcie.h"
+#include "file_to_pcie_map.h"
+
+#define DEVICE_PATH "/dev/file_to_pcie"
+#define DIR_ENTRIES 1024
+#define DIR_NAMES_SIZE (64 * 1024)
+#define DIR_RECORDS 4096
+#define MAX_THREADS 1024
+
+/*
+ * Bytes and files behind one device or NUMA node. PCI devices are
+ * keyed by domain << 16 | bus << 8 | devfn, NUMA nodes by node.
+ */
+struct place_stat {
+    uint64_t key;
+    int numa_node;
+    uint64_t files;
+    uint64_t bytes;
+};
+
+struct stat_table {
+    struct place_stat *v;
+    size_t count;
+    size_t capacity;
+};
+
+struct scan_totals {
+    uint64_t dirs;
+    uint64_t files;
+    uint64_t bytes;
+    uint64_t unmapped_files;    /* Regular files with no PCIe device */
+    uint64_t unmapped_bytes;
+    uint64_t shared_files;      /* Split over devices in unknown shares */
+    uint64_t shared_bytes;
+    uint64_t errors;
+};
+
+/*
+ * Placement map under construction. Each worker builds its own, and
+ * they are merged into one before it is written out. Devices are
+ * always added after their parent, so parent < child in the table.
+ */
+struct map_builder {
+    struct file_to_pcie_map_device *devices;
+    uint64_t *device_keys;
+    uint64_t nr_devices, devices_cap, keys_cap;
+    struct file_to_pcie_map_file *files;
+    uint64_t nr_files, files_cap;
+    struct file_to_pcie_map_extent *extents;
+    uint64_t nr_extents, extents_cap;
+    char *strings;
+    uint64_t strings_size, strings_cap;
+    uint64_t generation;        /* Oldest one seen, 0 if none */
+};
+
+/* A directory waiting to be scanned */
+struct dir_work {
+    struct dir_work *next;
+    char path[];
+};
+
+struct scanner {
+    int dev_fd;
+    int verbose;
+    int build_map;              /* Collect a placement map */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dir_work *queue;     /* LIFO, so the walk stays depth-first */
+    unsigned long pending;      /* Queued or being scanned */
+    int failed;                 /* Set on an error that stops the scan */
+};
+
+/* Per-thread state, merged once all workers are done */
+struct worker {
+    pthread_t thread;
+    struct scanner *s;
+    struct file_to_pcie_dir_entry *entries;
+    char *names;
+    struct file_to_pcie_dev_record *records;
+    struct file_to_pcie_dev_record *big;    /* For files that overflow */
+    uint32_t big_capacity;
+    struct stat_table devices;
+    struct stat_table nodes;
+    struct stat_table root_ports;
+    struct scan_totals totals;
+    struct map_builder map;
+};
+
+static void print_usage(const char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-f csv|json] [-o output] "
+            "[-m map] [-v] <path>...\n", prog_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -j  Worker threads (default: online CPUs)\n");
+    fprintf(stderr, "  -f  Output format (default: csv)\n");
+    fprintf(stderr, "  -o  Write the report to a file instead of "
+            "stdout\n");
+    fprintf(stderr, "  -m  Also write a placement map for loaders to "
+            "mmap\n");
+    fprintf(stderr, "  -v  Report files that could not be mapped\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Example: %s -j 32 -f json /mnt/data\n", prog_name);
+}
+
+static uint64_t pci_key(uint32_t domain, uint8_t bus, uint8_t devfn)
+{
+    return (uint64_t)domain << 16 | bus << 8 | devfn;
+}
+
+/*
+ * Find or create the entry for key
+ * Returns NULL if out of memory
+ */
+static struct place_stat *stat_get(struct stat_table *t, uint64_t key,
+                                   int numa_node)
+{
+    struct place_stat *v;
+    size_t i;
+
+    /* A handful of devices at most, so a linear scan is fine */
+    for (i = 0; i < t->count; i++) {
+        if (t->v[i].key == key)
+            return &t->v[i];
+    }
+
+    if (t->count == t->capacity) {
+        size_t cap = t->capacity ? t->capacity * 2 : 16;
+
+        v = realloc(t->v, cap * sizeof(*v));
+        if (!v)
+            return NULL;
+        t->v = v;
+        t->capacity = cap;
+    }
+
+    v = &t->v[t->count++];
+    memset(v, 0, sizeof(*v));
+    v->key = key;
+    v->numa_node = numa_node;
+    return v;
+}
+
+static int stat_add(struct stat_table *t, uint64_t key, int numa_node,
+                    uint64_t files, uint64_t bytes)
+{
+    struct place_stat *v = stat_get(t, key, numa_node);
+
+    if (!v)
+        return -ENOMEM;
+    v->files += files;
+    v->bytes += bytes;
+    return 0;
+}
+
+static int stat_merge(struct stat_table *dst, const struct stat_table *src)
+{
+    size_t i;
+
+    for (i = 0; i < src->count; i++) {
+        if (stat_add(dst, src->v[i].key, src->v[i].numa_node,
+                     src->v[i].files, src->v[i].bytes) < 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+static int stat_cmp(const void *a, const void *b)
+{
+    const struct place_stat *x = a, *y = b;
+
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/*
+ * Whether a file's records leave each device's share of it unknown:
+ * several chains, of which some have no sector range. Striped arrays,
+ * multi-device filesystems and device-mapper report every member
+ * with the whole file that way, not knowing which one holds what.
+ */
+static int records_shared(const struct file_to_pcie_dev_record *recs,
+                          uint32_t count)
+{
+    uint32_t i, chains = 0;
+    int unknown = 0;
+
+    for (i = 0; i < count; i++) {
+        if (recs[i].depth)
+            continue;
+        chains++;
+        unknown |= recs[i].sector_start < 0;
+    }
+    return chains > 1 && unknown;
+}
+
+/*
+ * Account the records of one file. Records come as chains, each from
+ * an endpoint (depth 0) up to its root port, with the endpoint's share
+ * of the file in its offset range. A file shared out in unknown
+ * shares counts as a file on every device it is on, but its bytes
+ * only count as shared.
+ */
+static int account_file(struct worker *w,
+                        const struct file_to_pcie_dev_record *recs,
+                        uint32_t count, uint64_t size)
+{
+    const struct file_to_pcie_dev_record *ep, *rp;
+    uint64_t bytes;
+    uint32_t i, top;
+    int shared = records_shared(recs, count);
+
+    w->totals.files++;
+    w->totals.bytes += size;
+    if (!count && size) {
+        w->totals.unmapped_files++;
+        w->totals.unmapped_bytes += size;
+        return 0;
+    }
+    if (shared) {
+        w->totals.shared_files++;
+        w->totals.shared_bytes += size;
+    }
+
+    for (i = 0; i < count; i = top + 1) {
+        for (top = i; top + 1 < count && recs[top + 1].depth; top++)
+            ;
+        ep = &recs[i];
+        rp = &recs[top];
+        bytes = shared ? 0 : ep->file_offset_end - ep->file_offset_start + 1;
+
+        if (stat_add(&w->devices, pci_key(ep->domain, ep->bus, ep->devfn),
+                     ep->numa_node, 1, bytes) < 0 ||
+            stat_add(&w->nodes, (uint32_t)ep->numa_node, ep->numa_node, 1,
+                     bytes) < 0 ||
+            stat_add(&w->root_ports, pci_key(rp->domain, rp->bus, rp->devfn),
+                     rp->numa_node, 1, bytes) < 0)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Make room for need more elements of size bytes in *v
+ * Returns 0 on success, -ENOMEM on failure
+ */
+static int grow(void *v, uint64_t *cap, uint64_t used, uint64_t need,
+                size_t size)
+{
+    uint64_t n = *cap ? *cap : 64;
+    void *p;
+
+    if (used + need <= *cap)
+        return 0;
+    while (n < used + need)
+        n *= 2;
+
+    p = realloc(*(void **)v, n * size);
+    if (!p)
+        return -ENOMEM;
+    *(void **)v = p;
+    *cap = n;
+    return 0;
+}
+
+/*
+ * Index of device key in the map, adding it if it is new
+ * Returns 0 on success, -ENOMEM on failure
+ */
+static int map_get_device(struct map_builder *b, uint64_t key,
+                          const struct file_to_pcie_map_device *dev,
+                          uint32_t *index)
+{
+    uint64_t i;
+
+    for (i = 0; i < b->nr_devices; i++) {
+        if (b->device_keys[i] == key) {
+            *index = i;
+            return 0;
+        }
+    }
+
+    if (grow(&b->devices, &b->devices_cap, b->nr_devices, 1,
+             sizeof(*b->devices)) < 0 ||
+        grow(&b->device_keys, &b->keys_cap, b->nr_devices, 1,
+             sizeof(*b->device_keys)) < 0)
+        return -ENOMEM;
+
+    b->devices[b->nr_devices] = *dev;
+    b->device_keys[b->nr_devices] = key;
+    *index = b->nr_devices++;
+    return 0;
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+    const struct file_to_pcie_map_extent *x = a, *y = b;
+
+    if (x->file_offset_start != y->file_offset_start)
+        return x->file_offset_start < y->file_offset_start ? -1 : 1;
+    return x->device < y->device ? -1 : x->device > y->device;
+}
+
+/*
+ * Add one file and its records to the map. Each chain becomes one
+ * extent on its endpoint; the devices above it become its parents.
+ * Extents of a file in unknown shares are flagged, since each of them
+ * spans the whole file.
+ */
+static int map_add_file(struct map_builder *b, const char *dir,
+                        const char *name, uint64_t ino, uint64_t size,
+                        const struct file_to_pcie_dev_record *recs,
+                        uint32_t count)
+{
+    struct file_to_pcie_map_device dev;
+    struct file_to_pcie_map_extent *ext;
+    struct file_to_pcie_map_file *f;
+    const struct file_to_pcie_dev_record *r;
+    uint32_t i, j, top, parent, index;
+    uint32_t flags = records_shared(recs, count) ?
+                     FILE_TO_PCIE_MAP_EXTENT_F_SHARED : 0;
+    size_t len;
+
+    len = dir ? strlen(dir) + 1 + strlen(name) : strlen(name);
+    if (grow(&b->files, &b->files_cap, b->nr_files, 1, sizeof(*b->files)) ||
+        grow(&b->strings, &b->strings_cap, b->strings_size, len + 1, 1))
+        return -ENOMEM;
+
+    f = &b->files[b->nr_files];
+    memset(f, 0, sizeof(*f));
+    f->path = b->strings_size;
+    f->path_len = len;
+    f->first_extent = b->nr_extents;
+    f->size = size;
+    f->ino = ino;
+    if (dir)
+        sprintf(b->strings + b->strings_size, "%s/%s", dir, name);
+    else
+        strcpy(b->strings + b->strings_size, name);
+
+    for (i = 0; i < count; i = top + 1) {
+        for (top = i; top + 1 < count && recs[top + 1].depth; top++)
+            ;
+
+        /* Root port first, so every parent is in the table already */
+        parent = FILE_TO_PCIE_MAP_NO_PARENT;
+        for (j = top + 1; j-- > i; parent = index) {
+            r = &recs[j];
+            memset(&dev, 0, sizeof(dev));
+            dev.domain = r->domain;
+            dev.vendor_id = r->vendor_id;
+            dev.device_id = r->device_id;
+            dev.bus = r->bus;
+            dev.devfn = r->devfn;
+            dev.numa_node = r->numa_node;
+            dev.parent = parent;
+            dev.first_local_cpu = r->first_local_cpu;
+            dev.nr_local_cpus = r->nr_local_cpus;
+            if (map_get_device(b, pci_key(r->domain, r->bus, r->devfn), &dev,
+                               &index) < 0)
+                return -ENOMEM;
+        }
+
+        if (grow(&b->extents, &b->extents_cap, b->nr_extents, 1,
+                 sizeof(*b->extents)) < 0)
+            return -ENOMEM;
+        r = &recs[i];
+        ext = &b->extents[b->nr_extents++];
+        memset(ext, 0, sizeof(*ext));
+        ext->file_offset_start = r->file_offset_start;
+        ext->file_offset_end = r->file_offset_end;
+        ext->sector_start = r->sector_start;
+        ext->sector_end = r->sector_end;
+        ext->device = index;
+        ext->dev_major = r->dev_major;
+        ext->dev_minor = r->dev_minor;
+        ext->flags = flags;
+        f->extent_count++;
+    }
+
+    qsort(b->extents + f->first_extent, f->extent_count, sizeof(*ext),
+          extent_cmp);
+    b->strings_size += len + 1;
+    b->nr_files++;
+    return 0;
+}
+
+/*
+ * Note the topology generation of a query answer. The map is only as
+ * current as its oldest answer, so that is the one it records.
+ */
+static void map_note_generation(struct map_builder *b, uint64_t gen)
+{
+    if (gen && (!b->generation || gen < b->generation))
+        b->generation = gen;
+}
+
+/* Append src to dst, renumbering its devices, extents and strings */
+static int map_merge(struct map_builder *dst, const struct map_builder *src)
+{
+    struct file_to_pcie_map_device dev;
+    struct file_to_pcie_map_extent *ext;
+    struct file_to_pcie_map_file *f;
+    uint32_t *remap;
+    uint64_t i;
+    int ret = -ENOMEM;
+
+    map_note_generation(dst, src->generation);
+    remap = calloc(src->nr_devices ? src->nr_devices : 1, sizeof(*remap));
+    if (!remap)
+        return -ENOMEM;
+
+    for (i = 0; i < src->nr_devices; i++) {
+        dev = src->devices[i];
+        if (dev.parent != FILE_TO_PCIE_MAP_NO_PARENT)
+            dev.parent = remap[dev.parent];
+        if (map_get_device(dst, src->device_keys[i], &dev, &remap[i]) < 0)
+            goto out;
+    }
+
+    if (grow(&dst->files, &dst->files_cap, dst->nr_files, src->nr_files,
+             sizeof(*dst->files)) < 0 ||
+        grow(&dst->extents, &dst->extents_cap, dst->nr_extents,
+             src->nr_extents, sizeof(*dst->extents)) < 0 ||
+        grow(&dst->strings, &dst->strings_cap, dst->strings_size,
+             src->strings_size, 1) < 0)
+        goto out;
+
+    for (i = 0; i < src->nr_files; i++) {
+        f = &dst->files[dst->nr_files + i];
+        *f = src->files[i];
+        f->path += dst->strings_size;
+        f->first_extent += dst->nr_extents;
+    }
+    for (i = 0; i < src->nr_extents; i++) {
+        ext = &dst->extents[dst->nr_extents + i];
+        *ext = src->extents[i];
+        ext->device = remap[ext->device];
+    }
+    if (src->strings_size)
+        memcpy(dst->strings + dst->strings_size, src->strings,
+               src->strings_size);
+
+    dst->nr_files += src->nr_files;
+    dst->nr_extents += src->nr_extents;
+    dst->strings_size += src->strings_size;
+    ret = 0;
+out:
+    free(remap);
+    return ret;
+}
+
+static void map_free(struct map_builder *b)
+{
+    free(b->devices);
+    free(b->device_keys);
+    free(b->files);
+    free(b->extents);
+    free(b->strings);
+}
+
+/* qsort() has no context argument */
+static const char *map_sort_strings;
+
+static int file_cmp(const void *a, const void *b)
+{
+    const struct file_to_pcie_map_file *x = a, *y = b;
+
+    return strcmp(map_sort_strings + x->path, map_sort_strings + y->path);
+}
+
+static int write_table(FILE *out, const void *v, uint64_t count, size_t size,
+                       uint64_t *offset)
+{
+    static const char pad[8];
+    size_t n = (8 - *offset % 8) % 8;
+
+    if ((n && fwrite(pad, 1, n, out) != n) ||
+        (count && fwrite(v, size, count, out) != count))
+        return -EIO;
+    *offset += n + count * size;
+    return 0;
+}
+
+/*
+ * Write the map sorted by path, with each file's extents laid out in
+ * file order. Written to a temporary file and renamed into place, so
+ * loaders never map a partial file.
+ */
+static int map_write(struct map_builder *b, const char *path)
+{
+    struct file_to_pcie_map_header hdr;
+    struct file_to_pcie_map_file *f;
+    char *tmp;
+    FILE *out;
+    uint64_t i, offset, next;
+    int ret = -EIO;
+
+    map_sort_strings = b->strings;
+    qsort(b->files, b->nr_files, sizeof(*b->files), file_cmp);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FILE_TO_PCIE_MAP_MAGIC;
+    hdr.version = FILE_TO_PCIE_MAP_VERSION;
+    hdr.header_size = sizeof(hdr);
+    hdr.device_size = sizeof(*b->devices);
+    hdr.file_size = sizeof(*b->files);
+    hdr.extent_size = sizeof(*b->extents);
+    hdr.device_count = b->nr_devices;
+    hdr.file_count = b->nr_files;
+    hdr.extent_count = b->nr_extents;
+    hdr.strings_size = b->strings_size;
+    hdr.created = time(NULL);
+    hdr.generation = b->generation;
+    /* All records are multiples of 8 bytes, so only strings need padding */
+    hdr.devices = sizeof(hdr);
+    hdr.files = hdr.devices + b->nr_devices * sizeof(*b->devices);
+    hdr.extents = hdr.files + b->nr_files * sizeof(*b->files);
+    hdr.strings = hdr.extents + b->nr_extents * sizeof(*b->extents);
+
+    tmp = malloc(strlen(path) + 5);
+    if (!tmp)
+        return -ENOMEM;
+    sprintf(tmp, "%s.tmp", path);
+    out = fopen(tmp, "w");
+    if (!out) {
+        ret = -errno;
+        free(tmp);
+        return ret;
+    }
+
+    offset = 0;
+    if (write_table(out, &hdr, 1, sizeof(hdr), &offset) < 0 ||
+        write_table(out, b->devices, b->nr_devices, sizeof(*b->devices),
+                    &offset) < 0)
+        goto out_close;
+
+    /* File entries, renumbered for extents in file order */
+    for (i = 0, next = 0; i < b->nr_files; i++) {
+        struct file_to_pcie_map_file e = b->files[i];
+
+        e.first_extent = next;
+        next += e.extent_count;
+        if (write_table(out, &e, 1, sizeof(e), &offset) < 0)
+            goto out_close;
+    }
+    for (i = 0; i < b->nr_files; i++) {
+        f = &b->files[i];
+        if (write_table(out, b->extents + f->first_extent, f->extent_count,
+                        sizeof(*b->extents), &offset) < 0)
+            goto out_close;
+    }
+    if (write_table(out, b->strings, b->strings_size, 1, &offset) < 0 ||
+        fflush(out) || fsync(fileno(out)))
+        goto out_close;
+
+    ret = 0;
+out_close:
+    if (fclose(out) && !ret)
+        ret = -EIO;
+    if (!ret && rename(tmp, path) < 0)
+        ret = -errno;
+    if (ret)
+        unlink(tmp);
+    free(tmp);
+    return ret;
+}
+
+/*
+ * Query one file by path when its records did not fit in the shared
+ * directory buffer
+ */
+static int query_file(struct worker *w, int dirfd, const char *name,
+                      uint64_t size, uint32_t needed,
+                      const struct file_to_pcie_dev_record **recs,
+                      uint32_t *count)
+{
+    struct file_to_pcie_query q;
+    struct file_to_pcie_dev_record *big;
+
+    for (;;) {
+        if (needed > w->big_capacity) {
+            big = realloc(w->big, needed * sizeof(*big));
+            if (!big)
+                return -ENOMEM;
+            w->big = big;
+            w->big_capacity = needed;
+        }
+
+        memset(&q, 0, sizeof(q));
+        q.fd = dirfd;
+        q.flags = FILE_TO_PCIE_QUERY_F_PATH;
+        q.path = (uintptr_t)name;
+        q.offset = 0;
+        q.length = size;
+        q.records = (uintptr_t)w->big;
+        q.record_size = sizeof(*w->big);
+        q.record_capacity = w->big_capacity;
+        if (ioctl(w->s->dev_fd, FILE_TO_PCIE_IOCTL_QUERY, &q) < 0)
+            return -errno;
+        map_note_generation(&w->map, q.generation);
+
+        /* The file may have changed since the directory was read */
+        if (q.record_count == q.records_needed)
+            break;
+        needed = q.records_needed;
+    }
+
+    *recs = w->big;
+    *count = q.record_count;
+    return 0;
+}
+
+static void report_error(struct worker *w, const char *dir, const char *name,
+                         int err)
+{
+    w->totals.errors++;
+    if (w->s->verbose)
+        fprintf(stderr, "%s/%s: %s\n", dir, name, strerror(-err));
+}
+
+static int queue_dir(struct scanner *s, const char *dir, const char *name)
+{
+    struct dir_work *work;
+    size_t len = strlen(dir);
+
+    work = malloc(sizeof(*work) + len + (name ? strlen(name) + 2 : 1));
+    if (!work)
+        return -ENOMEM;
+    if (name)
+        sprintf(work->path, "%s/%s", len == 1 && dir[0] == '/' ? "" : dir,
+                name);
+    else
+        strcpy(work->path, dir);
+
+    pthread_mutex_lock(&s->lock);
+    work->next = s->queue;
+    s->queue = work;
+    s->pending++;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+/*
+ * Map every file of one directory, queueing its subdirectories
+ * Returns a negative error code only if the scan cannot go on
+ */
+static int scan_dir(struct worker *w, const char *path)
+{
+    struct file_to_pcie_dir_query q;
+    const struct file_to_pcie_dir_entry *ent;
+    const struct file_to_pcie_dev_record *recs;
+    const char *name;
+    uint32_t count, i;
+    int dirfd, ret = 0;
+
+    dirfd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) {
+        report_error(w, path, ".", -errno);
+        return 0;
+    }
+    w->totals.dirs++;
+
+    memset(&q, 0, sizeof(q));
+    q.dirfd = dirfd;
+    q.flags = FILE_TO_PCIE_DIR_F_SUBDIRS;
+    q.entries = (uintptr_t)w->entries;
+    q.entry_capacity = DIR_ENTRIES;
+    q.names = (uintptr_t)w->names;
+    q.names_size = DIR_NAMES_SIZE;
+    q.records = (uintptr_t)w->records;
+    q.record_size = sizeof(*w->records);
+    q.record_capacity = DIR_RECORDS;
+
+    do {
+        if (ioctl(w->s->dev_fd, FILE_TO_PCIE_IOCTL_QUERY_DIR, &q) < 0) {
+            ret = -errno;
+            /* The walk itself is broken, not just this directory */
+            if (ret == -ENOTTY || ret == -EFAULT || ret == -ENOMEM)
+                break;
+            report_error(w, path, ".", ret);
+            ret = 0;
+            break;
+        }
+        map_note_generation(&w->map, q.generation);
+
+        for (i = 0; i < q.entry_count; i++) {
+            ent = &w->entries[i];
+            name = w->names + ent->name_offset;
+
+            if (ent->status == -EISDIR) {
+                ret = queue_dir(w->s, path, name);
+                if (ret < 0)
+                    goto out;
+                continue;
+            }
+            if (ent->status < 0) {
+                report_error(w, path, name, ent->status);
+                continue;
+            }
+
+            recs = w->records + ent->record_index;
+            count = ent->record_count;
+            if (count < ent->records_needed) {
+                ret = query_file(w, dirfd, name, ent->size,
+                                 ent->records_needed, &recs, &count);
+                if (ret < 0) {
+                    report_error(w, path, name, ret);
+                    ret = 0;
+                    continue;
+                }
+            }
+
+            ret = account_file(w, recs, count, ent->size);
+            if (!ret && w->s->build_map)
+                ret = map_add_file(&w->map, path, name, ent->ino, ent->size,
+                                   recs, count);
+            if (ret < 0)
+                goto out;
+        }
+    } while (!q.done);
+
+out:
+    close(dirfd);
+    return ret;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct scanner *s = w->s;
+    struct dir_work *work;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!s->queue && s->pending && !s->failed)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (!s->queue || s->failed) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        work = s->queue;
+        s->queue = work->next;
+        pthread_mutex_unlock(&s->lock);
+
+        ret = scan_dir(w, work->path);
+        if (ret < 0)
+            fprintf(stderr, "Error: scanning %s: %s\n", work->path,
+                    strerror(-ret));
+        free(work);
+
+        pthread_mutex_lock(&s->lock);
+        if (ret < 0)
+            s->failed = 1;
+        /* Last directory done: wake everyone up to exit */
+        if (--s->pending == 0 || s->failed)
+            pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+/*
+ * A regular file given on the command line rather than a directory
+ */
+static int scan_file(struct worker *w, const char *path,
+                     const struct stat *st)
+{
+    const struct file_to_pcie_dev_record *recs = NULL;
+    uint32_t count = 0;
+    int ret;
+
+    if (st->st_size) {
+        ret = query_file(w, AT_FDCWD, path, st->st_size, DIR_RECORDS, &recs,
+                         &count);
+        if (ret < 0) {
+            w->totals.errors++;
+            fprintf(stderr, "Error: %s: %s\n", path, strerror(-ret));
+            return 0;
+        }
+    }
+
+    ret = account_file(w, recs, count, st->st_size);
+    if (!ret && w->s->build_map)
+        ret = map_add_file(&w->map, NULL, path, st->st_ino, st->st_size,
+                           recs, count);
+    return ret;
+}
+
+static void format_pci(char *buf, size_t size, uint64_t key)
+{
+    snprintf(buf, size, "%04x:%02x:%02x.%x", (unsigned int)(key >> 16),
+             (unsigned int)(key >> 8) & 0xff,
+             (unsigned int)(key >> 3) & 0x1f, (unsigned int)key & 0x7);
+}
+
+static void print_csv_rows(FILE *out, const char *level,
+                           const struct stat_table *t, int pci)
+{
+    char id[32];
+    size_t i;
+
+    for (i = 0; i < t->count; i++) {
+        if (pci)
+            format_pci(id, sizeof(id), t->v[i].key);
+        else
+            snprintf(id, sizeof(id), "%d", t->v[i].numa_node);
+        fprintf(out, "%s,%s,%d,%llu,%llu\n", level, id, t->v[i].numa_node,
+                (unsigned long long)t->v[i].files,
+                (unsigned long long)t->v[i].bytes);
+    }
+}
+
+static void print_csv(FILE *out, const struct worker *all)
+{
+    const struct scan_totals *t = &all->totals;
+
+    fprintf(out, "level,id,numa_node,files,bytes\n");
+    print_csv_rows(out, "device", &all->devices, 1);
+    print_csv_rows(out, "numa_node", &all->nodes, 0);
+    print_csv_rows(out, "root_port", &all->root_ports, 1);
+    fprintf(out, "unmapped,-,-1,%llu,%llu\n",
+            (unsigned long long)t->unmapped_files,
+            (unsigned long long)t->unmapped_bytes);
+    fprintf(out, "shared,-,-1,%llu,%llu\n",
+            (unsigned long long)t->shared_files,
+            (unsigned long long)t->shared_bytes);
+    fprintf(out, "total,-,-1,%llu,%llu\n",
+            (unsigned long long)t->files, (unsigned long long)t->bytes);
+}
+
+static void print_json_rows(FILE *out, const char *level,
+                            const struct stat_table *t, int pci)
+{
+    char id[32];
+    size_t i;
+
+    fprintf(out, "  \"%s\": [", level);
+    for (i = 0; i < t->count; i++) {
+        fprintf(out, "%s\n    {", i ? "," : "");
+        if (pci) {
+            format_pci(id, sizeof(id), t->v[i].key);
+            fprintf(out, "\"address\": \"%s\", ", id);
+        }
+        fprintf(out, "\"numa_node\": %d, \"files\": %llu, \"bytes\": %llu}",
+                t->v[i].numa_node, (unsigned long long)t->v[i].files,
+                (unsigned long long)t->v[i].bytes);
+    }
+    fprintf(out, "%s],\n", t->count ? "\n  " : "");
+}
+
+static void print_json(FILE *out, const struct worker *all)
+{
+    const struct scan_totals *t = &all->totals;
+
+    fprintf(out, "{\n");
+    print_json_rows(out, "devices", &all->devices, 1);
+    print_json_rows(out, "numa_nodes", &all->nodes, 0);
+    print_json_rows(out, "root_ports", &all->root_ports, 1);
+    fprintf(out, "  \"dirs\": %llu,\n", (unsigned long long)t->dirs);
+    fprintf(out, "  \"files\": %llu,\n", (unsigned long long)t->files);
+    fprintf(out, "  \"bytes\": %llu,\n", (unsigned long long)t->bytes);
+    fprintf(out, "  \"unmapped_files\": %llu,\n",
+            (unsigned long long)t->unmapped_files);
+    fprintf(out, "  \"unmapped_bytes\": %llu,\n",
+            (unsigned long long)t->unmapped_bytes);
+    fprintf(out, "  \"shared_files\": %llu,\n",
+            (unsigned long long)t->shared_files);
+    fprintf(out, "  \"shared_bytes\": %llu,\n",
+            (unsigned long long)t->shared_bytes);
+    fprintf(out, "  \"errors\": %llu\n", (unsigned long long)t->errors);
+    fprintf(out, "}\n");
+}
+
+static int worker_init(struct worker *w, struct scanner *s)
+{
+    memset(w, 0, sizeof(*w));
+    w->s = s;
+    w->entries = calloc(DIR_ENTRIES, sizeof(*w->entries));
+    w->names = malloc(DIR_NAMES_SIZE);
+    w->records = calloc(DIR_RECORDS, sizeof(*w->records));
+    if (!w->entries || !w->names || !w->records)
+        return -ENOMEM;
+    return 0;
+}
+
+static void worker_free(struct worker *w)
+{
+    free(w->entries);
+    free(w->names);
+    free(w->records);
+    free(w->big);
+    free(w->devices.v);
+    free(w->nodes.v);
+    free(w->root_ports.v);
+    map_free(&w->map);
+}
+
+/* Fold w into all, which holds the merged result */
+static int worker_merge(struct worker *all, const struct worker *w)
+{
+    all->totals.dirs += w->totals.dirs;
+    all->totals.files += w->totals.files;
+    all->totals.bytes += w->totals.bytes;
+    all->totals.unmapped_files += w->totals.unmapped_files;
+    all->totals.unmapped_bytes += w->totals.unmapped_bytes;
+    all->totals.shared_files += w->totals.shared_files;
+    all->totals.shared_bytes += w->totals.shared_bytes;
+    all->totals.errors += w->totals.errors;
+
+    if (stat_merge(&all->devices, &w->devices) < 0 ||
+        stat_merge(&all->nodes, &w->nodes) < 0 ||
+        stat_merge(&all->root_ports, &w->root_ports) < 0 ||
+        map_merge(&all->map, &w->map) < 0)
+        return -ENOMEM;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct scanner s;
+    struct worker *workers = NULL, all;
+    struct stat st;
+    const char *format = "csv";
+    const char *output = NULL;
+    const char *map_path = NULL;
+    FILE *out = stdout;
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, started = 0, ret = EXIT_FAILURE;
+    int opt;
+
+    memset(&s, 0, sizeof(s));
+    memset(&all, 0, sizeof(all));
+    while ((opt = getopt(argc, argv, "j:f:o:m:v")) != -1) {
+        switch (opt) {
+        case 'j':
+            nr_threads = strtol(optarg, NULL, 0);
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'm':
+            map_path = optarg;
+            s.build_map = 1;
+            break;
+        case 'v':
+            s.verbose = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc || nr_threads < 1 || nr_threads > MAX_THREADS ||
+        (strcmp(format, "csv") && strcmp(format, "json"))) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    s.dev_fd = open(DEVICE_PATH, O_RDWR);
+    if (s.dev_fd < 0) {
+        perror("Failed to open device");
+        fprintf(stderr, "Make sure the kernel module is loaded\n");
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    workers = calloc(nr_threads, sizeof(*workers));
+    if (worker_init(&all, &s) < 0 || !workers) {
+        fprintf(stderr, "Error: out of memory\n");
+        goto out;
+    }
+    for (i = 0; i < nr_threads; i++) {
+        if (worker_init(&workers[i], &s) < 0) {
+            fprintf(stderr, "Error: out of memory\n");
+            goto out_workers;
+        }
+    }
+
+    /* Files are mapped right away, directories go to the pool */
+    for (i = optind; i < argc; i++) {
+        if (stat(argv[i], &st) < 0) {
+            fprintf(stderr, "Error: %s: %s\n", argv[i], strerror(errno));
+            all.totals.errors++;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (queue_dir(&s, argv[i], NULL) < 0)
+                goto out_workers;
+        } else if (scan_file(&all, argv[i], &st) < 0) {
+            goto out_workers;
+        }
+    }
+
+    for (started = 0; started < nr_threads; started++) {
+        if (pthread_create(&workers[started].thread, NULL, worker_main,
+                           &workers[started])) {
+            fprintf(stderr, "Error: failed to start worker threads\n");
+            pthread_mutex_lock(&s.lock);
+            s.failed = 1;
+            pthread_cond_broadcast(&s.cond);
+            pthread_mutex_unlock(&s.lock);
+            break;
+        }
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    if (s.failed)
+        goto out_workers;
+
+    for (i = 0; i < nr_threads; i++) {
+        if (worker_merge(&all, &workers[i]) < 0) {
+            fprintf(stderr, "Error: out of memory\n");
+            goto out_workers;
+        }
+    }
+    qsort(all.devices.v, all.devices.count, sizeof(*all.devices.v),
+          stat_cmp);
+    qsort(all.nodes.v, all.nodes.count, sizeof(*all.nodes.v), stat_cmp);
+    qsort(all.root_ports.v, all.root_ports.count,
+          sizeof(*all.root_ports.v), stat_cmp);
+
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            perror("Failed to open output");
+            goto out_workers;
+        }
+    }
+    if (!strcmp(format, "json"))
+        print_json(out, &all);
+    else
+        print_csv(out, &all);
+    if (out != stdout && fclose(out)) {
+        perror("Failed to write output");
+        goto out_workers;
+    }
+    if (map_path) {
+        int err = map_write(&all.map, map_path);
+
+        if (err < 0) {
+            fprintf(stderr, "Error: writing %s: %s\n", map_path,
+                    strerror(-err));
+            goto out_workers;
+        }
+    }
+    ret = all.totals.errors ? 2 : EXIT_SUCCESS;
+
+out_workers:
+    for (i = 0; i < nr_threads; i++)
+        worker_free(&workers[i]);
+out:
+    worker_free(&all);
+    free(workers);
+    while (s.queue) {
+        struct dir_work *work = s.queue;
+
+        s.queue = work->next;
+        free(work);
+    }
+    close(s.dev_fd);
+    return ret;
+}
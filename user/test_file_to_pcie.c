@@ -12,21 +12,75 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <stdint.h>
+#include <linux/fiemap.h>
+#include <linux/blkzoned.h>
 #include "file_to_pcie.h"
+#include "uring.h"
 
 #ifndef ENOTSUPP
 #define ENOTSUPP 524
 #endif
 
 #define DEVICE_PATH "/dev/file_to_pcie"
+#define MAX_EXTENTS 256
+#define MAX_ZONES 256
+#define MAX_RECORDS 64
+#define MAX_PATHS 64
+#define MAX_DIR_ENTRIES 128
+#define MAX_CACHE_RANGES 256
+#define MAX_GROUP_FILES 256
 
 static void print_usage(const char *prog_name)
 {
-    fprintf(stderr, "Usage: %s <file_path> <offset> <length>\n",
+    fprintf(stderr, "Usage: %s [-c] [-l] [-q] [-L] [-m] [-E] [-T] [-u] [-r] "
+            "[-e] [-z] [-p target] <file_path> <offset> <length>\n",
             prog_name);
+    fprintf(stderr, "       %s [-l] [-q] [-L] [-E] [-T] [-o json|binary] "
+            "-M <manifest>\n", prog_name);
+    fprintf(stderr, "       %s -d <directory>\n", prog_name);
+    fprintf(stderr, "       %s -w\n", prog_name);
+    fprintf(stderr, "       %s -g device|switch|root-port|numa "
+            "<file>...\n", prog_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -c  Use the compact query and print its records\n");
+    fprintf(stderr, "  -l  Like -c, and also print PCIe link state\n");
+    fprintf(stderr, "  -q  Like -c, and also print block queue limits\n");
+    fprintf(stderr, "  -L  Like -c, and also print block queue load\n");
+    fprintf(stderr, "  -E  Like -c, but only print endpoints\n");
+    fprintf(stderr, "  -T  Like -c, but skip the sector mapping\n");
+    fprintf(stderr, "  -m  Like -c, and also print the page-cache resident "
+            "ranges\n");
+    fprintf(stderr, "  -u  Like -c, but submit the query through "
+            "io_uring\n");
+    fprintf(stderr, "  -r  Like -c, but register the file and query it "
+            "by index\n");
+    fprintf(stderr, "  -e  Also print the physical extents of the "
+            "segment\n");
+    fprintf(stderr, "  -z  Like -e, and also print the zones of extents on "
+            "zoned\n");
+    fprintf(stderr, "      devices\n");
+    fprintf(stderr, "  -p  Print the P2P DMA distance to a target, given "
+            "as a PCI\n");
+    fprintf(stderr, "      address (0000:65:00.0) or a path (file, block "
+            "device or\n");
+    fprintf(stderr, "      sysfs device directory)\n");
+    fprintf(stderr, "  -d  Map every regular file of a directory, "
+            "without opening them\n");
+    fprintf(stderr, "  -g  Group whole files by the device, switch, root "
+            "port or NUMA\n");
+    fprintf(stderr, "      node they share\n");
+    fprintf(stderr, "  -w  Print the topology generation, then wait for "
+            "changes to it\n");
+    fprintf(stderr, "  -M  Map every \"path offset length\" line of a "
+            "manifest (- for\n");
+    fprintf(stderr, "      stdin) with batched queries, one result per "
+            "line\n");
+    fprintf(stderr, "  -o  Manifest output: JSON Lines (default) or binary "
+            "records\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Example: %s /dev/sda1 0 4096\n", prog_name);
     fprintf(stderr, "         %s /tmp/testfile 0 1024\n",
@@ -64,22 +118,1186 @@ static void print_pcie_devices(struct file_to_pcie_request *req)
     }
 }
 
+/*
+ * Issue a request as an io_uring command instead of an ioctl
+ * Returns the CQE result, with errno set if it is negative
+ */
+static int uring_ioctl(int dev_fd, unsigned int cmd, void *arg)
+{
+    struct file_to_pcie_uring_cmd ucmd;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct uring ring;
+    int ret;
+
+    ret = uring_init(&ring, 1);
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    memset(&ucmd, 0, sizeof(ucmd));
+    ucmd.arg = (uintptr_t)arg;
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = dev_fd;
+    sqe->cmd_op = cmd;
+    memcpy(sqe->cmd, &ucmd, sizeof(ucmd));
+
+    ret = uring_submit_and_wait(&ring, 1);
+    if (ret >= 0) {
+        cqe = uring_peek_cqe(&ring);
+        ret = cqe->res;
+        uring_cqe_seen(&ring);
+    }
+    uring_exit(&ring);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+static const char *path_state_name(uint8_t state)
+{
+    switch (state) {
+    case FILE_TO_PCIE_PATH_OPTIMIZED:
+        return "optimized";
+    case FILE_TO_PCIE_PATH_NON_OPTIMIZED:
+        return "non-optimized";
+    case FILE_TO_PCIE_PATH_INACCESSIBLE:
+        return "inaccessible";
+    case FILE_TO_PCIE_PATH_PERSISTENT_LOSS:
+        return "persistent-loss";
+    case FILE_TO_PCIE_PATH_CHANGE:
+        return "change";
+    default:
+        return "unknown";
+    }
+}
+
+static int print_compact(int dev_fd, int file_fd, long offset,
+                         size_t length, uint32_t flags, int use_uring)
+{
+    static struct file_to_pcie_dev_record recs[MAX_RECORDS];
+    static struct file_to_pcie_cache_range ranges[MAX_CACHE_RANGES];
+    struct file_to_pcie_query q;
+    uint32_t i;
+    int ret;
+
+    memset(&q, 0, sizeof(q));
+    q.fd = file_fd;
+    q.flags = flags;
+    q.offset = offset;
+    q.length = length;
+    q.records = (uintptr_t)recs;
+    q.record_size = sizeof(recs[0]);
+    q.record_capacity = MAX_RECORDS;
+    q.cache_ranges = (uintptr_t)ranges;
+    q.cache_range_capacity = MAX_CACHE_RANGES;
+
+    if (flags & FILE_TO_PCIE_QUERY_F_FIXED) {
+        struct file_to_pcie_register reg;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.fds = (uintptr_t)&file_fd;
+        reg.offset = 0;
+        reg.count = 1;
+        if (ioctl(dev_fd, FILE_TO_PCIE_IOCTL_REGISTER_FILES, &reg) < 0) {
+            perror("file registration failed");
+            return -1;
+        }
+        q.fd = 0;
+    }
+
+    if (use_uring)
+        ret = uring_ioctl(dev_fd, FILE_TO_PCIE_IOCTL_QUERY, &q);
+    else
+        ret = ioctl(dev_fd, FILE_TO_PCIE_IOCTL_QUERY, &q);
+    if (ret < 0) {
+        perror("compact query failed");
+        return -1;
+    }
+
+    printf("Compact query: %u record(s) of %u needed, generation %llu\n",
+           q.record_count, q.records_needed,
+           (unsigned long long)q.generation);
+    printf("----------------------------------------\n");
+
+    for (i = 0; i < q.record_count; i++) {
+        printf("  [%u] %04x:%02x:%02x.%x %04x:%04x depth %u "
+               "bdev %u:%u file %lld-%lld sectors %lld-%lld "
+               "numa %d cpus %u (first %d)\n",
+               i, recs[i].domain, recs[i].bus, recs[i].devfn >> 3,
+               recs[i].devfn & 7, recs[i].vendor_id, recs[i].device_id,
+               recs[i].depth, recs[i].dev_major, recs[i].dev_minor,
+               (long long)recs[i].file_offset_start,
+               (long long)recs[i].file_offset_end,
+               (long long)recs[i].sector_start,
+               (long long)recs[i].sector_end,
+               recs[i].numa_node, recs[i].nr_local_cpus,
+               recs[i].first_local_cpu);
+        if (recs[i].path_state)
+            printf("      nvme path via nvme%u, ANA %s%s%s\n",
+                   recs[i].path_controller, path_state_name(recs[i].path_state),
+                   recs[i].path_flags & FILE_TO_PCIE_PATH_F_LIVE ?
+                   "" : ", not live",
+                   recs[i].path_flags & FILE_TO_PCIE_PATH_F_CURRENT ?
+                   ", current" : "");
+        if (flags & FILE_TO_PCIE_QUERY_F_LINK) {
+            printf("      link Gen%u x%u (max Gen%u x%u) available %u Mb/s",
+                   recs[i].link_speed, recs[i].link_width,
+                   recs[i].max_link_speed, recs[i].max_link_width,
+                   recs[i].available_bandwidth);
+            if (recs[i].available_bandwidth)
+                printf(", limited by %04x:%02x:%02x.%x Gen%u x%u",
+                       recs[i].limit_domain, recs[i].limit_bus,
+                       recs[i].limit_devfn >> 3, recs[i].limit_devfn & 7,
+                       recs[i].limit_link_speed, recs[i].limit_link_width);
+            printf("\n");
+        }
+        if (flags & FILE_TO_PCIE_QUERY_F_LIMITS)
+            printf("      queue lbs %u pbs %u io_min %u io_opt %u "
+                   "max_sectors %u max_segments %u dma_align %u%s%s%s%s\n",
+                   recs[i].logical_block_size, recs[i].physical_block_size,
+                   recs[i].io_min, recs[i].io_opt, recs[i].max_sectors,
+                   recs[i].max_segments, recs[i].dma_alignment,
+                   recs[i].queue_flags & FILE_TO_PCIE_QUEUE_F_ROTATIONAL ?
+                   " rotational" : "",
+                   recs[i].queue_flags & FILE_TO_PCIE_QUEUE_F_ZONED ?
+                   " zoned" : "",
+                   recs[i].queue_flags & FILE_TO_PCIE_QUEUE_F_DISCARD ?
+                   " discard" : "",
+                   recs[i].queue_flags & FILE_TO_PCIE_QUEUE_F_WRITE_ZEROES ?
+                   " write-zeroes" : "");
+        if (flags & FILE_TO_PCIE_QUERY_F_LOAD) {
+            printf("      load busy %llu ms at %llu ns, in flight ",
+                   (unsigned long long)recs[i].busy_ms,
+                   (unsigned long long)recs[i].sample_ns);
+            if (recs[i].load_flags & FILE_TO_PCIE_LOAD_F_INFLIGHT)
+                printf("%u\n", recs[i].inflight);
+            else
+                printf("unknown\n");
+        }
+    }
+    printf("\n");
+
+    if (flags & FILE_TO_PCIE_QUERY_F_CACHE) {
+        printf("Page cache: %u range(s) of %u cached\n",
+               q.cache_range_count, q.cache_ranges_needed);
+        printf("----------------------------------------\n");
+        for (i = 0; i < q.cache_range_count; i++)
+            printf("  [%u] file %lld-%lld%s%s\n", i,
+                   (long long)ranges[i].offset,
+                   (long long)(ranges[i].offset + ranges[i].length - 1),
+                   ranges[i].flags & FILE_TO_PCIE_CACHE_F_DIRTY ?
+                   " dirty" : "",
+                   ranges[i].flags & FILE_TO_PCIE_CACHE_F_WRITEBACK ?
+                   " writeback" : "");
+        printf("\n");
+    }
+
+    return 0;
+}
+
+static int print_p2p(int dev_fd, int file_fd, long offset, size_t length,
+                     const char *target)
+{
+    static struct file_to_pcie_p2p_path paths[MAX_PATHS];
+    struct file_to_pcie_p2p_query q;
+    unsigned int domain, bus, slot, func;
+    int target_fd = -1;
+    uint32_t i;
+
+    memset(&q, 0, sizeof(q));
+    q.fd = file_fd;
+    q.offset = offset;
+    q.length = length;
+    q.paths = (uintptr_t)paths;
+    q.path_capacity = MAX_PATHS;
+
+    if (sscanf(target, "%x:%x:%x.%x", &domain, &bus, &slot, &func) == 4) {
+        q.target_domain = domain;
+        q.target_bus = bus;
+        q.target_devfn = (slot << 3) | (func & 7);
+    } else {
+        target_fd = open(target, O_RDONLY);
+        if (target_fd < 0) {
+            perror("Failed to open P2P target");
+            return -1;
+        }
+        q.flags = FILE_TO_PCIE_P2P_F_TARGET_FD;
+        q.target_fd = target_fd;
+    }
+
+    if (ioctl(dev_fd, FILE_TO_PCIE_IOCTL_GET_P2P, &q) < 0) {
+        perror("P2P query failed");
+        if (target_fd >= 0)
+            close(target_fd);
+        return -1;
+    }
+    if (target_fd >= 0)
+        close(target_fd);
+
+    printf("P2P paths to %04x:%02x:%02x.%x: %u of %u\n", q.target_domain,
+           q.target_bus, q.target_devfn >> 3, q.target_devfn & 7,
+           q.path_count, q.paths_needed);
+    printf("----------------------------------------\n");
+
+    for (i = 0; i < q.path_count; i++) {
+        printf("  %04x:%02x:%02x.%x bdev %u:%u file %lld-%lld: %d hop(s)",
+               paths[i].domain, paths[i].bus, paths[i].devfn >> 3,
+               paths[i].devfn & 7, paths[i].dev_major, paths[i].dev_minor,
+               (long long)paths[i].file_offset_start,
+               (long long)paths[i].file_offset_end, paths[i].hops);
+        if (paths[i].flags & FILE_TO_PCIE_P2P_PATH_COMMON)
+            printf(" via %04x:%02x:%02x.%x", paths[i].common_domain,
+                   paths[i].common_bus, paths[i].common_devfn >> 3,
+                   paths[i].common_devfn & 7);
+        else if (paths[i].flags & FILE_TO_PCIE_P2P_PATH_HOST_BRIDGE)
+            printf(" via host bridge");
+        else
+            printf(" across host bridges");
+        if (paths[i].flags & FILE_TO_PCIE_P2P_PATH_NO_P2PDMA)
+            printf(", P2PDMA unavailable");
+        else if (paths[i].flags & FILE_TO_PCIE_P2P_PATH_SUPPORTED)
+            printf(", P2P distance %d", paths[i].distance);
+        else
+            printf(", P2P not supported");
+        printf("\n");
+    }
+    printf("\n");
+
+    return 0;
+}
+
+/*
+ * Print the topology generation each time it changes, until
+ * interrupted
+ */
+static int watch_generation(int dev_fd)
+{
+    struct pollfd pfd;
+    uint64_t gen;
+
+    pfd.fd = dev_fd;
+    pfd.events = POLLPRI;
+    for (;;) {
+        if (read(dev_fd, &gen, sizeof(gen)) != sizeof(gen)) {
+            perror("generation read failed");
+            return -1;
+        }
+        printf("Topology generation %llu\n", (unsigned long long)gen);
+        fflush(stdout);
+
+        if (poll(&pfd, 1, -1) < 0) {
+            perror("poll failed");
+            return -1;
+        }
+    }
+}
+
+static int parse_group_level(const char *name, uint32_t *level)
+{
+    static const char *const names[] = {
+        [FILE_TO_PCIE_GROUP_DEVICE] = "device",
+        [FILE_TO_PCIE_GROUP_SWITCH] = "switch",
+        [FILE_TO_PCIE_GROUP_ROOT_PORT] = "root-port",
+        [FILE_TO_PCIE_GROUP_NUMA_NODE] = "numa",
+    };
+    uint32_t i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (!strcmp(name, names[i])) {
+            *level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int print_groups(int dev_fd, uint32_t level, char **paths, int count)
+{
+    static struct file_to_pcie_segment segs[MAX_GROUP_FILES];
+    static struct file_to_pcie_group_result res[MAX_GROUP_FILES];
+    static struct file_to_pcie_cluster clusters[MAX_GROUP_FILES];
+    static uint32_t members[MAX_GROUP_FILES * 4];
+    struct file_to_pcie_group_query q;
+    uint32_t i, j;
+    int ret = -1;
+    int n;
+
+    if (count > MAX_GROUP_FILES) {
+        fprintf(stderr, "Error: at most %d files\n", MAX_GROUP_FILES);
+        return -1;
+    }
+
+    memset(segs, 0, sizeof(segs));
+    for (n = 0; n < count; n++) {
+        segs[n].fd = open(paths[n], O_RDONLY);
+        if (segs[n].fd < 0) {
+            perror(paths[n]);
+            goto out;
+        }
+    }
+
+    memset(&q, 0, sizeof(q));
+    q.segments = (uintptr_t)segs;
+    q.results = (uintptr_t)res;
+    q.count = count;
+    q.level = level;
+    q.clusters = (uintptr_t)clusters;
+    q.cluster_capacity = MAX_GROUP_FILES;
+    q.members = (uintptr_t)members;
+    q.member_capacity = sizeof(members) / sizeof(members[0]);
+    if (ioctl(dev_fd, FILE_TO_PCIE_IOCTL_QUERY_GROUPS, &q) < 0) {
+        perror("group query failed");
+        goto out;
+    }
+
+    printf("Groups: %u cluster(s), generation %llu\n", q.cluster_count,
+           (unsigned long long)q.generation);
+    printf("----------------------------------------\n");
+    for (i = 0; i < q.cluster_count && i < MAX_GROUP_FILES; i++) {
+        if (level == FILE_TO_PCIE_GROUP_NUMA_NODE)
+            printf("  cluster %u: numa %d, %u file(s)\n", i,
+                   clusters[i].numa_node, clusters[i].segments);
+        else
+            printf("  cluster %u: %04x:%02x:%02x.%x numa %d, %u file(s)\n",
+                   i, clusters[i].domain, clusters[i].bus,
+                   clusters[i].devfn >> 3, clusters[i].devfn & 7,
+                   clusters[i].numa_node, clusters[i].segments);
+    }
+    for (i = 0; i < q.completed; i++) {
+        printf("  %s:", paths[i]);
+        if (res[i].status < 0) {
+            printf(" %s\n", strerror(-res[i].status));
+            continue;
+        }
+        if (!res[i].cluster_count)
+            printf(" no PCIe device");
+        for (j = 0; j < res[i].member_count; j++)
+            printf(" %u", members[res[i].member_index + j]);
+        printf("\n");
+    }
+    printf("\n");
+    ret = 0;
+
+out:
+    while (n-- > 0)
+        close(segs[n].fd);
+    return ret;
+}
+
+static int print_dir(int dev_fd, const char *path)
+{
+    static struct file_to_pcie_dir_entry ents[MAX_DIR_ENTRIES];
+    static struct file_to_pcie_dev_record recs[MAX_RECORDS];
+    static char names[MAX_DIR_ENTRIES * 64];
+    struct file_to_pcie_dir_query q;
+    uint32_t i, j;
+    int dir_fd;
+
+    dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        perror("Failed to open directory");
+        return -1;
+    }
+
+    printf("Files in %s:\n", path);
+    printf("----------------------------------------\n");
+
+    memset(&q, 0, sizeof(q));
+    q.dirfd = dir_fd;
+    do {
+        q.entries = (uintptr_t)ents;
+        q.entry_capacity = MAX_DIR_ENTRIES;
+        q.names = (uintptr_t)names;
+        q.names_size = sizeof(names);
+        q.records = (uintptr_t)recs;
+        q.record_size = sizeof(recs[0]);
+        q.record_capacity = MAX_RECORDS;
+
+        if (ioctl(dev_fd, FILE_TO_PCIE_IOCTL_QUERY_DIR, &q) < 0) {
+            perror("directory query failed");
+            close(dir_fd);
+            return -1;
+        }
+
+        for (i = 0; i < q.entry_count; i++) {
+            printf("  %s (%llu bytes)", names + ents[i].name_offset,
+                   (unsigned long long)ents[i].size);
+            if (ents[i].status) {
+                printf(": %s\n", strerror(-ents[i].status));
+                continue;
+            }
+            printf(":");
+            for (j = 0; j < ents[i].record_count; j++) {
+                struct file_to_pcie_dev_record *r =
+                    &recs[ents[i].record_index + j];
+
+                if (r->depth == 0)
+                    printf(" %04x:%02x:%02x.%x", r->domain, r->bus,
+                           r->devfn >> 3, r->devfn & 7);
+            }
+            if (ents[i].record_count < ents[i].records_needed)
+                printf(" (%u of %u records)", ents[i].record_count,
+                       ents[i].records_needed);
+            printf("\n");
+        }
+    } while (!q.done && q.entry_count);
+
+    printf("\n");
+    close(dir_fd);
+    return 0;
+}
+
+static void print_extent_flags(uint32_t flags)
+{
+    if (flags & FIEMAP_EXTENT_UNWRITTEN)
+        printf(" unwritten");
+    if (flags & FIEMAP_EXTENT_DELALLOC)
+        printf(" delalloc");
+    if (flags & FIEMAP_EXTENT_DATA_INLINE)
+        printf(" inline");
+    if (flags & FIEMAP_EXTENT_SHARED)
+        printf(" shared");
+    if (flags & FIEMAP_EXTENT_ENCODED)
+        printf(" encoded");
+    if (flags & FIEMAP_EXTENT_LAST)
+        printf(" last");
+}
+
+static const char *zone_cond_name(uint8_t cond)
+{
+    switch (cond) {
+    case BLK_ZONE_COND_NOT_WP:
+        return "not-wp";
+    case BLK_ZONE_COND_EMPTY:
+        return "empty";
+    case BLK_ZONE_COND_IMP_OPEN:
+        return "implicit-open";
+    case BLK_ZONE_COND_EXP_OPEN:
+        return "explicit-open";
+    case BLK_ZONE_COND_CLOSED:
+        return "closed";
+    case BLK_ZONE_COND_READONLY:
+        return "read-only";
+    case BLK_ZONE_COND_FULL:
+        return "full";
+    case BLK_ZONE_COND_OFFLINE:
+        return "offline";
+    default:
+        return "unknown";
+    }
+}
+
+static void print_zone(const struct file_to_pcie_zone *z)
+{
+    printf("    Zone %llu+%llu: capacity %llu",
+           (unsigned long long)z->start, (unsigned long long)z->len,
+           (unsigned long long)z->capacity);
+    if (z->type == BLK_ZONE_TYPE_CONVENTIONAL)
+        printf(", conventional");
+    else
+        printf(", wp %llu, %s", (unsigned long long)z->wp,
+               zone_cond_name(z->cond));
+    if (z->flags & FILE_TO_PCIE_ZONE_F_ENDPOINT)
+        printf(", on %04x:%02x:%02x.%x", z->domain, z->bus, z->devfn >> 3,
+               z->devfn & 0x7);
+    printf("\n");
+}
+
+/*
+ * Page through the segment's extents MAX_EXTENTS at a time, resuming
+ * each call from the cursor the previous one returned
+ */
+static int print_extents(int dev_fd, int file_fd, long offset,
+                         size_t length, int zones)
+{
+    static struct file_to_pcie_extent extents[MAX_EXTENTS];
+    static struct file_to_pcie_zone zone_buf[MAX_ZONES];
+    struct file_to_pcie_extent_request req;
+    uint32_t i, j, total = 0, calls = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.fd = file_fd;
+    req.offset = offset;
+    req.length = length;
+    req.extents = (uintptr_t)extents;
+    req.extent_capacity = MAX_EXTENTS;
+    if (zones) {
+        req.flags = FILE_TO_PCIE_EXTENT_F_ZONES;
+        req.zones = (uintptr_t)zone_buf;
+        req.zone_capacity = MAX_ZONES;
+    }
+
+    printf("Extents:\n");
+    printf("----------------------------------------\n");
+
+    do {
+        if (ioctl(dev_fd, FILE_TO_PCIE_IOCTL_GET_EXTENTS, &req) < 0) {
+            if (errno == ESTALE)
+                fprintf(stderr, "Topology changed while mapping "
+                        "extents, try again\n");
+            else
+                perror("extent ioctl failed");
+            return -1;
+        }
+        calls++;
+
+        for (i = 0; i < req.extent_count; i++) {
+            printf("Extent %u:\n", ++total);
+            printf("  Block Device: %u:%u\n", extents[i].dev_major,
+                   extents[i].dev_minor);
+            printf("  File Offset: %lld (length: %llu)\n",
+                   (long long)extents[i].logical,
+                   (unsigned long long)extents[i].length);
+            printf("  Sector Range: %lld - %lld\n",
+                   (long long)extents[i].sector_start,
+                   (long long)extents[i].sector_end);
+            printf("  Flags: 0x%x", extents[i].flags);
+            print_extent_flags(extents[i].flags);
+            printf("\n");
+            if (extents[i].zone_count)
+                printf("  Zones: %u\n", extents[i].zone_count);
+            for (j = 0; j < extents[i].zone_count; j++) {
+                if (extents[i].zone_index + j >= req.zone_count) {
+                    printf("    (%u more not reported)\n",
+                           extents[i].zone_count - j);
+                    break;
+                }
+                print_zone(&zone_buf[extents[i].zone_index + j]);
+            }
+            printf("\n");
+        }
+
+        req.flags |= FILE_TO_PCIE_EXTENT_F_RESUME;
+    } while (req.cursor.offset < req.offset + (file_offset_t)req.length);
+
+    printf("Found %u extent(s) in %u call(s)\n", total, calls);
+    return 0;
+}
+
+/*
+ * Manifest mode: map "path offset length" lines, read from a file or
+ * stdin, with batched compact queries. The device and every file stay
+ * open across lines, and each line produces one JSON object or one
+ * binary result on stdout, in input order.
+ */
+#define MANIFEST_BATCH 64
+#define MANIFEST_RECORDS (MANIFEST_BATCH * 16)
+#define MANIFEST_FILES 128
+
+#define OUTPUT_JSON   0
+#define OUTPUT_BINARY 1
+
+/*
+ * Binary output: one header per line, followed by record_count
+ * struct file_to_pcie_dev_record of record_size bytes each
+ */
+struct manifest_result {
+    uint64_t line;              /* 1-based line in the manifest */
+    int64_t offset;
+    uint64_t length;
+    int32_t status;             /* 0, or negative errno */
+    uint32_t record_count;
+    uint32_t records_needed;
+    uint32_t record_size;
+};
+
+struct manifest_file {
+    char *path;
+    int fd;
+    uint64_t used;              /* For least-recently-used eviction */
+};
+
+struct manifest_entry {
+    uint64_t line;
+    char *path;                 /* NULL for a malformed line */
+    int64_t offset;
+    uint64_t length;
+    int fd;                     /* -1 if it could not be opened */
+    int status;
+};
+
+struct manifest {
+    int dev_fd;
+    int format;
+    uint32_t flags;             /* FILE_TO_PCIE_QUERY_F_* */
+    struct manifest_file files[MANIFEST_FILES];
+    unsigned int nr_files;
+    unsigned int last_file;
+    uint64_t clock;
+    struct manifest_entry ents[MANIFEST_BATCH];
+    unsigned int nr_ents;
+    struct file_to_pcie_segment segs[MANIFEST_BATCH];
+    struct file_to_pcie_query_result res[MANIFEST_BATCH];
+    struct file_to_pcie_dev_record recs[MANIFEST_RECORDS];
+    uint64_t lines;
+    uint64_t failed;
+};
+
+static void json_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", (unsigned char)*s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+static void json_record(const struct file_to_pcie_dev_record *r,
+                        uint32_t flags)
+{
+    printf("{\"pci\":\"%04x:%02x:%02x.%x\",\"vendor_id\":\"%04x\","
+           "\"device_id\":\"%04x\",\"depth\":%u,\"dev\":\"%u:%u\","
+           "\"numa_node\":%d,\"file_start\":%lld,\"file_end\":%lld,"
+           "\"sector_start\":%lld,\"sector_end\":%lld,"
+           "\"first_local_cpu\":%d,\"nr_local_cpus\":%u",
+           r->domain, r->bus, r->devfn >> 3, r->devfn & 7, r->vendor_id,
+           r->device_id, r->depth, r->dev_major, r->dev_minor,
+           r->numa_node, (long long)r->file_offset_start,
+           (long long)r->file_offset_end, (long long)r->sector_start,
+           (long long)r->sector_end, r->first_local_cpu, r->nr_local_cpus);
+    if (r->path_state)
+        printf(",\"nvme_path\":{\"controller\":%u,\"ana\":\"%s\","
+               "\"live\":%s,\"current\":%s}", r->path_controller,
+               path_state_name(r->path_state),
+               r->path_flags & FILE_TO_PCIE_PATH_F_LIVE ? "true" : "false",
+               r->path_flags & FILE_TO_PCIE_PATH_F_CURRENT ?
+               "true" : "false");
+    if (flags & FILE_TO_PCIE_QUERY_F_LINK)
+        printf(",\"link\":{\"speed\":%u,\"width\":%u,\"max_speed\":%u,"
+               "\"max_width\":%u,\"available_mbps\":%u}", r->link_speed,
+               r->link_width, r->max_link_speed, r->max_link_width,
+               r->available_bandwidth);
+    if (flags & FILE_TO_PCIE_QUERY_F_LIMITS)
+        printf(",\"queue\":{\"logical_block_size\":%u,"
+               "\"physical_block_size\":%u,\"io_min\":%u,\"io_opt\":%u,"
+               "\"max_sectors\":%u,\"max_segments\":%u,"
+               "\"dma_alignment\":%u,\"flags\":%u}", r->logical_block_size,
+               r->physical_block_size, r->io_min, r->io_opt,
+               r->max_sectors, r->max_segments, r->dma_alignment,
+               r->queue_flags);
+    if (flags & FILE_TO_PCIE_QUERY_F_LOAD) {
+        printf(",\"load\":{\"sample_ns\":%llu,\"busy_ms\":%llu",
+               (unsigned long long)r->sample_ns,
+               (unsigned long long)r->busy_ms);
+        if (r->load_flags & FILE_TO_PCIE_LOAD_F_INFLIGHT)
+            printf(",\"inflight\":%u", r->inflight);
+        printf("}");
+    }
+    printf("}");
+}
+
+static int manifest_emit(struct manifest *m, const struct manifest_entry *e,
+                         const struct file_to_pcie_query_result *r)
+{
+    const struct file_to_pcie_dev_record *recs = NULL;
+    struct manifest_result hdr;
+    uint32_t i, count = 0, needed = 0;
+    int status = e->status;
+
+    if (r) {
+        status = r->status;
+        if (!status) {
+            recs = m->recs + r->record_index;
+            count = r->record_count;
+            needed = r->records_needed;
+        }
+    }
+    m->lines++;
+    if (status)
+        m->failed++;
+
+    if (m->format == OUTPUT_BINARY) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.line = e->line;
+        hdr.offset = e->offset;
+        hdr.length = e->length;
+        hdr.status = status;
+        hdr.record_count = count;
+        hdr.records_needed = needed;
+        hdr.record_size = sizeof(*recs);
+        if (fwrite(&hdr, sizeof(hdr), 1, stdout) != 1 ||
+            (count && fwrite(recs, sizeof(*recs), count, stdout) != count))
+            return -EIO;
+        return 0;
+    }
+
+    printf("{\"line\":%llu", (unsigned long long)e->line);
+    if (e->path) {
+        printf(",\"path\":");
+        json_string(e->path);
+        printf(",\"offset\":%lld,\"length\":%llu", (long long)e->offset,
+               (unsigned long long)e->length);
+    }
+    printf(",\"status\":%d", status);
+    if (status) {
+        printf(",\"error\":");
+        json_string(e->path ? strerror(-status) : "malformed line");
+    } else {
+        printf(",\"records_needed\":%u", needed);
+        if (count < needed)
+            printf(",\"truncated\":true");
+        printf(",\"records\":[");
+        for (i = 0; i < count; i++) {
+            if (i)
+                putchar(',');
+            json_record(&recs[i], m->flags);
+        }
+        putchar(']');
+    }
+    printf("}\n");
+    return ferror(stdout) ? -EIO : 0;
+}
+
+/*
+ * Query and print every pending line. A segment whose records did not
+ * fit behind the ones before it goes again at the head of a new
+ * batch, so only a segment that alone overflows the record buffer
+ * comes back truncated.
+ */
+static int manifest_flush(struct manifest *m)
+{
+    struct file_to_pcie_query_batch qb;
+    unsigned int start = 0, i, n;
+    int seg[MANIFEST_BATCH];
+    int ret;
+
+    while (start < m->nr_ents) {
+        n = 0;
+        for (i = start; i < m->nr_ents; i++) {
+            seg[i] = -1;
+            if (m->ents[i].fd < 0)
+                continue;
+            m->segs[n].fd = m->ents[i].fd;
+            m->segs[n].flags = 0;
+            m->segs[n].offset = m->ents[i].offset;
+            m->segs[n].length = m->ents[i].length;
+            seg[i] = n++;
+        }
+
+        memset(&qb, 0, sizeof(qb));
+        if (n) {
+            qb.segments = (uintptr_t)m->segs;
+            qb.results = (uintptr_t)m->res;
+            qb.records = (uintptr_t)m->recs;
+            qb.count = n;
+            qb.record_size = sizeof(m->recs[0]);
+            qb.record_capacity = MANIFEST_RECORDS;
+            qb.flags = m->flags;
+            if (ioctl(m->dev_fd, FILE_TO_PCIE_IOCTL_QUERY_BATCH, &qb) < 0)
+                return -errno;
+            if (!qb.completed)
+                return -EIO;
+        }
+
+        for (i = start; i < m->nr_ents; i++) {
+            if (seg[i] < 0) {
+                ret = manifest_emit(m, &m->ents[i], NULL);
+            } else {
+                if ((uint32_t)seg[i] >= qb.completed ||
+                    (seg[i] && !m->res[seg[i]].status &&
+                     m->res[seg[i]].record_count <
+                     m->res[seg[i]].records_needed))
+                    break;
+                ret = manifest_emit(m, &m->ents[i], &m->res[seg[i]]);
+            }
+            if (ret < 0)
+                return ret;
+            free(m->ents[i].path);
+            m->ents[i].path = NULL;
+        }
+        start = i;
+    }
+
+    m->nr_ents = 0;
+    return 0;
+}
+
+/*
+ * Set *fd for path, opening it on first use (-errno if that fails).
+ * When all slots are taken, the pending lines are flushed before the
+ * least recently used file is closed, since they may still refer to
+ * it. Returns 0, or negative error code if the flush failed
+ */
+static int manifest_open(struct manifest *m, const char *path, int *fd)
+{
+    struct manifest_file *f;
+    unsigned int i, lru = 0;
+    int ret;
+
+    if (m->nr_files && !strcmp(m->files[m->last_file].path, path)) {
+        f = &m->files[m->last_file];
+        f->used = ++m->clock;
+        *fd = f->fd;
+        return 0;
+    }
+    for (i = 0; i < m->nr_files; i++) {
+        if (!strcmp(m->files[i].path, path)) {
+            m->files[i].used = ++m->clock;
+            m->last_file = i;
+            *fd = m->files[i].fd;
+            return 0;
+        }
+    }
+
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        *fd = -errno;
+        return 0;
+    }
+
+    if (m->nr_files == MANIFEST_FILES) {
+        ret = manifest_flush(m);
+        if (ret < 0) {
+            close(*fd);
+            return ret;
+        }
+        for (i = 1; i < m->nr_files; i++)
+            if (m->files[i].used < m->files[lru].used)
+                lru = i;
+        close(m->files[lru].fd);
+        free(m->files[lru].path);
+        i = lru;
+    } else {
+        i = m->nr_files++;
+    }
+
+    f = &m->files[i];
+    f->path = strdup(path);
+    if (!f->path) {
+        close(*fd);
+        m->files[i] = m->files[--m->nr_files];
+        return -ENOMEM;
+    }
+    f->fd = *fd;
+    f->used = ++m->clock;
+    m->last_file = i;
+    return 0;
+}
+
+/*
+ * Split "path offset length": the last two fields are numbers, so
+ * paths may contain spaces
+ */
+static int parse_manifest_line(char *line, char **path, int64_t *offset,
+                               uint64_t *length)
+{
+    char *end = line + strlen(line);
+    char *field[2];
+    char *p;
+    int i;
+
+    for (i = 1; i >= 0; i--) {
+        while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+            *--end = '\0';
+        p = end;
+        while (p > line && p[-1] != ' ' && p[-1] != '\t')
+            p--;
+        if (p == end || p == line)
+            return -EINVAL;
+        field[i] = p;
+        end = p;
+    }
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+
+    errno = 0;
+    *offset = strtoll(field[0], &p, 0);
+    if (errno || *p || *offset < 0)
+        return -EINVAL;
+    *length = strtoull(field[1], &p, 0);
+    if (errno || *p || !*length || field[1][0] == '-')
+        return -EINVAL;
+    *path = line;
+    return 0;
+}
+
+static int run_manifest(const char *manifest, int format, uint32_t flags)
+{
+    struct manifest *m;
+    struct manifest_entry *e;
+    FILE *in = stdin;
+    char *line = NULL, *path, *p;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t lineno = 0;
+    int64_t offset;
+    uint64_t length;
+    unsigned int i;
+    int fd, ret = 0;
+
+    m = calloc(1, sizeof(*m));
+    if (!m)
+        return -ENOMEM;
+    m->format = format;
+    m->flags = flags;
+
+    if (strcmp(manifest, "-")) {
+        in = fopen(manifest, "r");
+        if (!in) {
+            ret = -errno;
+            perror("Failed to open manifest");
+            free(m);
+            return ret;
+        }
+    }
+
+    m->dev_fd = open(DEVICE_PATH, O_RDWR);
+    if (m->dev_fd < 0) {
+        ret = -errno;
+        perror("Failed to open device");
+        if (in != stdin)
+            fclose(in);
+        free(m);
+        return ret;
+    }
+
+    while ((len = getline(&line, &cap, in)) >= 0) {
+        lineno++;
+        if (len && line[len - 1] == '\n')
+            line[--len] = '\0';
+        for (p = line; *p == ' ' || *p == '\t'; p++)
+            ;
+        if (!*p || *p == '#')
+            continue;
+
+        fd = -EINVAL;
+        path = NULL;
+        if (!parse_manifest_line(p, &path, &offset, &length)) {
+            /* Before taking a slot: opening may flush the batch */
+            ret = manifest_open(m, path, &fd);
+            if (ret < 0)
+                goto out;
+        }
+
+        e = &m->ents[m->nr_ents++];
+        memset(e, 0, sizeof(*e));
+        e->line = lineno;
+        e->fd = fd < 0 ? -1 : fd;
+        e->status = fd < 0 ? fd : 0;
+        if (path) {
+            e->path = strdup(path);
+            if (!e->path) {
+                ret = -ENOMEM;
+                goto out;
+            }
+            e->offset = offset;
+            e->length = length;
+        }
+
+        if (m->nr_ents == MANIFEST_BATCH) {
+            ret = manifest_flush(m);
+            if (ret < 0)
+                goto out;
+        }
+    }
+    if (ferror(in)) {
+        ret = -EIO;
+        goto out;
+    }
+    ret = manifest_flush(m);
+
+out:
+    if (ret < 0)
+        fprintf(stderr, "manifest: %s\n", strerror(-ret));
+    else
+        fprintf(stderr, "manifest: %llu line(s), %llu failed\n",
+                (unsigned long long)m->lines,
+                (unsigned long long)m->failed);
+    if (ret >= 0 && m->failed)
+        ret = 1;
+    for (i = 0; i < m->nr_ents; i++)
+        free(m->ents[i].path);
+    for (i = 0; i < m->nr_files; i++) {
+        close(m->files[i].fd);
+        free(m->files[i].path);
+    }
+    close(m->dev_fd);
+    if (in != stdin)
+        fclose(in);
+    free(line);
+    free(m);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     int dev_fd, file_fd;
     struct file_to_pcie_request req;
     long offset;
     size_t length;
+    int show_extents = 0;
+    int show_zones = 0;
+    int show_compact = 0;
+    uint32_t query_flags = 0;
+    int use_uring = 0;
+    const char *p2p_target = NULL;
+    int show_dir = 0;
+    int watch = 0;
+    int group = 0;
+    uint32_t group_level = 0;
+    const char *manifest = NULL;
+    int format = OUTPUT_JSON;
+    int opt;
     int ret;
 
-    if (argc != 4) {
+    while ((opt = getopt(argc, argv, "clqLmETurdwezp:g:M:o:")) != -1) {
+        switch (opt) {
+        case 'c':
+            show_compact = 1;
+            break;
+        case 'l':
+            show_compact = 1;
+            query_flags |= FILE_TO_PCIE_QUERY_F_LINK;
+            break;
+        case 'q':
+            show_compact = 1;
+            query_flags |= FILE_TO_PCIE_QUERY_F_LIMITS;
+            break;
+        case 'L':
+            show_compact = 1;
+            query_flags |= FILE_TO_PCIE_QUERY_F_LOAD;
+            break;
+        case 'E':
+            show_compact = 1;
+            query_flags |= FILE_TO_PCIE_QUERY_F_ENDPOINT;
+            break;
+        case 'T':
+            show_compact = 1;
+            query_flags |= FILE_TO_PCIE_QUERY_F_TOPOLOGY;
+            break;
+        case 'm':
+            show_compact = 1;
+            query_flags |= FILE_TO_PCIE_QUERY_F_CACHE;
+            break;
+        case 'u':
+            show_compact = 1;
+            use_uring = 1;
+            break;
+        case 'r':
+            show_compact = 1;
+            query_flags |= FILE_TO_PCIE_QUERY_F_FIXED;
+            break;
+        case 'e':
+            show_extents = 1;
+            break;
+        case 'z':
+            show_extents = 1;
+            show_zones = 1;
+            break;
+        case 'p':
+            p2p_target = optarg;
+            break;
+        case 'd':
+            show_dir = 1;
+            break;
+        case 'w':
+            watch = 1;
+            break;
+        case 'g':
+            if (parse_group_level(optarg, &group_level) < 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            group = 1;
+            break;
+        case 'M':
+            manifest = optarg;
+            break;
+        case 'o':
+            if (!strcmp(optarg, "json")) {
+                format = OUTPUT_JSON;
+            } else if (!strcmp(optarg, "binary")) {
+                format = OUTPUT_BINARY;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (watch) {
+        if (argc - optind != 0) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        dev_fd = open(DEVICE_PATH, O_RDONLY);
+        if (dev_fd < 0) {
+            perror("Failed to open device");
+            return 1;
+        }
+        ret = watch_generation(dev_fd);
+        close(dev_fd);
+        return ret < 0;
+    }
+
+    if (manifest) {
+        /* Only what a batched query takes */
+        if (argc - optind != 0 || use_uring || show_extents ||
+            p2p_target || (query_flags & ~(FILE_TO_PCIE_QUERY_F_LINK |
+                                           FILE_TO_PCIE_QUERY_F_LIMITS |
+                                           FILE_TO_PCIE_QUERY_F_LOAD |
+                                           FILE_TO_PCIE_QUERY_F_ENDPOINT |
+                                           FILE_TO_PCIE_QUERY_F_TOPOLOGY))) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return run_manifest(manifest, format, query_flags) != 0;
+    }
+
+    if (group) {
+        if (argc - optind < 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        dev_fd = open(DEVICE_PATH, O_RDWR);
+        if (dev_fd < 0) {
+            perror("Failed to open device");
+            return 1;
+        }
+        ret = print_groups(dev_fd, group_level, argv + optind,
+                           argc - optind);
+        close(dev_fd);
+        return ret < 0;
+    }
+
+    if (show_dir) {
+        if (argc - optind != 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        dev_fd = open(DEVICE_PATH, O_RDWR);
+        if (dev_fd < 0) {
+            perror("Failed to open device");
+            return 1;
+        }
+        ret = print_dir(dev_fd, argv[optind]);
+        close(dev_fd);
+        return ret < 0;
+    }
+
+    if (argc - optind != 3) {
         print_usage(argv[0]);
         return 1;
     }
 
     /* Parse arguments */
-    offset = strtol(argv[2], NULL, 0);
-    length = strtoul(argv[3], NULL, 0);
+    offset = strtol(argv[optind + 1], NULL, 0);
+    length = strtoul(argv[optind + 2], NULL, 0);
 
     if (offset < 0) {
         fprintf(stderr, "Error: offset must be >= 0\n");
@@ -101,7 +1319,7 @@ int main(int argc, char *argv[])
     }
 
     /* Open the target file */
-    file_fd = open(argv[1], O_RDONLY);
+    file_fd = open(argv[optind], O_RDONLY);
     if (file_fd < 0) {
         perror("Failed to open target file");
         close(dev_fd);
@@ -115,7 +1333,7 @@ int main(int argc, char *argv[])
     req.length = length;
 
     printf("Querying PCIe devices for:\n");
-    printf("  File: %s\n", argv[1]);
+    printf("  File: %s\n", argv[optind]);
     printf("  Offset: %ld\n", offset);
     printf("  Length: %zu\n", length);
     printf("\n");
@@ -159,6 +1377,27 @@ int main(int argc, char *argv[])
         print_pcie_devices(&req);
     }
 
+    if (show_compact && print_compact(dev_fd, file_fd, offset, length,
+                                      query_flags, use_uring) < 0) {
+        close(file_fd);
+        close(dev_fd);
+        return 1;
+    }
+
+    if (show_extents &&
+        print_extents(dev_fd, file_fd, offset, length, show_zones) < 0) {
+        close(file_fd);
+        close(dev_fd);
+        return 1;
+    }
+
+    if (p2p_target &&
+        print_p2p(dev_fd, file_fd, offset, length, p2p_target) < 0) {
+        close(file_fd);
+        close(dev_fd);
+        return 1;
+    }
+
     close(file_fd);
     close(dev_fd);
 
@@ -0,0 +1,153 @@
+/*
+ * uring.h - Minimal io_uring helpers for the file_to_pcie user tools
+ *
+ * Just enough of a submission/completion ring on top of the raw
+ * syscalls to avoid a liburing dependency: one ring per thread,
+ * single-mmap kernels (5.4+), no SQPOLL.
+ */
+
+#ifndef FILE_TO_PCIE_URING_H
+#define FILE_TO_PCIE_URING_H
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned int entries;
+    /* Submission ring */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending;    /* SQEs queued since the last submit */
+    /* Completion ring */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* Mappings */
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+static inline int uring_init(struct uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *ring;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -errno;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        return -ENOSYS;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->ring == MAP_FAILED)
+        goto err_close;
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto err_unmap;
+
+    ring = r->ring;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(ring + p.sq_off.array);
+    r->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+
+err_unmap:
+    munmap(r->ring, r->ring_size);
+err_close:
+    close(r->fd);
+    return -ENOMEM;
+}
+
+static inline void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->ring, r->ring_size);
+    close(r->fd);
+}
+
+/*
+ * Next free SQE, zeroed, or NULL if the submission ring is full
+ */
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *r->sq_tail + r->sq_pending;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= r->entries)
+        return NULL;
+
+    sqe = &r->sqes[tail & *r->sq_mask];
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    r->sq_pending++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * Submit queued SQEs and wait for at least wait_nr completions
+ * Returns the number of SQEs submitted, or a negative errno
+ */
+static inline int uring_submit_and_wait(struct uring *r, unsigned int wait_nr)
+{
+    unsigned int n = r->sq_pending;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->sq_pending = 0;
+
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, n, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/*
+ * Oldest unconsumed CQE, or NULL if there is none
+ */
+static inline struct io_uring_cqe *uring_peek_cqe(struct uring *r)
+{
+    unsigned int head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* FILE_TO_PCIE_URING_H */